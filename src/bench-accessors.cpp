@@ -0,0 +1,135 @@
+/*
+    Accessor throughput, hand written callbacks against binding.h.
+    Usage: ./out/bench-accessors [iterations]
+
+    Both classes hold the same two ints. HandPoint keeps the pointer in an
+    External and has the callbacks the way Point used to; Point uses the
+    generated ones. The same script loop reads and writes x and y on each.
+*/
+
+#include <iostream>
+#include "include/v8.h"
+#include "include/libplatform/libplatform.h"
+#include "common/runtime.h"
+
+using namespace v8;
+using namespace std;
+
+class HandPoint {
+    public:
+        HandPoint(int x, int y) : x_(x), y_(y) { }
+        int x_, y_;
+};
+
+static void HandPointConstructor(const FunctionCallbackInfo<Value>& args)
+{
+    HandleScope scope(args.GetIsolate());
+    Isolate* isolate = args.GetIsolate();
+
+    HandPoint* point = newWrapped<HandPoint>(isolate, args.This(),
+                                             args[0]->Int32Value(), args[1]->Int32Value());
+    args.This()->SetInternalField(0, External::New(isolate, point));
+}
+
+static void GetHandPointX(Local<String> property,
+             const PropertyCallbackInfo<Value>& info) {
+    Local<Object> self = info.Holder();
+    Local<External> wrap = Local<External>::Cast(self->GetInternalField(0));
+    info.GetReturnValue().Set(static_cast<HandPoint*>(wrap->Value())->x_);
+}
+
+static void SetHandPointX(Local<String> property, Local<Value> value,
+             const PropertyCallbackInfo<void>& info) {
+    Local<Object> self = info.Holder();
+    Local<External> wrap = Local<External>::Cast(self->GetInternalField(0));
+    static_cast<HandPoint*>(wrap->Value())->x_ = value->Int32Value();
+}
+
+static void GetHandPointY(Local<String> property,
+             const PropertyCallbackInfo<Value>& info) {
+    Local<Object> self = info.Holder();
+    Local<External> wrap = Local<External>::Cast(self->GetInternalField(0));
+    info.GetReturnValue().Set(static_cast<HandPoint*>(wrap->Value())->y_);
+}
+
+static void SetHandPointY(Local<String> property, Local<Value> value,
+             const PropertyCallbackInfo<void>& info) {
+    Local<Object> self = info.Holder();
+    Local<External> wrap = Local<External>::Cast(self->GetInternalField(0));
+    static_cast<HandPoint*>(wrap->Value())->y_ = value->Int32Value();
+}
+
+static void exposeHandPoint(Isolate* isolate, Handle<ObjectTemplate> context) {
+    HandleScope scope(isolate);
+
+    Local<FunctionTemplate> point_templ = FunctionTemplate::New(isolate, HandPointConstructor);
+    Local<ObjectTemplate> obj = point_templ->InstanceTemplate();
+    obj->SetInternalFieldCount(1);
+
+    obj->SetAccessor(String::NewFromUtf8(isolate, "x"), GetHandPointX, SetHandPointX);
+    obj->SetAccessor(String::NewFromUtf8(isolate, "y"), GetHandPointY, SetHandPointY);
+
+    context->Set(String::NewFromUtf8(isolate, "HandPoint"), point_templ);
+}
+
+    /* Run the accessor loop on one type, returns nanoseconds per get+set */
+static double timeAccessors(Isolate* isolate, Local<Context> context, const char* type, int iterations)
+{
+    HandleScope handle_scope(isolate);
+    Context::Scope context_scope(context);
+
+    char source[512];
+    snprintf(source, sizeof(source),
+             "(function() {"
+             "  var p = new %s(1, 2);"
+             "  for (var i = 0; i < %d; ++i) { p.x = p.y + 1; p.y = p.x - 1; }"
+             "  return p.x + p.y;"
+             "})", type, iterations);
+
+    Local<Function> loop = Local<Function>::Cast(Script::Compile(String::NewFromUtf8(isolate, source))->Run());
+
+    //One untimed call of the same length first, so the timed one runs on optimized code
+    loop->Call(context->Global(), 0, NULL);
+
+    double start = nowMicros();
+    loop->Call(context->Global(), 0, NULL);
+    double elapsed = nowMicros() - start;
+
+    //Each iteration is two gets and two sets
+    return elapsed * 1000.0 / (iterations * 2.0);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 10000000;
+
+    // Initialize V8.
+    V8::InitializeICU();
+    Platform* platform = platform::CreateDefaultPlatform();
+    V8::InitializePlatform(platform);
+    V8::Initialize();
+
+    Isolate* isolate = createIsolate();
+    {
+        Isolate::Scope isolate_scope(isolate);
+        HandleScope handle_scope(isolate);
+
+        Local<ObjectTemplate> global = createGlobalTemplate(isolate);
+        exposeHandPoint(isolate, global);
+        Local<Context> context = Context::New(isolate, NULL, global);
+
+        double hand = timeAccessors(isolate, context, "HandPoint", iterations);
+        double generated = timeAccessors(isolate, context, "Point", iterations);
+
+        printf("hand written: %.2f ns per get+set\n", hand);
+        printf("generated:    %.2f ns per get+set (%.0f%% of hand written)\n",
+               generated, hand > 0 ? generated * 100.0 / hand : 0.0);
+    }
+
+    // Dispose the isolate and tear down V8.
+    disposeIsolate(isolate);
+    V8::Dispose();
+    V8::ShutdownPlatform();
+    delete platform;
+    return 0;
+}
@@ -0,0 +1,377 @@
+/*
+    Microbenchmarks for the embedding paths the runners use.
+    Usage: ./out/bench [--json] [--samples=N] [--filter=name]
+
+    Every benchmark prints cold (the first sample) and warm percentiles in
+    nanoseconds per operation. --json writes one JSON object per line
+    instead, with the V8 version, so runs can be kept and compared:
+
+        make bench BENCH_ARGS=--json > bench-$(git rev-parse --short HEAD).json
+
+    What print() and game.start() write goes to /dev/null, only the call
+    is measured.
+*/
+
+#include <fcntl.h>
+#include <string>
+#include <vector>
+#include "include/v8.h"
+#include "include/libplatform/libplatform.h"
+#include "common/runtime.h"
+#include "common/contextpool.h"
+#include "common/gameloop.h"
+#include "common/bench.h"
+
+using namespace v8;
+using namespace std;
+
+static bool hasPrefix(const string& arg, const char* prefix)
+{
+    return arg.compare(0, strlen(prefix), prefix) == 0;
+}
+
+    /* Compile source into a function we can call repeatedly */
+static Local<Function> compileFunction(Isolate* isolate, Local<Context> context, const string& source)
+{
+    EscapableHandleScope handle_scope(isolate);
+    Context::Scope context_scope(context);
+
+    Local<Script> script = Script::Compile(String::NewFromUtf8(isolate, source.c_str()));
+    return handle_scope.Escape(Local<Function>::Cast(script->Run()));
+}
+
+    /* A script of roughly `bytes` bytes, made of small functions that are called once */
+static string largeSource(size_t bytes)
+{
+    string source;
+    char line[256];
+    for(int i = 0; source.size() < bytes; ++i) {
+        snprintf(line, sizeof(line),
+                 "function f%d(a, b) { var s = 0; for (var i = 0; i < a; ++i) s += i * b; return s; }\n"
+                 "f%d(3, %d);\n", i, i, i);
+        source += line;
+    }
+    return source + "undefined;\n";
+}
+
+    /* Isolate and context setup, a new one of each per operation */
+static void benchStartup(BenchSuite& suite)
+{
+    suite.Measure("isolate_create", 1, [](int) {
+        Isolate* isolate = createIsolate();
+        disposeIsolate(isolate);
+    });
+
+    Isolate* isolate = createIsolate();
+    {
+        Isolate::Scope isolate_scope(isolate);
+        Game game;
+
+        suite.Measure("context_create", 1, [&](int) {
+            HandleScope handle_scope(isolate);
+            createRuntimeContext(isolate, &game);
+        });
+
+        //What a request waits for with a pool. There is a spare for every
+        //sample, built up front, like the daemon rebuilds them after replying.
+        ContextPool pool(isolate, &game, suite.samples(), 1);
+        pool.Refill();
+        suite.Measure("context_pool_acquire", 1, [&](int) {
+            HandleScope handle_scope(isolate);
+            Local<Context> context = pool.Acquire();
+            pool.Release(context);
+        });
+
+        suite.Measure("context_pool_tenant", 1, [&](int) {
+            HandleScope handle_scope(isolate);
+            Local<Context> context = pool.Acquire("tenant");
+            pool.Release(context, "tenant");
+        });
+    }
+    disposeIsolate(isolate);
+}
+
+    /* Script compile + run through executeString, and the native calls */
+static void benchScripts(BenchSuite& suite, int devNull)
+{
+    Isolate* isolate = createIsolate();
+    {
+        Isolate::Scope isolate_scope(isolate);
+        HandleScope handle_scope(isolate);
+        getOutputBuffer(isolate)->setFd(devNull);
+
+        Game game;
+        Local<Context> context = createRuntimeContext(isolate, &game);
+
+        //A comment with the call number keeps the compilation cache from
+        //answering, so every operation pays for the compile.
+        suite.Measure("execute_small", 10, [&](int call) {
+            char source[128];
+            snprintf(source, sizeof(source), "//%d\nvar a = 1 + 2; undefined;", call);
+            executeString(isolate, context, String::NewFromUtf8(isolate, source));
+        });
+
+        string large = largeSource(256 * 1024);
+        suite.Measure("execute_large", 1, [&](int call) {
+            string source = "//" + to_string(call) + "\n" + large;
+            executeString(isolate, context, String::NewFromUtf8(isolate, source.c_str()));
+        });
+
+        //The same large script from disk, compiled after loading it and
+        //streamed while it is read. One file per call, for the same reason
+        //as the comment above.
+        vector<string> files;
+        for(int i = 0; i < suite.samples() * 2; ++i) {
+            char path[64];
+            snprintf(path, sizeof(path), "/tmp/v8-bench-%d-%d.js", (int)getpid(), i);
+            string source = "//" + to_string(i) + "\n" + large;
+            FILE* f = fopen(path, "wb");
+            if(f == NULL) break;
+            fwrite(source.data(), 1, source.size(), f);
+            fclose(f);
+            files.push_back(path);
+        }
+
+        if(files.size() == (size_t)suite.samples() * 2) {
+            suite.Measure("execute_large_file", 1, [&](int call) {
+                executeScript(isolate, context, files[call]);
+            });
+            suite.Measure("execute_large_streamed", 1, [&](int call) {
+                executeScript(isolate, context, files[suite.samples() + call], NULL, true, NULL, true);
+            });
+        }
+        for(size_t i = 0; i < files.size(); ++i) unlink(files[i].c_str());
+
+        //Bulk data: the same 256k points as a JS literal run as a script, as
+        //JSON through load(), and as two float64 columns through load()
+        const int kRows = 256 * 1024;
+        string literal = "[";
+        for(int i = 0; i < kRows; ++i) {
+            literal += (i ? ",[" : "[") + to_string(i) + "," + to_string(kRows - i) + "]";
+        }
+        literal += "]";
+
+        char jsonPath[64], columnsPath[64];
+        snprintf(jsonPath, sizeof(jsonPath), "/tmp/v8-bench-%d.json", (int)getpid());
+        snprintf(columnsPath, sizeof(columnsPath), "/tmp/v8-bench-%d.cols", (int)getpid());
+
+        FILE* json = fopen(jsonPath, "wb");
+        FILE* columns = fopen(columnsPath, "wb");
+        if(json && columns) {
+            fwrite(literal.data(), 1, literal.size(), json);
+
+            ColumnsHeader header = { { 0 }, 2, 0, kRows };
+            memcpy(header.magic, kColumnsMagic, sizeof(header.magic));
+            ColumnEntry entries[2];
+            memset(entries, 0, sizeof(entries));
+            strcpy(entries[0].name, "x");
+            strcpy(entries[1].name, "y");
+            entries[0].type = entries[1].type = eCOLUMN_FLOAT64;
+            entries[0].offset = 128;
+            entries[1].offset = 128 + kRows * sizeof(double);
+
+            vector<double> xs(kRows), ys(kRows);
+            for(int i = 0; i < kRows; ++i) { xs[i] = i; ys[i] = kRows - i; }
+
+            char pad[128 - sizeof(header) - sizeof(entries)] = { 0 };
+            fwrite(&header, sizeof(header), 1, columns);
+            fwrite(entries, sizeof(entries), 1, columns);
+            fwrite(pad, sizeof(pad), 1, columns);
+            fwrite(&xs[0], sizeof(double), kRows, columns);
+            fwrite(&ys[0], sizeof(double), kRows, columns);
+        }
+        if(json) fclose(json);
+        if(columns) fclose(columns);
+
+        Local<Function> loadFile = compileFunction(isolate, context, "(function(path) { return load(path).length; })");
+        Local<Value> jsonArg = String::NewFromUtf8(isolate, jsonPath);
+        Local<Value> columnsArg = String::NewFromUtf8(isolate, columnsPath);
+
+        suite.Measure("load_data_literal", 1, [&](int call) {
+            string source = "//" + to_string(call) + "\n" + literal + ".length";
+            executeString(isolate, context, String::NewFromUtf8(isolate, source.c_str()));
+        });
+        suite.Measure("load_json", 1, [&](int) {
+            loadFile->Call(context->Global(), 1, &jsonArg);
+        });
+        suite.Measure("load_columns", 1, [&](int) {
+            loadFile->Call(context->Global(), 1, &columnsArg);
+        });
+        unlink(jsonPath);
+        unlink(columnsPath);
+
+        //The native calls run in a script loop, so the number is the
+        //round trip from JS into the callback and back.
+        const int kCalls = 10000;
+        Local<Function> callPrint = compileFunction(isolate, context,
+            "(function(n) { for (var i = 0; i < n; ++i) print('x'); })");
+        Local<Function> callStart = compileFunction(isolate, context,
+            "(function(n) { for (var i = 0; i < n; ++i) game.start(); })");
+        Local<Function> pointGet = compileFunction(isolate, context,
+            "(function(n) { var p = new Point(1, 2), s = 0; for (var i = 0; i < n; ++i) s += p.x; return s; })");
+        Local<Function> pointSet = compileFunction(isolate, context,
+            "(function(n) { var p = new Point(1, 2); for (var i = 0; i < n; ++i) p.x = i; return p.x; })");
+
+        Context::Scope context_scope(context);
+        Local<Value> count = Integer::New(isolate, kCalls);
+
+        struct { const char* name; Local<Function> fn; } loops[] = {
+            { "call_print", callPrint },
+            { "call_game_start", callStart },
+            { "point_get", pointGet },
+            { "point_set", pointSet },
+        };
+
+        for(size_t i = 0; i < sizeof(loops) / sizeof(loops[0]); ++i) {
+            Local<Function> fn = loops[i].fn;
+            suite.Measure(loops[i].name, 1, [&](int) {
+                fn->Call(context->Global(), 1, &count);
+            }, kCalls);
+        }
+
+        //A timer through the event loop: setTimeout, the heap, and the call
+        Local<Function> setTimers = compileFunction(isolate, context,
+            "(function(n) { var f = function() { }; for (var i = 0; i < n; ++i) setTimeout(f, i % 2); })");
+        suite.Measure("timer_set_fire", 1, [&](int) {
+            setTimers->Call(context->Global(), 1, &count);
+            getEventLoop(isolate)->Run();
+        }, kCalls);
+
+        //Wrapping, a new game object from the shared template each time
+        suite.Measure("wrap_game_object", 100, [&](int) {
+            HandleScope scope(isolate);
+            WrapGameObject(isolate, &game);
+        });
+
+        //Bulk wrapping, an array of wrappers over many natives in one call
+        const int kWrapped = 100000;
+        vector<Game*> games(kWrapped, &game);
+        suite.Measure("wrap_natives_100k", 1, [&](int) {
+            HandleScope scope(isolate);
+            wrapNatives(isolate, &games[0], games.size());
+        }, kWrapped);
+
+        //One frame of the game loop over a few thousand script side entities.
+        //Each sample queues its events up front, so they all arrive in its
+        //first frame. The rate is far above what a frame takes, so frames
+        //run back to back and nothing sleeps.
+        const int kFrames = 100;
+        compileFunction(isolate, context,
+            "(function() {"
+            "  var entities = [];"
+            "  for (var i = 0; i < 5000; ++i) entities.push({ x: i, y: 0, vx: 1, vy: 2 });"
+            "  update = function(dt, events) {"
+            "    for (var e = 0; e < entities.length; ++e) {"
+            "      var en = entities[e]; en.x += en.vx * dt; en.y += en.vy * dt;"
+            "    }"
+            "    for (var i = 0; i < events.length; i += 4) entities[events[i + 2] | 0].vx = events[i + 3];"
+            "  };"
+            "})")->Call(context->Global(), 0, NULL);
+        {
+            GameLoop loop(isolate, context, &game, 1e6);
+            suite.Measure("game_frame", 1, [&](int) {
+                for(int i = 0; i < kFrames * 8; ++i) game.QueueEvent(1, i % 5000, 1);
+                loop.Run(kFrames);
+            }, kFrames);
+        }
+
+        flushOutput(isolate);
+    }
+    disposeIsolate(isolate);
+}
+
+    /* Names and strings at the binding boundary, each old path next to
+       the one that replaced it, see stringconv.h */
+static void benchStrings(BenchSuite& suite)
+{
+    Isolate* isolate = createIsolate();
+    {
+        Isolate::Scope isolate_scope(isolate);
+        HandleScope handle_scope(isolate);
+
+        Game game;
+        Local<Context> context = createRuntimeContext(isolate, &game);
+        Context::Scope context_scope(context);
+
+        //Setup: every template and name the runtime global needs
+        suite.Measure("global_template_build", 1, [&](int) {
+            HandleScope scope(isolate);
+            createGlobalTemplate(isolate);
+        });
+
+        suite.Measure("name_new_utf8", 1000, [&](int) {
+            HandleScope scope(isolate);
+            String::NewFromUtf8(isolate, "externalBytes");
+        });
+        suite.Measure("name_interned", 1000, [&](int) {
+            HandleScope scope(isolate);
+            internName(isolate, "externalBytes");
+        });
+
+        string text(4096, 'a');
+        for(size_t i = 0; i < text.size(); i += 64) text[i] = ' ';
+
+        suite.Measure("string_new_utf8_4k", 100, [&](int) {
+            HandleScope scope(isolate);
+            String::NewFromUtf8(isolate, text.data(), String::kNormalString, (int)text.size());
+        });
+        suite.Measure("string_new_ascii_4k", 100, [&](int) {
+            HandleScope scope(isolate);
+            newString(isolate, text);
+        });
+
+        Local<String> jsText = newString(isolate, text);
+        suite.Measure("string_utf8value_4k", 100, [&](int) {
+            String::Utf8Value utf8(jsText);
+        });
+        suite.Measure("string_to_std_4k", 100, [&](int) {
+            toStdString(jsText);
+        });
+
+        //A callback that builds an object of named properties
+        const int kCalls = 10000;
+        Local<Function> callStats = compileFunction(isolate, context,
+            "(function(n) { var s = 0; for (var i = 0; i < n; ++i) s += nativeStats().live; return s; })");
+        Local<Value> count = Integer::New(isolate, kCalls);
+        suite.Measure("call_native_stats", 1, [&](int) {
+            callStats->Call(context->Global(), 1, &count);
+        }, kCalls);
+    }
+    disposeIsolate(isolate);
+}
+
+int main(int argc, char **argv)
+{
+    BenchSuite suite;
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if(arg == "--json") suite.setJson(true);
+        else if(hasPrefix(arg, "--samples=")) suite.setSamples(atoi(arg.c_str() + 10));
+        else if(hasPrefix(arg, "--filter=")) suite.setFilter(arg.substr(9));
+        else {
+            fprintf(stderr, "Usage: %s [--json] [--samples=N] [--filter=name]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Initialize V8.
+    V8::InitializeICU();
+    Platform* platform = platform::CreateDefaultPlatform();
+    V8::InitializePlatform(platform);
+    V8::Initialize();
+    streamingPlatform() = platform;
+
+    int devNull = open("/dev/null", O_WRONLY);
+
+    benchStartup(suite);
+    benchScripts(suite, devNull);
+    benchStrings(suite);
+
+    close(devNull);
+
+    // Tear down V8.
+    V8::Dispose();
+    V8::ShutdownPlatform();
+    delete platform;
+    return 0;
+}
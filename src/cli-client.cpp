@@ -0,0 +1,229 @@
+/*
+    Run scripts on a cli-script daemon instead of starting V8 each time.
+    Usage: ./out/cli-client [options] anyfile.js [more.js ...]
+           ./out/cli-client [options] --eval='print(1 + 2)'
+
+    Start the daemon first:  ./out/cli-script --daemon [--jobs=N] &
+    The output is the same as running cli-script directly, so callers only
+    swap the binary name. The exit status is the failed script's
+    eScriptExecResult, or 0 when everything ran.
+
+    Options:
+        --socket=PATH       Daemon socket (default $XDG_RUNTIME_DIR/cli-script.sock,
+                            or /tmp/cli-script-<uid>/cli-script.sock)
+        --eval=SOURCE       Run SOURCE instead of a file
+        --tenant=NAME       Run in NAME's own context, kept between requests
+                            when the daemon has a --context-pool
+        --latency           Print the round trip of each request to stderr
+        --cold=CLI_SCRIPT   Also time a cold launch of the given cli-script
+                            binary on the same file, implies --latency
+
+    With --latency and more than one request, the median round trip (and
+    median cold launch, with --cold) over all of them is printed last.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common/frames.h"
+
+using namespace std;
+
+struct ClientOptions {
+    ClientOptions() : socketPath(defaultDaemonSocket()), latency(false) { }
+
+    string socketPath;
+    bool latency;
+    string coldBinary;
+    string tenant;
+    vector<string> sources;     //--eval
+    vector<string> scripts;
+};
+
+static bool hasPrefix(const char* arg, const char* prefix)
+{
+    return strncmp(arg, prefix, strlen(prefix)) == 0;
+}
+
+static double nowMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static bool parseOptions(int argc, char **argv, ClientOptions &options)
+{
+    for(int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+
+        if(hasPrefix(arg, "--socket=")) {
+            options.socketPath = arg + strlen("--socket=");
+        } else if(hasPrefix(arg, "--eval=")) {
+            options.sources.push_back(arg + strlen("--eval="));
+        } else if(hasPrefix(arg, "--tenant=")) {
+            options.tenant = arg + strlen("--tenant=");
+        } else if(strcmp(arg, "--latency") == 0) {
+            options.latency = true;
+        } else if(hasPrefix(arg, "--cold=")) {
+            options.coldBinary = arg + strlen("--cold=");
+            options.latency = true;
+        } else if(hasPrefix(arg, "--")) {
+            printf("Unknown option %s\n", arg);
+            return false;
+        } else {
+            options.scripts.push_back(arg);
+        }
+    }
+
+    return !options.scripts.empty() || !options.sources.empty();
+}
+
+static int connectDaemon(const string& socketPath)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "No cli-script daemon on %s, start one with: cli-script --daemon\n", socketPath.c_str());
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+    /* Send one request and copy its output to stdout. Returns the status,
+       or -1 if the daemon went away. */
+static int request(int fd, char type, const string& payload, ResultFrame* result)
+{
+    if(!writeFrame(fd, type, payload.data(), (uint32_t)payload.size())) return -1;
+
+    char frameType;
+    string frame;
+    while(readFrame(fd, &frameType, &frame)) {
+        if(frameType == eFRAME_OUTPUT) {
+            writeFully(STDOUT_FILENO, frame.data(), frame.size());
+        } else if(frameType == eFRAME_RESULT && frame.size() == sizeof(ResultFrame)) {
+            memcpy(result, frame.data(), sizeof(ResultFrame));
+            return result->status;
+        } else {
+            break;
+        }
+    }
+    return -1;
+}
+
+    /* How long a fresh cli-script process takes on the same file, output discarded */
+static double coldLaunch(const string& binary, const string& script)
+{
+    double start = nowMicros();
+
+    pid_t pid = fork();
+    if(pid == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        execl(binary.c_str(), binary.c_str(), script.c_str(), (char*)NULL);
+        _exit(127);
+    }
+
+    int status;
+    if(pid < 0 || waitpid(pid, &status, 0) < 0) return -1;
+    return nowMicros() - start;
+}
+
+static double median(vector<double> times)
+{
+    if(times.empty()) return -1;
+    sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+int main(int argc, char **argv)
+{
+    ClientOptions options;
+    if(!parseOptions(argc, argv, options)) {
+        printf("Usage: [options] <scriptname.js> [more.js ...] \n Run scripts on a cli-script daemon. The options are listed at the top of cli-client.cpp\n");
+        return 1;
+    }
+
+    int fd = connectDaemon(options.socketPath);
+    if(fd < 0) return 1;
+
+    if(!options.tenant.empty() &&
+       !writeFrame(fd, eFRAME_TENANT, options.tenant.data(), (uint32_t)options.tenant.size())) {
+        fprintf(stderr, "Lost the connection to the daemon\n");
+        return 1;
+    }
+
+    //Sources first, then files, each as its own request on one connection
+    vector<pair<char, string> > requests;
+    for(size_t i = 0; i < options.sources.size(); ++i) {
+        requests.push_back(make_pair((char)eFRAME_SOURCE, options.sources[i]));
+    }
+    for(size_t i = 0; i < options.scripts.size(); ++i) {
+        //The daemon has its own working directory
+        char resolved[PATH_MAX];
+        string path = realpath(options.scripts[i].c_str(), resolved) ? resolved : options.scripts[i];
+        requests.push_back(make_pair((char)eFRAME_FILE, path));
+    }
+
+    vector<double> roundTrips, colds;
+
+    int exitStatus = 0;
+    for(size_t i = 0; i < requests.size(); ++i) {
+        ResultFrame result;
+        double start = nowMicros();
+        int status = request(fd, requests[i].first, requests[i].second, &result);
+        double roundTrip = nowMicros() - start;
+
+        if(status < 0) {
+            fprintf(stderr, "Lost the connection to the daemon\n");
+            exitStatus = 1;
+            break;
+        }
+        if(status != 0 && exitStatus == 0) exitStatus = status;
+
+        if(options.latency) {
+            const char* name = requests[i].first == eFRAME_FILE ? requests[i].second.c_str() : "<eval>";
+            fprintf(stderr, "%s: %.0fus round trip, %uus in the daemon", name, roundTrip, result.micros);
+            roundTrips.push_back(roundTrip);
+
+            if(!options.coldBinary.empty() && requests[i].first == eFRAME_FILE) {
+                double cold = coldLaunch(options.coldBinary, requests[i].second);
+                if(cold >= 0) {
+                    fprintf(stderr, ", cold launch %.0fus (%.1fx)", cold, cold / roundTrip);
+                    colds.push_back(cold);
+                }
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+
+    if(roundTrips.size() > 1) {
+        double warm = median(roundTrips);
+        fprintf(stderr, "latency: %d requests, median round trip %.0fus", (int)roundTrips.size(), warm);
+        if(!colds.empty()) {
+            double cold = median(colds);
+            fprintf(stderr, ", cold launch %.0fus (%.1fx)", cold, cold / warm);
+        }
+        fprintf(stderr, "\n");
+    }
+
+    close(fd);
+    return exitStatus;
+}
@@ -1,59 +1,415 @@
 /*
     Just run any file passed from args
-    Usage: ./out/cli-script anyfile.js
+    Usage: ./out/cli-script [options] anyfile.js
+           ./out/cli-script [options] a.js b.js ... | --manifest=FILE
+           ./out/cli-script --daemon[=SOCKET] [--jobs=N] [options]
+
+    Given more than one script (without --jobs), the scripts run one after
+    the other on one isolate, each in a fresh context, with the next file
+    parsed while the current one runs. A summary of every file's result,
+    error and times goes to stderr at the end, and the exit status is 1 if
+    any of them failed. See batch.h. With --jobs the exit status is the same.
+
+    Options:
+        --code-cache            Reuse compiled code from earlier runs
+        --no-code-cache         Always compile from source (default)
+        --code-cache-dir=DIR    Where cache entries live (default .v8-cache)
+        --snapshot=FILE         Boot from a blob written by snapshot-builder
+        --startup-time          Print how long each startup step took
+        --manifest=FILE         Add the scripts listed in FILE, one per line
+        --jobs=N                Run all the given scripts on a pool of N
+                                isolates, one per thread (0 = one per CPU
+                                in the process's affinity mask)
+        --copy-source           Read scripts into memory instead of mapping them
+        --microtasks=task|turn  Run promise reactions after every timer or I/O
+                                callback (default), or once per loop turn
+        --shared-memory         sharedBuffer() returns a SharedArrayBuffer, and
+                                Atomics is available, for scripts on several
+                                isolates (--jobs) working on the same memory
+        --module                Run the script as the entry module of a program
+                                split over files with require(), prefetching
+                                and parsing its imports in parallel first
+        --stream                Parse the script on a background thread while
+                                it is read, for large bundles
+        --game[=HZ]             After the script, call its update(dt, events) at
+                                a fixed HZ (default 60) until game.stop(), then
+                                print frame time stats, see gameloop.h
+        --frames=N              With --game, stop after N frames
+        --idle-gc               Give the time before the next frame or timer to
+                                the garbage collector, and pass memory pressure
+                                from the cgroup or /proc on to V8, see gcschedule.h
+        --gc-stats              Print GC pauses inside frames versus in idle time
+        --timeout=MS            Stop a script (and then its event loop) after
+                                MS milliseconds of wall clock time
+        --cpu-limit=MS          Stop a script after MS milliseconds of CPU time
+        --heap-limit=MB         Stop a script once its isolate uses more than
+                                MB megabytes of heap
+        --load-stats            Print source load time and peak RSS
+        --line-buffered         Write every print() straight away
+        --batched-output        Collect print() output and write it in batches
+                                (default unless stdout is a terminal)
+        --native-stats          Print live/pooled/freed native object counts
+        --cpu-profile[=FILE]    Sample the script with V8's CPU profiler and
+                                write FILE (default cli-script.cpuprofile) for
+                                DevTools, plus collapsed stacks next to it
+        --cpu-profile-interval=US
+                                Sampling interval in microseconds
+        --stats[=FILE]          Write compile/run times, GC pauses and heap
+                                numbers for each script as JSON lines
+                                (to stderr without a FILE)
+        --daemon[=SOCKET]       Stay resident with warm isolates and run what
+                                cli-client sends (default socket in frames.h),
+                                --jobs=N sets how many isolates serve requests
+        --context-pool=N        In the daemon, keep N contexts built ahead of
+                                time per isolate, and the contexts of up to N
+                                named tenants (cli-client --tenant=NAME)
 */
 
 #include <iostream>
+#include <string.h>
+#include <sys/resource.h>
 #include "include/v8.h"
 #include "include/libplatform/libplatform.h"
-#include "common/common.h"
+#include "common/runtime.h"
+#include "common/isolatepool.h"
+#include "common/daemon.h"
+#include "common/profiler.h"
+#include "common/gameloop.h"
+#include "common/batch.h"
 using namespace v8;
 using namespace std;
 
-int main(int argc, char **argv) 
+struct CliOptions {
+    CliOptions() : useCodeCache(false), codeCacheDir(".v8-cache"), startupTime(false), jobs(-1),
+                   mapSource(true), loadStats(false), nativeStats(false), daemon(false),
+                   contextPool(0), stream(false), stats(false),
+                   cpuProfileInterval(0), gameHz(0), frames(0), sharedMemory(false), module(false) { }
+
+    bool useCodeCache;
+    string codeCacheDir;
+    string snapshot;
+    bool startupTime;
+    int jobs;   //-1 runs a single script on the main thread
+    bool mapSource;
+    bool loadStats;
+    bool nativeStats;
+    bool daemon;
+    string daemonSocket;
+    int contextPool;
+    bool stream;
+    bool stats;
+    string statsFile;
+    string cpuProfile;  //empty when not profiling
+    int cpuProfileInterval;
+    double gameHz;      //0 when there is no frame loop
+    uint64_t frames;
+    bool sharedMemory;
+    bool module;
+    vector<string> scripts;
+};
+
+static bool hasPrefix(const char* arg, const char* prefix)
 {
-    // Initialize V8.
-    V8::InitializeICU();
-    Platform* platform = platform::CreateDefaultPlatform();
-    V8::InitializePlatform(platform);
-    V8::Initialize();
+    return strncmp(arg, prefix, strlen(prefix)) == 0;
+}
 
+static bool parseOptions(int argc, char **argv, CliOptions &options)
+{
+    for(int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+
+        if(strcmp(arg, "--code-cache") == 0) {
+            options.useCodeCache = true;
+        } else if(strcmp(arg, "--no-code-cache") == 0) {
+            options.useCodeCache = false;
+        } else if(hasPrefix(arg, "--code-cache-dir=")) {
+            options.codeCacheDir = arg + strlen("--code-cache-dir=");
+        } else if(hasPrefix(arg, "--snapshot=")) {
+            options.snapshot = arg + strlen("--snapshot=");
+        } else if(strcmp(arg, "--startup-time") == 0) {
+            options.startupTime = true;
+        } else if(hasPrefix(arg, "--manifest=")) {
+            if(!readManifest(arg + strlen("--manifest="), &options.scripts)) {
+                printf("Could not read %s\n", arg + strlen("--manifest="));
+                return false;
+            }
+        } else if(hasPrefix(arg, "--jobs=")) {
+            options.jobs = atoi(arg + strlen("--jobs="));
+        } else if(strcmp(arg, "--copy-source") == 0) {
+            options.mapSource = false;
+        } else if(strcmp(arg, "--microtasks=task") == 0) {
+            EventLoop::defaultPolicy() = EventLoop::eMICROTASKS_AFTER_TASK;
+        } else if(strcmp(arg, "--microtasks=turn") == 0) {
+            EventLoop::defaultPolicy() = EventLoop::eMICROTASKS_AFTER_TURN;
+        } else if(strcmp(arg, "--game") == 0) {
+            options.gameHz = 60;
+        } else if(hasPrefix(arg, "--game=")) {
+            options.gameHz = atof(arg + strlen("--game="));
+        } else if(hasPrefix(arg, "--frames=")) {
+            options.frames = strtoull(arg + strlen("--frames="), NULL, 10);
+        } else if(hasPrefix(arg, "--timeout=")) {
+            ScriptLimits::defaults().wallMillis = atof(arg + strlen("--timeout="));
+        } else if(hasPrefix(arg, "--cpu-limit=")) {
+            ScriptLimits::defaults().cpuMillis = atof(arg + strlen("--cpu-limit="));
+        } else if(hasPrefix(arg, "--heap-limit=")) {
+            ScriptLimits::defaults().heapBytes = (size_t)atoi(arg + strlen("--heap-limit=")) * 1024 * 1024;
+        } else if(strcmp(arg, "--idle-gc") == 0) {
+            GcPolicy::defaults().idleTime = true;
+            GcPolicy::defaults().memoryPressure = true;
+        } else if(strcmp(arg, "--gc-stats") == 0) {
+            GcPolicy::defaults().track = true;
+        } else if(strcmp(arg, "--shared-memory") == 0) {
+            options.sharedMemory = true;
+        } else if(strcmp(arg, "--module") == 0) {
+            options.module = true;
+        } else if(strcmp(arg, "--stream") == 0) {
+            options.stream = true;
+        } else if(strcmp(arg, "--load-stats") == 0) {
+            options.loadStats = true;
+        } else if(strcmp(arg, "--stats") == 0) {
+            options.stats = true;
+        } else if(hasPrefix(arg, "--stats=")) {
+            options.stats = true;
+            options.statsFile = arg + strlen("--stats=");
+        } else if(strcmp(arg, "--cpu-profile") == 0) {
+            options.cpuProfile = "cli-script.cpuprofile";
+        } else if(hasPrefix(arg, "--cpu-profile=")) {
+            options.cpuProfile = arg + strlen("--cpu-profile=");
+        } else if(hasPrefix(arg, "--cpu-profile-interval=")) {
+            options.cpuProfileInterval = atoi(arg + strlen("--cpu-profile-interval="));
+        } else if(strcmp(arg, "--native-stats") == 0) {
+            options.nativeStats = true;
+        } else if(strcmp(arg, "--line-buffered") == 0) {
+            OutputBuffer::defaultMode() = OutputBuffer::eOUTPUT_LINE_BUFFERED;
+        } else if(strcmp(arg, "--batched-output") == 0) {
+            OutputBuffer::defaultMode() = OutputBuffer::eOUTPUT_BATCHED;
+        } else if(strcmp(arg, "--daemon") == 0) {
+            options.daemon = true;
+            options.daemonSocket = defaultDaemonSocket();
+        } else if(hasPrefix(arg, "--daemon=")) {
+            options.daemon = true;
+            options.daemonSocket = arg + strlen("--daemon=");
+        } else if(hasPrefix(arg, "--context-pool=")) {
+            options.contextPool = atoi(arg + strlen("--context-pool="));
+        } else if(hasPrefix(arg, "--")) {
+            printf("Unknown option %s\n", arg);
+            return false;
+        } else {
+            options.scripts.push_back(arg);
+        }
+    }
+
+    return options.daemon || !options.scripts.empty();
+}
+
+    /* The default mode, one script on one isolate on the main thread */
+static void runSingle(const CliOptions &options, StartupData* snapshot, CodeCache &cache,
+                      double startTime, double initTime)
+{
     //Quite simple, these are scope based 'managers'.
     //One protects threading issues, and one manages
     //the creation of JS handles, for clean up.
 
-    Isolate* isolate = Isolate::New();
+    Isolate* isolate = createIsolate(snapshot);
     {
         Isolate::Scope isolate_scope(isolate);
 
         // Create a stack-allocated handle scope.
         HandleScope handle_scope(isolate);
 
-        // Create a new context.
-        Local<Context> context = Context::New(isolate);
+        double isolateTime = nowMicros();
 
-        //A context is a fresh execution context. Take for example, 
+        // Create a new context, with print, Point and game installed.
+        Game game;
+        Local<Context> context = createRuntimeContext(isolate, &game);
+
+        //A context is a fresh execution context. Take for example,
         //a browser tab or frame in Google Chrome. Each of these are
         //a new context, stamped with a global template, and created
-        //on demand. When executing scripts, you can execute them in 
-        //and existing context by using the Context::context_scope 
+        //on demand. When executing scripts, you can execute them in
+        //and existing context by using the Context::context_scope
         //handlers. This 'switches' context for that execution period
         Context::Scope context_scope(context);
 
-        //If we receive an argument, execute the script file
+        if(options.startupTime) {
+            double contextTime = nowMicros();
+            fprintf(stderr, "startup (%s): init %.0fus, isolate %.0fus, context %.0fus, total %.0fus\n",
+                    snapshot ? "snapshot" : "default",
+                    initTime - startTime, isolateTime - initTime,
+                    contextTime - isolateTime, contextTime - startTime);
+        }
 
-        if(argc > 1) {
-            eScriptExecResult r = executeScript(isolate, context, string(argv[1]));
-        } else {
-            printf("Usage: <scriptname.js> \n Execute the javascript file.");
+        //The profile covers the script, its frames and everything its timers do after
+        ScriptProfiler* profiler = NULL;
+        if(!options.cpuProfile.empty()) {
+            profiler = new ScriptProfiler(isolate, options.cpuProfileInterval);
+            profiler->Start();
+        }
+
+        //Execute the script file, through the code cache if asked to
+        SourceLoadInfo load;
+        eScriptExecResult r = options.module
+            ? executeModule(isolate, context, options.scripts[0])
+            : executeScript(isolate, context, options.scripts[0], &cache,
+                            options.mapSource, &load, options.stream);
+
+        //Drive the script's update() at a fixed rate
+        if(options.gameHz > 0 && r == eSCRIPT_ERROR_NONE) {
+            GameLoop loop(isolate, context, &game, options.gameHz);
+            if(loop.Run(options.frames)) {
+                flushOutput(isolate);
+                loop.PrintStats(stderr);
+            }
+        }
+
+        //Keep going until every timer and file operation is done
+        getEventLoop(isolate)->Run();
+
+        if(profiler) {
+            flushOutput(isolate);
+            if(profiler->Stop(options.cpuProfile)) {
+                fprintf(stderr, "cpu profile: %s, %s\n", options.cpuProfile.c_str(),
+                        ScriptProfiler::collapsedPath(options.cpuProfile).c_str());
+            }
+            delete profiler;
+        }
+
+        if(options.loadStats) {
+            //ru_maxrss is in kilobytes on Linux
+            struct rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            fprintf(stderr, "load (%s): %zu bytes, %s, %.0fus, peak rss %ldKB\n",
+                    options.mapSource ? "mapped" : "copied", load.bytes,
+                    load.external ? (load.twoByte ? "external two byte" : "external one byte") : "heap",
+                    load.micros, usage.ru_maxrss);
         }
 
+        if(options.loadStats && options.module) getModuleLoader(isolate)->PrintStats(stderr);
+
+        if(options.nativeStats) getObjectArena(isolate)->PrintCounters(stderr);
+
+        GcScheduler* gc = getGcScheduler(isolate);
+        if(gc) gc->Print(stderr);
+    }
+
+    // Dispose the isolate.
+    disposeIsolate(isolate);
+}
+
+    /* Every script on the isolate pool, results reported in argument order.
+       false if any failed. */
+static bool runPool(const CliOptions &options, StartupData* snapshot, CodeCache &cache)
+{
+    IsolatePool pool(options.jobs, snapshot, &cache, options.mapSource, options.stream, options.module);
+
+    double start = nowMicros();
+    vector<eScriptExecResult> results = pool.Run(options.scripts);
+    double elapsed = nowMicros() - start;
+
+    int failed = 0;
+    for(size_t i = 0; i < results.size(); ++i) {
+        if(results[i] != eSCRIPT_ERROR_NONE) {
+            fprintf(stderr, "%s: failed (%d)\n", options.scripts[i].c_str(), (int)results[i]);
+            failed++;
+        }
     }
 
-    // Dispose the isolate and tear down V8.
-    isolate->Dispose();
+    fprintf(stderr, "%d scripts on %d isolates in %.1fms, %d failed\n",
+            (int)results.size(), pool.size(), elapsed / 1000.0, failed);
+    return failed == 0;
+}
+
+    /* Several scripts one after the other, see batch.h. false if any failed. */
+static bool runBatch(const CliOptions &options, StartupData* snapshot, CodeCache &cache)
+{
+    Isolate* isolate = createIsolate(snapshot);
+    bool ok;
+    {
+        Isolate::Scope isolate_scope(isolate);
+        HandleScope handle_scope(isolate);
+
+        BatchRunner batch(isolate, &cache, options.mapSource, options.module);
+        ok = batch.Run(options.scripts);
+
+        flushOutput(isolate);
+        batch.Summary(stderr);
+
+        if(options.loadStats && options.module) getModuleLoader(isolate)->PrintStats(stderr);
+        if(options.nativeStats) getObjectArena(isolate)->PrintCounters(stderr);
+
+        GcScheduler* gc = getGcScheduler(isolate);
+        if(gc) gc->Print(stderr);
+    }
+    disposeIsolate(isolate);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    CliOptions options;
+    if(!parseOptions(argc, argv, options)) {
+        printf("Usage: [options] <scriptname.js> [more.js ...] \n Execute the javascript file. The options are listed at the top of cli-script.cpp\n");
+        return 1;
+    }
+
+    double startTime = nowMicros();
+
+    //Flags have to be set before V8 starts
+    if(options.sharedMemory && !enableSharedMemory()) {
+        fprintf(stderr, "--shared-memory needs V8 4.6 or later, sharedBuffer() returns plain ArrayBuffers\n");
+    }
+
+    // Initialize V8.
+    V8::InitializeICU();
+    Platform* platform = platform::CreateDefaultPlatform();
+    V8::InitializePlatform(platform);
+    V8::Initialize();
+    streamingPlatform() = platform;
+
+    double initTime = nowMicros();
+
+    //The blob has to outlive the isolate created from it
+    StartupData snapshot = { NULL, 0 };
+    if(!options.snapshot.empty() && !loadSnapshotBlob(options.snapshot, &snapshot)) {
+        return 1;
+    }
+
+    if(options.stats) {
+        MetricsRecorder::output() = options.statsFile.empty() ? stderr : fopen(options.statsFile.c_str(), "a");
+        if(MetricsRecorder::output() == NULL) {
+            printf("Could not open %s\n", options.statsFile.c_str());
+            return 1;
+        }
+    }
+
+    CodeCache cache(options.codeCacheDir);
+    cache.setEnabled(options.useCodeCache);
+
+    if(!options.cpuProfile.empty() && (options.daemon || options.jobs >= 0 || options.scripts.size() > 1)) {
+        fprintf(stderr, "--cpu-profile profiles a single script, ignored with --daemon, --jobs and several scripts\n");
+    }
+
+    bool failed = false;
+    if(options.daemon) {
+        ScriptDaemon daemon(options.daemonSocket, options.jobs < 0 ? 1 : options.jobs,
+                            snapshot.data ? &snapshot : NULL, &cache, options.contextPool);
+        if(!daemon.Serve()) return 1;
+    } else if(options.jobs >= 0) {
+        failed = !runPool(options, snapshot.data ? &snapshot : NULL, cache);
+    } else if(options.scripts.size() > 1) {
+        failed = !runBatch(options, snapshot.data ? &snapshot : NULL, cache);
+    } else {
+        runSingle(options, snapshot.data ? &snapshot : NULL, cache, startTime, initTime);
+    }
+
+    if(cache.enabled()) cache.PrintStats(stderr);
+
+    if(MetricsRecorder::output() && MetricsRecorder::output() != stderr) fclose(MetricsRecorder::output());
+
+    // Tear down V8.
     V8::Dispose();
     V8::ShutdownPlatform();
     delete platform;
-    return 0;
-}
\ No newline at end of file
+    delete[] snapshot.data;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,204 @@
+#pragma once
+#include "include/v8.h"
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "runtime.h"
+#include "modules.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    Many scripts, one after the other on one isolate, with the compile of
+    the next file overlapping the run of the current one.
+
+    Before file N runs, file N+1's parse is started on a platform
+    background thread (streaming.h), so by the time N and its event loop
+    are done, N+1 usually only needs its compile finalized. Every file gets
+    a fresh context, so scripts can't see each other's globals, but they
+    share the isolate, its compiled code and its warm heap, which is most
+    of what a process per file paid for.
+
+    The result, the last reported error and the times of every file are
+    kept, and Summary() prints them with totals at the end. A file fails
+    when its script does, and also when one of its timer callbacks throws
+    or its event loop is stopped by the script limits:
+
+        ok        12.4ms  (script 11.9ms, loop 0.5ms)  tests/a.js
+        FAIL 3     0.8ms  (script 0.8ms, loop 0.0ms)   tests/b.js
+                  tests/b.js:4: SyntaxError: Unexpected token }
+        2 files, 1 failed, 13.2ms total, 13.9ms wall
+
+    Files with a code cache entry, or any file in module mode, don't stream;
+    the cache or the module prefetch already covers their compile.
+*/
+
+class BatchRunner {
+
+public:
+    struct FileResult {
+        FileResult() : result(eSCRIPT_ERROR_UNKNOWN), scriptMicros(0), loopMicros(0) { }
+        string filename;
+        eScriptExecResult result;
+        string error;
+        double scriptMicros;    //load, compile and run
+        double loopMicros;      //the event loop afterwards
+    };
+
+    BatchRunner(Isolate* isolate, CodeCache* cache, bool mapSource, bool modules)
+        : isolate_(isolate), cache_(cache), mapSource_(mapSource), modules_(modules), wallMicros_(0) { }
+
+    //Runs every file in order, false if any of them failed
+    bool Run(const vector<string>& files)
+    {
+        double start = nowMicros();
+        results_.assign(files.size(), FileResult());
+
+        StreamedCompile* next = startParse(files, 0);
+
+        for(size_t i = 0; i < files.size(); ++i) {
+            StreamedCompile* current = next;
+            next = startParse(files, i + 1);
+
+            runFile(files[i], current, &results_[i]);
+            delete current;
+        }
+
+        wallMicros_ = nowMicros() - start;
+
+        for(size_t i = 0; i < results_.size(); ++i) {
+            if(results_[i].result != eSCRIPT_ERROR_NONE) return false;
+        }
+        return true;
+    }
+
+    const vector<FileResult>& results() const { return results_; }
+
+    void Summary(FILE* out) const
+    {
+        int failed = 0;
+        double total = 0;
+
+        for(size_t i = 0; i < results_.size(); ++i) {
+            const FileResult& file = results_[i];
+            double micros = file.scriptMicros + file.loopMicros;
+            total += micros;
+
+            if(file.result == eSCRIPT_ERROR_NONE) {
+                fprintf(out, "ok      ");
+            } else {
+                fprintf(out, "FAIL %-3d", (int)file.result);
+                failed++;
+            }
+            fprintf(out, " %8.1fms  (script %.1fms, loop %.1fms)  %s\n", micros / 1000.0,
+                    file.scriptMicros / 1000.0, file.loopMicros / 1000.0, file.filename.c_str());
+            if(!file.error.empty()) fprintf(out, "          %s\n", file.error.c_str());
+        }
+
+        fprintf(out, "%d files, %d failed, %.1fms total, %.1fms wall\n",
+                (int)results_.size(), failed, total / 1000.0, wallMicros_ / 1000.0);
+    }
+
+private:
+    //The parse of files[index], already running, or NULL when it won't stream
+    StreamedCompile* startParse(const vector<string>& files, size_t index)
+    {
+        if(index >= files.size() || modules_) return NULL;
+        if(cache_ && cache_->enabled() && cache_->Has(files[index])) return NULL;
+
+        StreamedCompile* streamed = new StreamedCompile(isolate_, files[index]);
+        if(!streamed->Start()) {
+            //Missing files are reported when their turn comes
+            delete streamed;
+            return NULL;
+        }
+        return streamed;
+    }
+
+    void runFile(const string& filename, StreamedCompile* streamed, FileResult* file)
+    {
+        HandleScope handle_scope(isolate_);
+
+        file->filename = filename;
+        getIsolateData(isolate_)->lastError.clear();
+
+        double start = nowMicros();
+
+        game_.Reset();
+        Local<Context> context = createRuntimeContext(isolate_, &game_);
+        Context::Scope context_scope(context);
+
+        if(modules_) {
+            file->result = executeModule(isolate_, context, filename);
+        } else if(streamed) {
+            file->result = superviseScript(isolate_, filename, [&]() {
+                return executeStartedScript(isolate_, context, filename, *streamed, mapSource_);
+            });
+        } else {
+            file->result = executeScript(isolate_, context, filename, cache_, mapSource_);
+        }
+
+        double scriptEnd = nowMicros();
+
+        //Errors of the loop's callbacks are told apart from the script's
+        IsolateData* data = getIsolateData(isolate_);
+        string scriptError = data->lastError;
+        data->lastError.clear();
+
+        EventLoop* loop = getEventLoop(isolate_);
+        loop->Run();
+
+        file->scriptMicros = scriptEnd - start;
+        file->loopMicros = nowMicros() - scriptEnd;
+        file->error = scriptError.empty() ? data->lastError : scriptError;
+
+        //A file whose script ran fine still fails when its callbacks threw
+        //or the loop ran over the limits
+        if(file->result == eSCRIPT_ERROR_NONE) {
+            if(loop->stoppedBy() != Watchdog::eLIMIT_NONE) {
+                file->result = limitResult(loop->stoppedBy());
+                if(file->error.empty()) file->error = string("event loop: stopped, over the ") +
+                                                      Watchdog::describe(loop->stoppedBy());
+            } else if(!data->lastError.empty()) {
+                file->result = eSCRIPT_ERROR_CALLBACK_FAILED;
+            }
+        }
+    }
+
+    Isolate* isolate_;
+    CodeCache* cache_;
+    bool mapSource_;
+    bool modules_;
+    Game game_;
+
+    vector<FileResult> results_;
+    double wallMicros_;
+};
+
+    /* The scripts listed in a manifest, one path per line. Blank lines and
+       lines starting with # are skipped; relative paths are relative to the
+       manifest. false if it can't be read. */
+bool readManifest(const string& manifest, vector<string>* files)
+{
+    ifstream in(manifest.c_str());
+    if(!in) return false;
+
+    size_t slash = manifest.rfind('/');
+    string dir = slash == string::npos ? string() : manifest.substr(0, slash + 1);
+
+    string line;
+    while(getline(in, line)) {
+        size_t begin = line.find_first_not_of(" \t\r");
+        if(begin == string::npos || line[begin] == '#') continue;
+        size_t end = line.find_last_not_of(" \t\r");
+        string path = line.substr(begin, end - begin + 1);
+
+        files->push_back(path[0] == '/' ? path : dir + path);
+    }
+    return true;
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include "include/v8.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    A small harness for the embedding benchmarks.
+
+    Each benchmark body runs `batch` times per sample. The first sample is
+    kept apart as the cold number (first compile, empty caches, untouched
+    code), the rest are sorted for warm percentiles. Times are reported per
+    operation, in nanoseconds, as a table or as JSON lines for tracking
+    regressions between versions.
+*/
+
+class BenchSuite {
+
+public:
+    struct Result {
+        string name;
+        int samples;
+        int batch;
+        double cold;
+        double min, mean, p50, p90, p99, max;
+    };
+
+    BenchSuite() : samples_(30), json_(false) { }
+
+    int samples() const { return samples_; }
+    void setSamples(int samples) { samples_ = samples < 2 ? 2 : samples; }
+    void setFilter(const string& filter) { filter_ = filter; }
+    void setJson(bool json) { json_ = json; }
+
+    bool enabled(const char* name) const
+    {
+        return filter_.empty() || strstr(name, filter_.c_str()) != NULL;
+    }
+
+    //body(i) is called batch times per sample, with i counting every call.
+    //A body that loops itself says how many operations one call stands for.
+    template<class F> void Measure(const char* name, int batch, F body, int opsPerCall = 1)
+    {
+        if(!enabled(name)) return;
+
+        vector<double> times;
+        int call = 0;
+        for(int s = 0; s < samples_; ++s) {
+            double start = nowMicros();
+            for(int b = 0; b < batch; ++b) body(call++);
+            times.push_back((nowMicros() - start) * 1000.0 / ((double)batch * opsPerCall));
+        }
+
+        Result result;
+        result.name = name;
+        result.samples = samples_;
+        result.batch = batch;
+        result.cold = times[0];
+
+        vector<double> warm(times.begin() + 1, times.end());
+        sort(warm.begin(), warm.end());
+
+        double sum = 0;
+        for(size_t i = 0; i < warm.size(); ++i) sum += warm[i];
+
+        result.min = warm.front();
+        result.max = warm.back();
+        result.mean = sum / warm.size();
+        result.p50 = percentile(warm, 0.50);
+        result.p90 = percentile(warm, 0.90);
+        result.p99 = percentile(warm, 0.99);
+
+        report(result);
+        results_.push_back(result);
+    }
+
+    const vector<Result>& results() const { return results_; }
+
+private:
+    static double percentile(const vector<double>& sorted, double p)
+    {
+        double rank = p * (sorted.size() - 1);
+        size_t low = (size_t)floor(rank);
+        size_t high = (size_t)ceil(rank);
+        return sorted[low] + (sorted[high] - sorted[low]) * (rank - low);
+    }
+
+    void report(const Result& r)
+    {
+        if(json_) {
+            printf("{\"bench\":\"%s\",\"v8\":\"%s\",\"unit\":\"ns\",\"samples\":%d,\"batch\":%d,"
+                   "\"cold\":%.1f,\"min\":%.1f,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f}\n",
+                   r.name.c_str(), V8::GetVersion(), r.samples, r.batch,
+                   r.cold, r.min, r.mean, r.p50, r.p90, r.p99, r.max);
+        } else {
+            if(results_.empty()) {
+                printf("%-24s %12s %12s %12s %12s\n", "benchmark (ns/op)", "cold", "p50", "p90", "p99");
+            }
+            printf("%-24s %12.1f %12.1f %12.1f %12.1f\n", r.name.c_str(), r.cold, r.p50, r.p90, r.p99);
+        }
+        fflush(stdout);
+    }
+
+    int samples_;
+    bool json_;
+    string filter_;
+    vector<Result> results_;
+};
@@ -0,0 +1,200 @@
+#pragma once
+#include "include/v8.h"
+
+#include "objectpool.h"
+#include "stringconv.h"
+
+using namespace v8;
+
+/*
+    Compile time bindings for native classes.
+
+    Instead of writing a getter, setter or method callback by hand for every
+    member, name the member in a template argument and the callback is stamped
+    out by the compiler. Each one is a plain static function that unwraps the
+    aligned pointer in internal field 0 and touches the member directly, there
+    is no virtual call or lookup table in between. Names go through the
+    isolate's name cache (stringconv.h), so pass literals.
+
+        bindField<Point, int, &Point::x_>(isolate, instance_template, "x");
+        bindMethod<void (Game::*)(Isolate*), &Game::start>(isolate, object, "start");
+        FunctionTemplate::New(isolate, Constructor<Point, int, int>::New);
+
+    Wrappers have kWrapperFieldCount internal fields: the native, and a tag
+    for its type. Script can call a method or accessor on any object
+    (game.start.call({}), Object.create(game).emit()), so the generated
+    callbacks check the tag and throw a TypeError for anything that is not
+    a wrapper of their type, instead of reading a field that isn't there.
+*/
+
+static const int kNativeField = 0;
+static const int kTypeField = 1;
+static const int kWrapperFieldCount = 2;
+
+//One address per type, stored in kTypeField. int so it is aligned the way
+//SetAlignedPointerInInternalField needs.
+template<class T> void* wrapperTag()
+{
+    static int tag;
+    return &tag;
+}
+
+template<class T> T* Unwrap(Local<Object> object)
+{
+    return static_cast<T*>(object->GetAlignedPointerFromInternalField(kNativeField));
+}
+
+template<class T> void Wrap(Local<Object> object, T* native)
+{
+    object->SetAlignedPointerInInternalField(kNativeField, native);
+    object->SetAlignedPointerInInternalField(kTypeField, wrapperTag<T>());
+}
+
+    /* The T in receiver, or NULL with a TypeError thrown when receiver is
+       not a wrapper of T */
+template<class T> T* unwrapReceiver(Isolate* isolate, Local<Object> receiver)
+{
+    if(receiver->InternalFieldCount() >= kWrapperFieldCount &&
+       receiver->GetAlignedPointerFromInternalField(kTypeField) == wrapperTag<T>()) {
+        return Unwrap<T>(receiver);
+    }
+    isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Illegal invocation")));
+    return NULL;
+}
+
+//Conversions between JS values and the C++ types used in bindings.
+//Arguments can also ask for the isolate itself.
+template<class A> struct Convert;
+
+template<> struct Convert<int> {
+    static int FromJS(const FunctionCallbackInfo<Value>& args, int i) { return FromJS(args[i]); }
+    static int FromJS(Local<Value> value) { return value->Int32Value(); }
+    static void ToJS(ReturnValue<Value> result, int value) { result.Set(value); }
+};
+
+template<> struct Convert<double> {
+    static double FromJS(const FunctionCallbackInfo<Value>& args, int i) { return FromJS(args[i]); }
+    static double FromJS(Local<Value> value) { return value->NumberValue(); }
+    static void ToJS(ReturnValue<Value> result, double value) { result.Set(value); }
+};
+
+template<> struct Convert<bool> {
+    static bool FromJS(const FunctionCallbackInfo<Value>& args, int i) { return FromJS(args[i]); }
+    static bool FromJS(Local<Value> value) { return value->BooleanValue(); }
+    static void ToJS(ReturnValue<Value> result, bool value) { result.Set(value); }
+};
+
+template<> struct Convert<Isolate*> {
+    static Isolate* FromJS(const FunctionCallbackInfo<Value>& args, int) { return args.GetIsolate(); }
+};
+
+//0, 1, ... N-1 as a type, to expand argument lists
+template<int...> struct Indices { };
+template<int N, int... I> struct MakeIndices : MakeIndices<N - 1, N - 1, I...> { };
+template<int... I> struct MakeIndices<0, I...> { typedef Indices<I...> type; };
+
+    /* obj.name reads and writes T::*Member */
+template<class T, class M, M T::*Member>
+struct Field {
+    static void Get(Local<String> property, const PropertyCallbackInfo<Value>& info)
+    {
+        T* self = unwrapReceiver<T>(info.GetIsolate(), info.Holder());
+        if(self) Convert<M>::ToJS(info.GetReturnValue(), self->*Member);
+    }
+
+    static void Set(Local<String> property, Local<Value> value, const PropertyCallbackInfo<void>& info)
+    {
+        T* self = unwrapReceiver<T>(info.GetIsolate(), info.Holder());
+        if(self) self->*Member = Convert<M>::FromJS(value);
+    }
+};
+
+    /* obj.name(...) calls Fn on the unwrapped object */
+template<class Sig, Sig Fn> struct Method;
+
+template<class T, class R, class... Args, R (T::*Fn)(Args...)>
+struct Method<R (T::*)(Args...), Fn> {
+    static void Call(const FunctionCallbackInfo<Value>& args)
+    {
+        invoke(args, typename MakeIndices<sizeof...(Args)>::type());
+    }
+
+private:
+    template<int... I> static void invoke(const FunctionCallbackInfo<Value>& args, Indices<I...>)
+    {
+        T* self = unwrapReceiver<T>(args.GetIsolate(), args.Holder());
+        if(self) Convert<R>::ToJS(args.GetReturnValue(), (self->*Fn)(Convert<Args>::FromJS(args, I)...));
+    }
+};
+
+template<class T, class... Args, void (T::*Fn)(Args...)>
+struct Method<void (T::*)(Args...), Fn> {
+    static void Call(const FunctionCallbackInfo<Value>& args)
+    {
+        invoke(args, typename MakeIndices<sizeof...(Args)>::type());
+    }
+
+private:
+    template<int... I> static void invoke(const FunctionCallbackInfo<Value>& args, Indices<I...>)
+    {
+        T* self = unwrapReceiver<T>(args.GetIsolate(), args.Holder());
+        if(self) (self->*Fn)(Convert<Args>::FromJS(args, I)...);
+    }
+};
+
+    /* new Name(...) makes a pooled T from the arguments, see objectpool.h */
+template<class T, class... Args>
+struct Constructor {
+    static void New(const FunctionCallbackInfo<Value>& args)
+    {
+        construct(args, typename MakeIndices<sizeof...(Args)>::type());
+    }
+
+private:
+    template<int... I> static void construct(const FunctionCallbackInfo<Value>& args, Indices<I...>)
+    {
+        Isolate* isolate = args.GetIsolate();
+        HandleScope scope(isolate);
+
+        //Called as a plain function, This() is not a wrapper to fill in
+        if(!args.IsConstructCall()) {
+            isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Constructor needs new")));
+            return;
+        }
+
+        T* native = newWrapped<T>(isolate, args.This(), Convert<Args>::FromJS(args, I)...);
+        Wrap(args.This(), native);
+    }
+};
+
+    /* Register an accessor for a data member on a template */
+template<class T, class M, M T::*Member>
+void bindField(Isolate* isolate, Local<ObjectTemplate> templ, const char* name)
+{
+    templ->SetAccessor(internName(isolate, name),
+                       Field<T, M, Member>::Get, Field<T, M, Member>::Set);
+}
+
+    /* Register a method on a template, usually the prototype template */
+template<class Sig, Sig Fn>
+void bindMethod(Isolate* isolate, Local<ObjectTemplate> templ, const char* name)
+{
+    Local<FunctionTemplate> fn = FunctionTemplate::New(isolate, Method<Sig, Fn>::Call);
+    Local<String> fn_name = internName(isolate, name);
+    fn->SetClassName(fn_name);
+    templ->Set(fn_name, fn);
+}
+
+    /* Register a plain native function on a template. The name is set on
+       the function too, so profiles and stack traces show it by name
+       instead of as an anonymous frame. Methods that unwrap their receiver
+       pass a signature, so V8 throws for any other receiver before the
+       callback runs. */
+static void bindFunction(Isolate* isolate, Local<ObjectTemplate> templ, const char* name, FunctionCallback callback,
+                         Local<Signature> signature = Local<Signature>())
+{
+    Local<FunctionTemplate> fn = FunctionTemplate::New(isolate, callback, Local<Value>(), signature);
+    Local<String> fn_name = internName(isolate, name);
+    fn->SetClassName(fn_name);
+    templ->Set(fn_name, fn);
+}
@@ -0,0 +1,203 @@
+#pragma once
+#include "include/v8.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+
+using namespace v8;
+using namespace std;
+
+/*
+    On-disk code cache for executeScript.
+
+    Each script gets one cache file, named after a hash of its canonical path.
+    The file header stores a hash of the source the data was produced from and
+    V8's cached data version tag, so an edited script (or a different V8 build)
+    is simply a miss, and the entry is rewritten on that compile.
+*/
+
+    /* FNV-1a, good enough to tell two versions of one script apart */
+uint64_t hashBytes(const char* data, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+class CodeCache {
+
+public:
+    struct Stats {
+        int hits;       //cache data was accepted by V8
+        int misses;     //no entry, or the entry was for other source
+        int rejected;   //V8 refused the data (flags or version changed)
+        int written;    //new entries produced and stored
+        int errors;     //cache files that could not be read or written
+    };
+
+    CodeCache(const string& dir) : dir_(dir), enabled_(true)
+    {
+        memset(&stats_, 0, sizeof(stats_));
+    }
+
+    const string& dir() const { return dir_; }
+    bool enabled() const { return enabled_; }
+    void setEnabled(bool enabled) { enabled_ = enabled; }
+    const Stats& stats() const { return stats_; }
+
+    //Whether there is an entry for this script at all, without reading it.
+    //It may still turn out to be stale when loaded.
+    bool Has(const string& path) const
+    {
+        return access(entryPath(path).c_str(), R_OK) == 0;
+    }
+
+    //Returns the cached data for this script, or NULL on a miss. The caller
+    //owns the result, normally by handing it straight to a ScriptCompiler::Source.
+    ScriptCompiler::CachedData* Load(const string& path, uint64_t sourceHash)
+    {
+        FILE* f = fopen(entryPath(path).c_str(), "rb");
+        if(!f) {
+            stats_.misses++;
+            return NULL;
+        }
+
+        Header header;
+        if(fread(&header, sizeof(header), 1, f) != 1 ||
+           header.magic != kMagic ||
+           header.versionTag != ScriptCompiler::CachedDataVersionTag() ||
+           header.sourceHash != sourceHash) {
+            //Written by another V8, or for another version of the script
+            fclose(f);
+            stats_.misses++;
+            return NULL;
+        }
+
+        uint8_t* data = new uint8_t[header.length];
+        if(fread(data, 1, header.length, f) != header.length) {
+            delete[] data;
+            fclose(f);
+            stats_.errors++;
+            stats_.misses++;
+            return NULL;
+        }
+        fclose(f);
+
+        return new ScriptCompiler::CachedData(data, header.length,
+                                              ScriptCompiler::CachedData::BufferOwned);
+    }
+
+    //Called after compiling with cached data, V8 tells us if it was usable.
+    void Consumed(const string& path, const ScriptCompiler::CachedData* data)
+    {
+        if(!data->rejected) {
+            stats_.hits++;
+            return;
+        }
+
+        //Drop the entry, the next run misses and produces a fresh one
+        stats_.rejected++;
+        unlink(entryPath(path).c_str());
+    }
+
+    void Store(const string& path, uint64_t sourceHash, const ScriptCompiler::CachedData* data)
+    {
+        if(data == NULL || data->length <= 0) return;
+
+        if(mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+            stats_.errors++;
+            return;
+        }
+
+        Header header;
+        header.magic = kMagic;
+        header.versionTag = ScriptCompiler::CachedDataVersionTag();
+        header.length = data->length;
+        header.reserved = 0;
+        header.sourceHash = sourceHash;
+
+        //Write to a temporary and rename, so a concurrent run
+        //never sees a half written entry. mkstemp makes the name unique
+        //across processes and the threads of an isolate pool alike.
+        string target = entryPath(path);
+        char tmp[PATH_MAX];
+        snprintf(tmp, sizeof(tmp), "%s.XXXXXX", target.c_str());
+
+        int fd = mkstemp(tmp);
+        if(fd >= 0) fchmod(fd, 0644);   //mkstemp makes it 0600, fopen did 0644
+        FILE* f = fd < 0 ? NULL : fdopen(fd, "wb");
+        if(!f) {
+            if(fd >= 0) {
+                close(fd);
+                unlink(tmp);
+            }
+            stats_.errors++;
+            return;
+        }
+
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                  fwrite(data->data, 1, data->length, f) == (size_t)data->length;
+        ok = (fclose(f) == 0) && ok;
+
+        if(!ok || rename(tmp, target.c_str()) != 0) {
+            unlink(tmp);
+            stats_.errors++;
+            return;
+        }
+
+        stats_.written++;
+    }
+
+    //Add the counters of a cache used on another thread to ours, and zero them there
+    void MergeStats(CodeCache& other)
+    {
+        stats_.hits += other.stats_.hits;
+        stats_.misses += other.stats_.misses;
+        stats_.rejected += other.stats_.rejected;
+        stats_.written += other.stats_.written;
+        stats_.errors += other.stats_.errors;
+        memset(&other.stats_, 0, sizeof(other.stats_));
+    }
+
+    void PrintStats(FILE* out) const
+    {
+        fprintf(out, "code cache: %d hits, %d misses, %d rejected, %d written, %d errors\n",
+                stats_.hits, stats_.misses, stats_.rejected, stats_.written, stats_.errors);
+    }
+
+private:
+    static const uint32_t kMagic = 0x43433856; // "V8CC"
+
+    struct Header {
+        uint32_t magic;
+        uint32_t versionTag;
+        uint32_t length;
+        uint32_t reserved;
+        uint64_t sourceHash;
+    };
+
+    string entryPath(const string& path) const
+    {
+        //Key on the canonical path, so ./a.js and a.js share an entry
+        char resolved[PATH_MAX];
+        const char* key = realpath(path.c_str(), resolved) ? resolved : path.c_str();
+
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bin",
+                 (unsigned long long)hashBytes(key, strlen(key)));
+        return dir_ + "/" + name;
+    }
+
+    string dir_;
+    bool enabled_;
+    Stats stats_;
+};
@@ -3,6 +3,30 @@
 #include "include/v8.h"
 #include <fstream>
 #include <vector>
+#include <time.h>
+
+    /* The monotonic clock every timing in the runtime is read from, in
+       microseconds. Defined ahead of the includes below, which use it too. */
+double nowMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+    /* The same clock in milliseconds, for timers, frames and limits */
+double nowMillis()
+{
+    return nowMicros() / 1e3;
+}
+
+#include "isolatedata.h"
+#include "print.h"
+#include "codecache.h"
+#include "mappedfile.h"
+#include "streaming.h"
+#include "metrics.h"
+#include "watchdog.h"
 
 using namespace v8;
 using namespace std;
@@ -12,6 +36,10 @@ enum eScriptExecResult {
     eSCRIPT_ERROR_NOT_FOUND,
     eSCRIPT_ERROR_EMPTY_SOURCE,
     eSCRIPT_ERROR_COMPILE_FAILED,
+    eSCRIPT_ERROR_TIMEOUT,
+    eSCRIPT_ERROR_CPU_LIMIT,
+    eSCRIPT_ERROR_HEAP_LIMIT,
+    eSCRIPT_ERROR_CALLBACK_FAILED,  //a timer callback threw
     eSCRIPT_ERROR_NONE,
     eSCRIPT_ERROR_COUNT
 };
@@ -38,9 +66,15 @@ string fileToString(const string &fileName)
 void reportException(Isolate* isolate,
                      TryCatch* try_catch ) 
 {
+    //Stopped by the watchdog, which reports it once the script unwound
+    if (try_catch->HasTerminated()) return;
+
     Locker lock(isolate);
     HandleScope handle_scope(isolate);
 
+    //Errors go through the same buffer as print(), so they stay in order
+    OutputBuffer* out = getOutputBuffer(isolate);
+
     //Get a string from the error message and exception detail
     String::Utf8Value exception( try_catch->Exception() );
     Handle<Message> message = try_catch->Message();
@@ -48,36 +82,170 @@ void reportException(Isolate* isolate,
     //This error has no message
     if (message.IsEmpty()) 
     {
-        printf("%s\n" , *exception );
+        getIsolateData(isolate)->lastError = *exception ? *exception : "";
+        out->Printf("%s\n" , *exception );
+        out->EndMessage();
         return;
     }
 
-    char ex[1024];
     String::Utf8Value filename( message->GetScriptResourceName() );
     int linenum = message->GetLineNumber();
 
     // Print (filename):(line number): (message).
-    sprintf( ex , "%s:%i: %s\n", *filename , linenum , *exception );
-    printf("%s", ex);
+    out->Printf("%s:%i: %s\n", *filename , linenum , *exception );
+
+    //Kept for runners that summarize errors per script
+    char location[64];
+    snprintf(location, sizeof(location), ":%i: ", linenum);
+    getIsolateData(isolate)->lastError = string(*filename ? *filename : "") + location + (*exception ? *exception : "");
 
     // Print line of source code.
     String::Utf8Value sourceline( message->GetSourceLine() );
-    printf( "%s\n", *sourceline );
-
+    out->Printf( "%s\n", *sourceline );
+    out->EndMessage();
 }
 
 /*  readFile from the v8 samples. 
-    Returns a v8::String from a file. */
-const char* readFile(Isolate* isolate, const string str ) 
+    Returns a v8::String from a file. 
+
+    By default the file is mapped and given to V8 as an external string,
+    pass mapped = false for the old copying path. An empty handle means
+    the file could not be read. */
+Local<String> readFile(Isolate* isolate, const string str,
+                       bool mapped = true,
+                       uint64_t* sourceHash = NULL,
+                       SourceLoadInfo* info = NULL)
 {
-    return fileToString(str).c_str();
+    double start = nowMicros();
+    SourceLoadInfo load;
+    Local<String> source;
+
+    MappedFile* file = mapped ? MappedFile::Open(str) : NULL;
+
+    if ( mapped && file == NULL )
+    {
+        getOutputBuffer(isolate)->Printf("File dos not exist! %s\n", str.c_str());
+        getOutputBuffer(isolate)->EndMessage();
+        return source;
+    }
+
+    if ( file != NULL )
+    {
+        load.bytes = file->size();
+        if ( sourceHash ) *sourceHash = hashBytes(file->data(), file->size());
+
+        if ( file->size() < kMinMappedSourceSize )
+        {
+            //Small enough that one copy onto the heap is the cheap option
+            size_t bom = utf8BomLength(file->data(), file->size());
+            source = String::NewFromUtf8(isolate, file->data() + bom, String::kNormalString,
+                                         (int)(file->size() - bom));
+            delete file;
+        } else if ( file->isAscii() ) {
+            //V8 owns the resource from here on, and unmaps it when the string dies
+            source = String::NewExternal(isolate, new MappedOneByteResource(file));
+            load.external = true;
+        } else {
+            source = String::NewExternal(isolate, new DecodedTwoByteResource(file));
+            load.external = true;
+            load.twoByte = true;
+            delete file;
+        }
+    } else {
+        string contents = fileToString(str);
+        load.bytes = contents.size();
+        if ( sourceHash ) *sourceHash = hashBytes(contents.data(), contents.size());
+        size_t bom = utf8BomLength(contents.data(), contents.size());
+        source = String::NewFromUtf8(isolate, contents.data() + bom, String::kNormalString,
+                                     (int)(contents.size() - bom));
+    }
+
+    load.micros = nowMicros() - start;
+    if ( info ) *info = load;
+
+    return source;
+}
+
+
+    /* Compile a script, going through the code cache when one is given */
+Local<Script> compileScript(Isolate* isolate,
+                            Local<String> source,
+                            const string &filename,
+                            CodeCache* cache,
+                            uint64_t sourceHash)
+{
+    //Without a name there is nothing to key the cache on
+    if ( filename.empty() ) return Script::Compile(source);
+
+    ScriptOrigin origin( String::NewFromUtf8(isolate, filename.c_str()) );
+
+    if ( cache == NULL || !cache->enabled() )
+    {
+        ScriptCompiler::Source plain(source, origin);
+        return ScriptCompiler::Compile(isolate, &plain);
+    }
+
+    //The Source takes ownership of the cached data, if there is any
+    ScriptCompiler::CachedData* cached = cache->Load(filename, sourceHash);
+    ScriptCompiler::Source cachedSource(source, origin, cached);
+
+    ScriptCompiler::CompileOptions options = cached ? ScriptCompiler::kConsumeCodeCache
+                                                    : ScriptCompiler::kProduceCodeCache;
+    Local<Script> script = ScriptCompiler::Compile(isolate, &cachedSource, options);
+
+    if ( script.IsEmpty() ) return script;
+
+    if ( cached )
+    {
+        //V8 silently falls back to a full compile if it rejects the data
+        cache->Consumed(filename, cachedSource.GetCachedData());
+    } else {
+        cache->Store(filename, sourceHash, cachedSource.GetCachedData());
+    }
+
+    return script;
+}
+
+
+    /* Run a compiled script in the current context and print its result */
+bool runScript(Isolate* isolate, Local<Script> script, TryCatch* try_catch)
+{
+    //So if compilation succeeds, execute it.
+    MetricsRecorder* metrics = getMetricsRecorder(isolate);
+    double start = metrics ? nowMicros() : 0;
+
+    Handle<Value> result = script->Run();
+
+    if ( metrics ) metrics->AddRun(nowMicros() - start);
+
+    //If the results are empty, there was a runtime
+    //error, so we can report these errors.
+    if ( result.IsEmpty() ) 
+    {
+        reportException(isolate, try_catch );
+        return false;
+    }  else {
+        //If there is a result, print it to the console
+        if ( !result->IsUndefined() && !result.IsEmpty() ) 
+        {
+            //Convert the results to string
+            String::Utf8Value utf8(result);
+            getOutputBuffer(isolate)->Printf("%s\n", *utf8);
+            getOutputBuffer(isolate)->EndMessage();
+        }
+        //Done
+        return true;
+    }
 }
 
 
     /* Execute a specific piece of text in the execution context specified */
 bool executeString(Isolate* isolate,
                    const Handle<Context> &context,
-                   Local<String> source)
+                   Local<String> source,
+                   const string &filename = string(),
+                   CodeCache* cache = NULL,
+                   uint64_t sourceHash = 0)
 {
     HandleScope handle_scope(isolate);
 
@@ -89,53 +257,177 @@ bool executeString(Isolate* isolate,
     TryCatch try_catch(isolate);
 
     // Compile the source code.
-    Local<Script> script = Script::Compile(source);
+    MetricsRecorder* metrics = getMetricsRecorder(isolate);
+    double start = metrics ? nowMicros() : 0;
+
+    Local<Script> script = compileScript(isolate, source, filename, cache, sourceHash);
+
+    if ( metrics ) metrics->AddCompile(nowMicros() - start);
 
     //If the script is empty, there were compile errors.
     if ( script.IsEmpty() )
     {
         reportException(isolate, &try_catch );
         return false;
-    } else {
-        //So if compilation succeeds, execute it.
-        Handle<Value> result = script->Run();
+    }
 
-        //If the results are empty, there was a runtime
-        //error, so we can report these errors.
-        if ( result.IsEmpty() ) 
-        {
-            reportException(isolate, &try_catch );
-            return false;
-        }  else {
-            //If there is a result, print it to the console
-            if ( !result->IsUndefined() && !result.IsEmpty() ) 
-            {
-                //Convert the results to string
-                String::Utf8Value utf8(result);
-                printf("%s\n", *utf8);
-            }
-            //Done
-            return true;
-        }
+    return runScript(isolate, script, &try_catch);
+}
+
+
+    /* Finish and run a file whose parse was already started, see
+       executeStreamedScript. The batch runner starts the next file's
+       parse before the current one runs. */
+eScriptExecResult executeStartedScript(Isolate* isolate,
+                                       Local<Context> context,
+                                       const string &filename,
+                                       StreamedCompile& streamed,
+                                       bool mapSource = true,
+                                       SourceLoadInfo* loadInfo = NULL)
+{
+    HandleScope handle_scope(isolate);
+
+    Local<String> source = readFile(isolate, filename, mapSource, NULL, loadInfo);
+    if( source.IsEmpty() ) return eSCRIPT_ERROR_NOT_FOUND;
+    if( source->Length() == 0 ) return eSCRIPT_ERROR_EMPTY_SOURCE;
+
+    Context::Scope context_scope(context);
+    TryCatch try_catch(isolate);
+
+    ScriptOrigin origin( String::NewFromUtf8(isolate, filename.c_str()) );
+
+    //Only the wait and the finalize show up as compile time here,
+    //the parse itself ran on the background thread
+    MetricsRecorder* metrics = getMetricsRecorder(isolate);
+    double start = metrics ? nowMicros() : 0;
+
+    Local<Script> script = streamed.Finish(source, origin);
+
+    if ( metrics ) metrics->AddCompile(nowMicros() - start);
+
+    if ( script.IsEmpty() )
+    {
+        reportException(isolate, &try_catch );
+        return eSCRIPT_ERROR_COMPILE_FAILED;
     }
+
+    if ( !runScript(isolate, script, &try_catch) ) return eSCRIPT_ERROR_COMPILE_FAILED;
+    return eSCRIPT_ERROR_NONE;
 }
 
 
-    /* Execute the script by filename in the execution context specified */
-eScriptExecResult executeScript(Isolate* isolate,
-                               Local<Context> context,
-                               string filename)
+    /* Execute a file parsed on a background thread while it is read,
+       see streaming.h. Big bundles get to their first line sooner. */
+eScriptExecResult executeStreamedScript(Isolate* isolate,
+                                        Local<Context> context,
+                                        const string &filename,
+                                        bool mapSource = true,
+                                        SourceLoadInfo* loadInfo = NULL)
+{
+    //Start the parse first, so it runs while the source string is loaded
+    StreamedCompile streamed(isolate, filename);
+    if ( !streamed.Start() )
+    {
+        getOutputBuffer(isolate)->Printf("File dos not exist! %s\n", filename.c_str());
+        getOutputBuffer(isolate)->EndMessage();
+        return eSCRIPT_ERROR_NOT_FOUND;
+    }
+
+    return executeStartedScript(isolate, context, filename, streamed, mapSource, loadInfo);
+}
+
+
+    /* The result for a script the watchdog stopped */
+eScriptExecResult limitResult(Watchdog::eLimit limit)
+{
+    switch ( limit )
+    {
+        case Watchdog::eLIMIT_WALL: return eSCRIPT_ERROR_TIMEOUT;
+        case Watchdog::eLIMIT_CPU: return eSCRIPT_ERROR_CPU_LIMIT;
+        case Watchdog::eLIMIT_HEAP: return eSCRIPT_ERROR_HEAP_LIMIT;
+        default: return eSCRIPT_ERROR_UNKNOWN;
+    }
+}
+
+
+    /* Load, compile and run one file, see executeScript */
+static eScriptExecResult executeScriptFile(Isolate* isolate,
+                                           Local<Context> context,
+                                           const string &filename,
+                                           CodeCache* cache,
+                                           bool mapSource,
+                                           SourceLoadInfo* loadInfo,
+                                           bool stream)
 {
+    HandleScope handle_scope(isolate);
 
-    //The source code of this file.
-    Local<String> source = String::NewFromUtf8(isolate, readFile(isolate, filename));
+    if( stream && !(cache && cache->enabled() && cache->Has(filename)) )
+    {
+        return executeStreamedScript(isolate, context, filename, mapSource, loadInfo);
+    }
+
+    //The source code of this file, and a hash of it for the cache.
+    uint64_t sourceHash = 0;
+    Local<String> source = readFile(isolate, filename, mapSource, cache ? &sourceHash : NULL, loadInfo);
+
+    //Could not read the file.
+    if( source.IsEmpty() ) return eSCRIPT_ERROR_NOT_FOUND;
 
     //No data in the file.
-    if( source.IsEmpty() ) return eSCRIPT_ERROR_EMPTY_SOURCE;
+    if( source->Length() == 0 ) return eSCRIPT_ERROR_EMPTY_SOURCE;
 
     //Return compilation error
-    if ( !executeString(isolate, context, source)) return eSCRIPT_ERROR_COMPILE_FAILED;
+    if ( !executeString(isolate, context, source, filename, cache, sourceHash)) return eSCRIPT_ERROR_COMPILE_FAILED;
 
     //Succesfully executed
     return eSCRIPT_ERROR_NONE;
-}
\ No newline at end of file
+}
+
+
+    /* Run one script under the metrics recorder and the watchdog, when
+       they are on. run() loads, compiles and runs it. */
+template<class F>
+eScriptExecResult superviseScript(Isolate* isolate, const string &filename, F run)
+{
+    MetricsRecorder* metrics = getMetricsRecorder(isolate);
+    if ( metrics ) metrics->Begin(filename);
+
+    Watchdog* watchdog = getWatchdog(isolate);
+    if ( watchdog ) watchdog->Arm(ScriptLimits::defaults());
+
+    eScriptExecResult result = run();
+
+    if ( watchdog )
+    {
+        Watchdog::eLimit limit = watchdog->Disarm();
+        if ( limit != Watchdog::eLIMIT_NONE )
+        {
+            result = limitResult(limit);
+            getOutputBuffer(isolate)->Printf("%s: stopped, over the %s\n", filename.c_str(), Watchdog::describe(limit));
+            getOutputBuffer(isolate)->EndMessage();
+        }
+    }
+
+    if ( metrics ) metrics->End(result);
+    return result;
+}
+
+
+    /* Execute the script by filename in the execution context specified.
+       Pass a CodeCache to skip parsing and compiling on repeat runs, or
+       stream = true to parse large files while they are read. A cache
+       entry, when there is one, beats streaming. With metrics on, one
+       JSON line is written per script, see metrics.h. With limits set,
+       the script runs under the isolate's watchdog, see watchdog.h. */
+eScriptExecResult executeScript(Isolate* isolate,
+                               Local<Context> context,
+                               string filename,
+                               CodeCache* cache = NULL,
+                               bool mapSource = true,
+                               SourceLoadInfo* loadInfo = NULL,
+                               bool stream = false)
+{
+    return superviseScript(isolate, filename, [&]() {
+        return executeScriptFile(isolate, context, filename, cache, mapSource, loadInfo, stream);
+    });
+}
@@ -0,0 +1,186 @@
+#pragma once
+#include "include/v8.h"
+#include <stdio.h>
+#include <string.h>
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+
+#include "runtime.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    Ready made runtime contexts for running many small scripts on one isolate.
+
+    Building a context (global object, builtins, our templates) is the bulk
+    of the cost of a tiny script. The pool keeps a few fresh contexts built
+    ahead of time, so Acquire() hands one out straight away and Refill()
+    makes the replacements later, once the caller is idle.
+
+    Scripts from different tenants never see each other's context. A one-shot
+    context is detached from its global when released and is not handed out
+    again; only its global proxy is kept, and reused for the next context
+    the pool builds. A named tenant gets its own context back on every
+    request, and the pool keeps up to maxTenants of those, evicting the
+    least recently used.
+
+        ContextPool pool(isolate, &game, 4, 64);
+        Local<Context> context = pool.Acquire("tenant-a");
+        ...
+        pool.Release(context, "tenant-a");
+        pool.Refill();
+*/
+
+class ContextPool {
+
+public:
+    struct Stats {
+        size_t created;     //contexts built, ahead of time or on demand
+        size_t warmHits;    //handed out from the warm spares
+        size_t tenantHits;  //a tenant got its own context back
+        size_t evicted;     //tenant contexts dropped by the LRU
+        size_t proxies;     //global proxies reused
+    };
+
+    ContextPool(Isolate* isolate, Game* game, size_t warm, size_t maxTenants)
+        : isolate_(isolate), game_(game), warm_(warm), maxTenants_(maxTenants > 0 ? maxTenants : 1)
+    {
+        memset(&stats_, 0, sizeof(stats_));
+    }
+
+    ~ContextPool()
+    {
+        for(size_t i = 0; i < spares_.size(); ++i) spares_[i].Reset();
+        for(list<Tenant>::iterator i = tenants_.begin(); i != tenants_.end(); ++i) i->context.Reset();
+        for(size_t i = 0; i < proxies_.size(); ++i) proxies_[i].Reset();
+    }
+
+    const Stats& stats() const { return stats_; }
+
+    //A context for one request. An empty tenant gets a one-shot context.
+    Local<Context> Acquire(const string& tenant = string())
+    {
+        if(!tenant.empty()) {
+            map<string, list<Tenant>::iterator>::iterator found = byName_.find(tenant);
+            if(found != byName_.end()) {
+                //Most recently used goes to the front
+                tenants_.splice(tenants_.begin(), tenants_, found->second);
+                stats_.tenantHits++;
+                return Local<Context>::New(isolate_, found->second->context);
+            }
+        }
+
+        Local<Context> context = take();
+
+        if(!tenant.empty()) {
+            tenants_.push_front(Tenant());
+            tenants_.front().name = tenant;
+            tenants_.front().context.Reset(isolate_, context);
+            byName_[tenant] = tenants_.begin();
+
+            while(tenants_.size() > maxTenants_) evict();
+        }
+
+        return context;
+    }
+
+    //Done with a request. Tenant contexts stay in the pool for their tenant.
+    void Release(Local<Context> context, const string& tenant = string())
+    {
+        if(tenant.empty()) retire(context);
+    }
+
+    //Build spares up to the warm count, best called between requests
+    void Refill()
+    {
+        while(spares_.size() < warm_) {
+            HandleScope handle_scope(isolate_);
+            Local<Context> context = build();
+            spares_.push_back(ContextHandle());
+            spares_.back().Reset(isolate_, context);
+        }
+    }
+
+    void PrintStats(FILE* out) const
+    {
+        fprintf(out, "context pool: %zu created, %zu warm hits, %zu tenant hits, %zu evicted, %zu proxies reused\n",
+                stats_.created, stats_.warmHits, stats_.tenantHits, stats_.evicted, stats_.proxies);
+    }
+
+private:
+    //Copyable so they fit in containers. Copies would be separate handles
+    //that are never reset, so entries are only ever added empty and set in
+    //place, and the containers never move what they hold.
+    typedef Persistent<Context, CopyablePersistentTraits<Context> > ContextHandle;
+    typedef Persistent<Object, CopyablePersistentTraits<Object> > ProxyHandle;
+
+    struct Tenant {
+        string name;
+        ContextHandle context;
+    };
+
+    //A warm spare if there is one, otherwise a context built now
+    Local<Context> take()
+    {
+        if(spares_.empty()) return build();
+
+        Local<Context> context = Local<Context>::New(isolate_, spares_.back());
+        spares_.back().Reset();
+        spares_.pop_back();
+        stats_.warmHits++;
+        return context;
+    }
+
+    Local<Context> build()
+    {
+        Local<Object> proxy;
+        if(!proxies_.empty()) {
+            proxy = Local<Object>::New(isolate_, proxies_.back());
+            proxies_.back().Reset();
+            proxies_.pop_back();
+            stats_.proxies++;
+        }
+
+        stats_.created++;
+        return createRuntimeContext(isolate_, game_, proxy);
+    }
+
+    //Cut the global loose so nothing the script left behind is reachable
+    //through the proxy, then keep the proxy for the next context
+    void retire(Local<Context> context)
+    {
+        Local<Object> proxy = context->Global();
+        context->DetachGlobal();
+        if(proxies_.size() < warm_) {
+            proxies_.push_back(ProxyHandle());
+            proxies_.back().Reset(isolate_, proxy);
+        }
+    }
+
+    void evict()
+    {
+        Tenant& oldest = tenants_.back();
+        {
+            HandleScope handle_scope(isolate_);
+            retire(Local<Context>::New(isolate_, oldest.context));
+        }
+        oldest.context.Reset();
+        byName_.erase(oldest.name);
+        tenants_.pop_back();
+        stats_.evicted++;
+    }
+
+    Isolate* isolate_;
+    Game* game_;
+    size_t warm_;
+    size_t maxTenants_;
+
+    deque<ContextHandle> spares_;
+    deque<ProxyHandle> proxies_;
+    list<Tenant> tenants_;
+    map<string, list<Tenant>::iterator> byName_;
+    Stats stats_;
+};
@@ -0,0 +1,465 @@
+#pragma once
+#include "include/v8.h"
+#include <stdio.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <deque>
+#include <functional>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "runtime.h"
+#include "contextpool.h"
+#include "frames.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    cli-script as a resident process.
+
+    Starting V8, creating an isolate and building the runtime context costs
+    more than most of the scripts we run. The daemon pays for that once: it
+    listens on a Unix domain socket, and each worker thread keeps a warm
+    isolate for as long as the daemon lives. The accepting thread polls
+    every open connection; one with a request waiting is queued for the
+    next free worker, which runs that one request in a fresh runtime
+    context, streams the output back as it is produced, and hands the
+    connection back to be polled. A client sending many requests takes
+    its turn with everyone else instead of holding a worker until it
+    hangs up. The protocol is in frames.h, cli-client.cpp is the other
+    end; its --latency --cold=out/cli-script times each request against
+    a cold process launch of the same file.
+
+    A client can run anything the daemon's user can, so the socket is only
+    for that user: it is made 0600, the default one sits in a 0700
+    directory (frames.h), and peers with another uid are hung up on.
+
+    With a context pool each worker also keeps contexts built ahead of
+    time, and gives named tenants their own context back on every request
+    (see contextpool.h). A tenant's context lives on one isolate, so once a
+    connection has named its tenant, its requests only go to the worker
+    the tenant name hashes to. Spares are rebuilt after the result has been sent,
+    so the client does not wait for them.
+*/
+
+class ScriptDaemon {
+
+public:
+    //workers == 0 means one isolate per CPU we may run on, contextPool == 0 builds
+    //a context for every request
+    ScriptDaemon(const string& socketPath, int workers, StartupData* snapshot = NULL, CodeCache* cache = NULL,
+                 int contextPool = 0)
+        : socketPath_(socketPath), workerCount_(workers), contextPool_(contextPool),
+          snapshot_(snapshot), cache_(cache), listenFd_(-1), stopping_(false)
+    {
+        wakeFds_[0] = wakeFds_[1] = -1;
+        if(workerCount_ <= 0) workerCount_ = (int)allowedCpus().size();
+        if(workerCount_ <= 0) workerCount_ = (int)thread::hardware_concurrency();
+        if(workerCount_ <= 0) workerCount_ = 1;
+    }
+
+    ~ScriptDaemon()
+    {
+        if(listenFd_ >= 0) {
+            close(listenFd_);
+            unlink(socketPath_.c_str());
+        }
+        if(wakeFds_[0] >= 0) close(wakeFds_[0]);
+        if(wakeFds_[1] >= 0) close(wakeFds_[1]);
+    }
+
+    //Blocks until SIGINT or SIGTERM, false if the socket could not be set up.
+    //Connections already being served are finished before it returns.
+    bool Serve()
+    {
+        if(!listen()) return false;
+
+        //A client that disconnects early must not kill the daemon
+        signal(SIGPIPE, SIG_IGN);
+        installStopHandler();
+
+        pinned_.resize(workerCount_);
+
+        vector<thread> workers;
+        for(int i = 0; i < workerCount_; ++i) {
+            workers.push_back(thread(&ScriptDaemon::workerMain, this, i));
+        }
+
+        fprintf(stderr, "daemon: listening on %s with %d isolates\n", socketPath_.c_str(), workerCount_);
+
+        //Connections between requests, only this thread touches them
+        vector<Connection> idle;
+        vector<struct pollfd> fds;
+
+        while(!stopRequested()) {
+            takeReturned(&idle);
+
+            fds.resize(idle.size() + 2);
+            fds[0].fd = listenFd_;
+            fds[1].fd = wakeFds_[0];
+            for(size_t i = 0; i < idle.size(); ++i) fds[i + 2].fd = idle[i].fd;
+            for(size_t i = 0; i < fds.size(); ++i) {
+                fds[i].events = POLLIN;
+                fds[i].revents = 0;
+            }
+
+            if(poll(&fds[0], fds.size(), -1) < 0) continue; //EINTR on shutdown
+
+            if(fds[1].revents) drainWakeups();
+
+            //A request, or a hangup, waiting: over to the workers
+            vector<Connection> waiting;
+            {
+                lock_guard<mutex> lock(mutex_);
+                for(size_t i = 0; i < idle.size(); ++i) {
+                    if(fds[i + 2].revents) {
+                        queueLocked(idle[i]);
+                    } else {
+                        waiting.push_back(idle[i]);
+                    }
+                }
+            }
+            idle.swap(waiting);
+
+            if(fds[0].revents & POLLIN) {
+                int client = accept(listenFd_, NULL, NULL);
+                if(client >= 0 && !samePeerUser(client)) {
+                    close(client);
+                } else if(client >= 0) {
+                    setClientTimeouts(client);
+                    idle.push_back(Connection(client));
+                }
+            }
+        }
+
+        {
+            lock_guard<mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for(size_t i = 0; i < workers.size(); ++i) workers[i].join();
+
+        for(size_t i = 0; i < idle.size(); ++i) close(idle[i].fd);
+
+        fprintf(stderr, "daemon: stopped\n");
+        return true;
+    }
+
+private:
+    //A client connection and the tenant it last asked for
+    struct Connection {
+        explicit Connection(int fd = -1) : fd(fd) { }
+
+        int fd;
+        string tenant;
+    };
+
+    static volatile sig_atomic_t& stopFlag()
+    {
+        static volatile sig_atomic_t flag = 0;
+        return flag;
+    }
+
+    static void onStopSignal(int) { stopFlag() = 1; }
+
+    static bool stopRequested() { return stopFlag() != 0; }
+
+    //No SA_RESTART, so the signal breaks accept() out of its wait
+    static void installStopHandler()
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = onStopSignal;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+    }
+
+    bool listen()
+    {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if(socketPath_.size() >= sizeof(address.sun_path)) {
+            fprintf(stderr, "daemon: socket path too long %s\n", socketPath_.c_str());
+            return false;
+        }
+        strcpy(address.sun_path, socketPath_.c_str());
+
+        if(socketPath_ == defaultDaemonSocket() && !privateDir(daemonSocketDir())) return false;
+
+        //A stale socket from a daemon that did not shut down cleanly,
+        //anything else at that path is not ours to remove
+        struct stat existing;
+        if(lstat(socketPath_.c_str(), &existing) == 0) {
+            if(!S_ISSOCK(existing.st_mode)) {
+                fprintf(stderr, "daemon: %s exists and is not a socket\n", socketPath_.c_str());
+                return false;
+            }
+            unlink(socketPath_.c_str());
+        }
+
+        //No window where the socket is open to others
+        listenFd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        mode_t mask = umask(077);
+        bool bound = listenFd_ >= 0 && bind(listenFd_, (struct sockaddr*)&address, sizeof(address)) == 0;
+        umask(mask);
+
+        if(!bound || chmod(socketPath_.c_str(), 0600) != 0 || ::listen(listenFd_, SOMAXCONN) != 0) {
+            perror("daemon");
+            return false;
+        }
+
+        //Workers write a byte here to wake poll() when they hand a connection back
+        if(pipe(wakeFds_) != 0) {
+            perror("daemon");
+            return false;
+        }
+        fcntl(wakeFds_[0], F_SETFL, O_NONBLOCK);
+        fcntl(wakeFds_[1], F_SETFL, O_NONBLOCK);
+        return true;
+    }
+
+    //The default socket's directory: ours, and only ours to enter
+    static bool privateDir(const string& dir)
+    {
+        if(mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+            perror("daemon");
+            return false;
+        }
+
+        struct stat info;
+        if(lstat(dir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) ||
+           info.st_uid != geteuid() || (info.st_mode & 077) != 0) {
+            fprintf(stderr, "daemon: %s must be a directory of this user with mode 0700\n", dir.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    //A frame has this long to arrive once it has started, and output this
+    //long to be taken, before the client is dropped and the worker freed
+    static const int kClientTimeoutSeconds = 5;
+
+    static void setClientTimeouts(int client)
+    {
+        struct timeval timeout;
+        timeout.tv_sec = kClientTimeoutSeconds;
+        timeout.tv_usec = 0;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    //Only the daemon's own user may run scripts through it
+    static bool samePeerUser(int client)
+    {
+        struct ucred peer;
+        socklen_t length = sizeof(peer);
+        return getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0 && peer.uid == geteuid();
+    }
+
+    //Tenants go to the worker that holds their context, the rest to anyone
+    void queueLocked(const Connection& client)
+    {
+        if(client.tenant.empty()) {
+            clients_.push_back(client);
+            wake_.notify_one();
+        } else {
+            pinned_[hash<string>()(client.tenant) % pinned_.size()].push_back(client);
+            wake_.notify_all();
+        }
+    }
+
+    //This worker's tenants first, then whoever is waiting
+    bool nextClient(int worker, Connection* client)
+    {
+        unique_lock<mutex> lock(mutex_);
+        deque<Connection>& own = pinned_[worker];
+        wake_.wait(lock, [&] { return stopping_ || !own.empty() || !clients_.empty(); });
+
+        deque<Connection>& from = own.empty() ? clients_ : own;
+        if(from.empty()) return false;
+
+        *client = from.front();
+        from.pop_front();
+        return true;
+    }
+
+    //A worker is done with one request, the connection goes back to be polled
+    void giveBack(const Connection& client)
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            if(stopping_) {
+                close(client.fd);
+                return;
+            }
+            returned_.push_back(client);
+        }
+
+        //A full pipe already has a wakeup pending
+        char wake = 0;
+        ssize_t written = write(wakeFds_[1], &wake, 1);
+        (void)written;
+    }
+
+    void takeReturned(vector<Connection>* idle)
+    {
+        lock_guard<mutex> lock(mutex_);
+        idle->insert(idle->end(), returned_.begin(), returned_.end());
+        returned_.clear();
+    }
+
+    void drainWakeups()
+    {
+        char buffer[64];
+        while(read(wakeFds_[0], buffer, sizeof(buffer)) > 0) { }
+    }
+
+    void workerMain(int index)
+    {
+        //Stop signals go to the accepting thread only
+        sigset_t stopSignals;
+        sigemptyset(&stopSignals);
+        sigaddset(&stopSignals, SIGINT);
+        sigaddset(&stopSignals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+
+        Isolate* isolate = createIsolate(snapshot_);
+        {
+            Locker locker(isolate);
+            Isolate::Scope isolate_scope(isolate);
+
+            Game game;
+            CodeCache cache(cache_ ? cache_->dir() : string());
+            cache.setEnabled(cache_ != NULL && cache_->enabled());
+
+            ContextPool* pool = NULL;
+            if(contextPool_ > 0) {
+                pool = new ContextPool(isolate, &game, contextPool_, contextPool_);
+                pool->Refill();
+            }
+
+            Connection client;
+            while(nextClient(index, &client)) {
+                bool open = serveRequest(isolate, &game, &cache, pool, &client);
+
+                {
+                    lock_guard<mutex> lock(mutex_);
+                    if(cache_) cache_->MergeStats(cache);
+                }
+
+                if(open) giveBack(client);
+                else close(client.fd);
+
+                //Another worker can take the client's next request meanwhile
+                if(pool) pool->Refill();
+            }
+
+            if(pool) {
+                pool->PrintStats(stderr);
+                delete pool;
+            }
+        }
+        disposeIsolate(isolate);
+    }
+
+    //0 for success, anything else a failure. eSCRIPT_ERROR_UNKNOWN is 0
+    //itself, so it goes out as eSCRIPT_ERROR_COUNT.
+    static int32_t resultStatus(eScriptExecResult result)
+    {
+        if(result == eSCRIPT_ERROR_NONE) return 0;
+        if(result == eSCRIPT_ERROR_UNKNOWN) return (int32_t)eSCRIPT_ERROR_COUNT;
+        return (int32_t)result;
+    }
+
+    //One frame off the connection: a tenant is remembered, a request is
+    //run and answered. False once the client hung up or sent garbage.
+    bool serveRequest(Isolate* isolate, Game* game, CodeCache* cache, ContextPool* pool, Connection* client)
+    {
+        char type;
+        string payload;
+        if(!readFrame(client->fd, &type, &payload)) return false;
+
+        if(type == eFRAME_TENANT) {
+            client->tenant = payload;
+            return true;
+        }
+        if(type != eFRAME_FILE && type != eFRAME_SOURCE) return false;
+
+        double start = nowMicros();
+
+        OutputBuffer* out = getOutputBuffer(isolate);
+        out->setFd(client->fd);
+        out->setFramed(eFRAME_OUTPUT);
+
+        eScriptExecResult result = run(isolate, game, cache, pool, client->tenant, type, payload);
+
+        out->setFramed(0);
+        out->setFd(STDOUT_FILENO);
+
+        ResultFrame done;
+        done.status = resultStatus(result);
+        done.micros = (uint32_t)(nowMicros() - start);
+        return writeFrame(client->fd, eFRAME_RESULT, &done, sizeof(done));
+    }
+
+    eScriptExecResult run(Isolate* isolate, Game* game, CodeCache* cache, ContextPool* pool,
+                          const string& tenant, char type, const string& payload)
+    {
+        HandleScope handle_scope(isolate);
+        game->Reset();
+        Local<Context> context = pool ? pool->Acquire(tenant) : createRuntimeContext(isolate, game);
+
+        eScriptExecResult result;
+        {
+            Context::Scope context_scope(context);
+
+            if(type == eFRAME_FILE) {
+                result = executeScript(isolate, context, payload, cache);
+            } else {
+                //Under the watchdog and the metrics like a file, a loop sent
+                //as source must not keep the worker
+                result = superviseScript(isolate, "<daemon>", [&]() {
+                    Local<String> source = String::NewFromUtf8(isolate, payload.data(),
+                                                               String::kNormalString, (int)payload.size());
+                    if(source->Length() == 0) return eSCRIPT_ERROR_EMPTY_SOURCE;
+                    if(!executeString(isolate, context, source, "<daemon>")) return eSCRIPT_ERROR_COMPILE_FAILED;
+                    return eSCRIPT_ERROR_NONE;
+                });
+            }
+
+            //Timers and file reads the script started still answer this request
+            getEventLoop(isolate)->Run();
+        }
+
+        if(pool) pool->Release(context, tenant);
+        return result;
+    }
+
+    string socketPath_;
+    int workerCount_;
+    int contextPool_;
+    StartupData* snapshot_;
+    CodeCache* cache_;
+    int listenFd_;
+    int wakeFds_[2];
+
+    //Connections with a request waiting for a worker, and ones workers
+    //are done with waiting to be polled again, guarded by mutex_
+    mutex mutex_;
+    condition_variable wake_;
+    deque<Connection> clients_;
+    vector<deque<Connection> > pinned_;     //per worker, by tenant
+    vector<Connection> returned_;
+    bool stopping_;
+};
@@ -0,0 +1,264 @@
+#pragma once
+#include "include/v8.h"
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <string>
+
+#include "mappedfile.h"
+#include "shared.h"
+#include "stringconv.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    Bulk data into scripts without going through the JS parser.
+
+        var config = load("config.json");            // JSON, any shape
+        var table = load("particles.cols");          // columns, see below
+        var x = table.columns.x, y = table.columns.y;
+        for (var i = 0; i < table.rows; ++i) x[i] += y[i];
+
+    The format is the second argument ("json" or "columns"), or else taken
+    from the name: .json files are JSON, anything else columns.
+
+    JSON files are mapped and handed to JSON::Parse as an external string,
+    the same way scripts are loaded (mappedfile.h), so the only pass over the
+    text is the JSON parser's own. V8 strings top out at String::kMaxLength
+    (256MB in this V8); larger data has to be in the columns format.
+
+    The columns format holds a table of numbers, one contiguous array per
+    column. All fields are little endian:
+
+        offset  size
+        0       8       magic "V8COLS01"
+        8       4       uint32 column count
+        12      4       uint32 flags, 0
+        16      8       uint64 row count
+        24      48*n    column directory, one entry per column:
+                          32  name, UTF-8, NUL padded
+                          4   uint32 type, see eColumnType
+                          4   uint32 reserved, 0
+                          8   uint64 offset of the column's rows from the
+                              start of the file, a multiple of the
+                              element size
+
+    The whole file is mapped copy on write and becomes one ArrayBuffer, and
+    every column a typed array view into it, so nothing is copied or parsed
+    and no object is made per row. Pages are read in as the script touches
+    them, with readahead asked for the whole file up front. Scripts may
+    write to the arrays; the file itself never changes. The mapping goes
+    away with the last view, through the same reference counting as
+    sharedBuffer() (shared.h).
+*/
+
+enum eColumnType {
+    eCOLUMN_INT8 = 1,
+    eCOLUMN_UINT8,
+    eCOLUMN_INT16,
+    eCOLUMN_UINT16,
+    eCOLUMN_INT32,
+    eCOLUMN_UINT32,
+    eCOLUMN_FLOAT32,
+    eCOLUMN_FLOAT64
+};
+
+static const char kColumnsMagic[8] = { 'V', '8', 'C', 'O', 'L', 'S', '0', '1' };
+
+struct ColumnsHeader {
+    char magic[8];
+    uint32_t columns;
+    uint32_t flags;
+    uint64_t rows;
+};
+
+struct ColumnEntry {
+    char name[32];
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t offset;
+};
+
+static_assert(sizeof(ColumnsHeader) == 24, "ColumnsHeader must match the file layout");
+static_assert(sizeof(ColumnEntry) == 48, "ColumnEntry must match the file layout");
+
+    /* Bytes per element of a column type, 0 for unknown types */
+static size_t columnElementSize(uint32_t type)
+{
+    switch(type) {
+        case eCOLUMN_INT8: case eCOLUMN_UINT8: return 1;
+        case eCOLUMN_INT16: case eCOLUMN_UINT16: return 2;
+        case eCOLUMN_INT32: case eCOLUMN_UINT32: case eCOLUMN_FLOAT32: return 4;
+        case eCOLUMN_FLOAT64: return 8;
+    }
+    return 0;
+}
+
+static Local<Value> newColumnView(Local<ArrayBuffer> buffer, uint32_t type, size_t offset, size_t rows)
+{
+    switch(type) {
+        case eCOLUMN_INT8: return Int8Array::New(buffer, offset, rows);
+        case eCOLUMN_UINT8: return Uint8Array::New(buffer, offset, rows);
+        case eCOLUMN_INT16: return Int16Array::New(buffer, offset, rows);
+        case eCOLUMN_UINT16: return Uint16Array::New(buffer, offset, rows);
+        case eCOLUMN_INT32: return Int32Array::New(buffer, offset, rows);
+        case eCOLUMN_UINT32: return Uint32Array::New(buffer, offset, rows);
+        case eCOLUMN_FLOAT32: return Float32Array::New(buffer, offset, rows);
+        default: return Float64Array::New(buffer, offset, rows);
+    }
+}
+
+static void throwLoadError(Isolate* isolate, const string& path, const char* problem)
+{
+    string message = "load: " + path + ": " + problem;
+    isolate->ThrowException(Exception::Error(newString(isolate, message)));
+}
+
+    /* Releases a mapping adopted by the shared buffer registry */
+static void releaseMappedFile(void* data, size_t size, void* hint)
+{
+    delete static_cast<MappedFile*>(hint);
+}
+
+    /* A JSON file parsed straight out of its mapping. Empty with an
+       exception pending on bad JSON. Takes the file. */
+Local<Value> loadJson(Isolate* isolate, const string& path, MappedFile* file)
+{
+    EscapableHandleScope handle_scope(isolate);
+
+    if(file->size() > (size_t)String::kMaxLength) {
+        delete file;
+        throwLoadError(isolate, path, "too large for a JSON string, use the columns format");
+        return Local<Value>();
+    }
+
+    //JSON::Parse rejects a byte order mark. Only the decoder below drops
+    //one itself; an ASCII file can't start with one.
+    Local<String> text;
+    if(file->size() < kMinMappedSourceSize) {
+        size_t bom = utf8BomLength(file->data(), file->size());
+        text = newString(isolate, file->data() + bom, file->size() - bom);
+        delete file;
+    } else if(file->isAscii()) {
+        //V8 unmaps the file when the string dies
+        text = String::NewExternal(isolate, new MappedOneByteResource(file));
+    } else {
+        text = String::NewExternal(isolate, new DecodedTwoByteResource(file));
+        delete file;
+    }
+
+    Local<Value> result = JSON::Parse(text);
+    if(result.IsEmpty()) return Local<Value>();
+    return handle_scope.Escape(result);
+}
+
+    /* A columns file as { rows, columns: { name: typed array, ... } },
+       or empty with an exception pending. Takes the file. */
+Local<Value> loadColumns(Isolate* isolate, const string& path, MappedFile* file)
+{
+    EscapableHandleScope handle_scope(isolate);
+
+    const char* data = file->data();
+    size_t size = file->size();
+
+    ColumnsHeader header;
+    if(size < sizeof(header)) {
+        delete file;
+        throwLoadError(isolate, path, "not a columns file");
+        return Local<Value>();
+    }
+    memcpy(&header, data, sizeof(header));
+
+    const char* problem = NULL;
+    if(memcmp(header.magic, kColumnsMagic, sizeof(kColumnsMagic)) != 0) {
+        problem = "not a columns file";
+    } else if(header.columns > (size - sizeof(header)) / sizeof(ColumnEntry)) {
+        problem = "column directory runs past the end of the file";
+    } else if(header.rows > 0x7fffffff) {
+        problem = "too many rows for a typed array";
+    }
+
+    //Every column checked before anything is made, so a bad file throws
+    //without leaving half a table behind
+    for(uint32_t i = 0; problem == NULL && i < header.columns; ++i) {
+        ColumnEntry entry;
+        memcpy(&entry, data + sizeof(header) + i * sizeof(entry), sizeof(entry));
+
+        size_t element = columnElementSize(entry.type);
+        if(element == 0) problem = "unknown column type";
+        else if(entry.name[0] == 0) problem = "column without a name";
+        else if(entry.offset % element != 0) problem = "misaligned column";
+        else if(entry.offset > size || header.rows > (size - entry.offset) / element) {
+            problem = "column runs past the end of the file";
+        }
+    }
+
+    if(problem) {
+        delete file;
+        throwLoadError(isolate, path, problem);
+        return Local<Value>();
+    }
+
+    //Start reading the rest of the file in while the script gets going
+    if(size > 0) madvise(const_cast<char*>(data), size, MADV_WILLNEED);
+
+    //The views hold the mapping from here on, ours goes once they have theirs
+    SharedBuffer* shared = SharedBufferRegistry::get().Adopt(string(), const_cast<char*>(data), size,
+                                                            releaseMappedFile, file);
+    Local<ArrayBuffer> buffer = Local<ArrayBuffer>::Cast(wrapSharedBuffer(isolate, shared, false));
+    SharedBufferRegistry::get().Release(shared);
+
+    Local<Object> columns = Object::New(isolate);
+    for(uint32_t i = 0; i < header.columns; ++i) {
+        ColumnEntry entry;
+        memcpy(&entry, data + sizeof(header) + i * sizeof(entry), sizeof(entry));
+
+        columns->Set(newString(isolate, entry.name, strnlen(entry.name, sizeof(entry.name))),
+                     newColumnView(buffer, entry.type, (size_t)entry.offset, (size_t)header.rows));
+    }
+
+    Local<Object> table = Object::New(isolate);
+    table->Set(internName(isolate, "rows"), Number::New(isolate, (double)header.rows));
+    table->Set(internName(isolate, "columns"), columns);
+    return handle_scope.Escape(table);
+}
+
+    /* load(path[, format]), format "json" or "columns", see above */
+static void loadBinding(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+
+    if(args.Length() < 1 || !args[0]->IsString()) {
+        isolate->ThrowException(Exception::TypeError(
+            newString(isolate, "load(path, format) needs a path")));
+        return;
+    }
+
+    string path = toStdString(args[0]);
+
+    bool json;
+    if(args.Length() > 1 && !args[1]->IsUndefined()) {
+        string format = toStdString(args[1]->ToString());
+        if(format != "json" && format != "columns") {
+            isolate->ThrowException(Exception::TypeError(
+                newString(isolate, "load: format is \"json\" or \"columns\"")));
+            return;
+        }
+        json = format == "json";
+    } else {
+        json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+    }
+
+    //Columns are mapped writable so scripts can update them in place
+    MappedFile* file = MappedFile::Open(path, !json);
+    if(file == NULL) {
+        throwLoadError(isolate, path, strerror(errno));
+        return;
+    }
+
+    Local<Value> result = json ? loadJson(isolate, path, file) : loadColumns(isolate, path, file);
+    if(!result.IsEmpty()) args.GetReturnValue().Set(result);
+}
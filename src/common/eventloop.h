@@ -0,0 +1,601 @@
+#pragma once
+#include "include/v8.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "common.h"
+#include "binding.h"
+#include "gcschedule.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    An event loop for scripts: timers, microtasks and async file I/O.
+
+    Every isolate gets one loop, made on first use. Runners call Run() once
+    the main script is done, and it returns when nothing is left to wait for:
+    no timers, and no file operations in flight.
+
+        setTimeout(fn, ms, ...args) / clearTimeout(id)
+        setInterval(fn, ms, ...args) / clearInterval(id)
+        readFileAsync(path)         -> Promise of the contents as a string
+        writeFileAsync(path, text)  -> Promise of the number of bytes written
+
+    Timers sit in a binary heap ordered by due time, so thousands of them
+    cost log n each. A cleared timer is only dropped from the id map, its
+    heap entry is skipped when it comes up.
+
+    File operations run on a few I/O threads. Each finished operation is
+    queued for the loop and an eventfd is bumped, which wakes the loop's
+    epoll_wait; the promise is settled back on the isolate's thread.
+
+    V8 no longer runs microtasks (promise reactions) by itself once the loop
+    exists. The loop runs them at a checkpoint after the main script, and
+    then either after every callback (eMICROTASKS_AFTER_TASK, the default,
+    what browsers and node do) or once per loop turn (eMICROTASKS_AFTER_TURN,
+    fewer checkpoints when many timers fire together).
+*/
+
+class EventLoop {
+
+public:
+    enum eMicrotaskPolicy {
+        eMICROTASKS_AFTER_TASK = 0,
+        eMICROTASKS_AFTER_TURN
+    };
+
+    //The policy new loops start with, for every isolate in the process
+    static eMicrotaskPolicy& defaultPolicy()
+    {
+        static eMicrotaskPolicy policy = eMICROTASKS_AFTER_TASK;
+        return policy;
+    }
+
+    explicit EventLoop(Isolate* isolate)
+        : isolate_(isolate), policy_(defaultPolicy()), nextId_(1), sequence_(0),
+          pendingIo_(0), ioGeneration_(0), stoppedBy_(Watchdog::eLIMIT_NONE), stopping_(false)
+    {
+        isolate_->SetAutorunMicrotasks(false);
+
+        wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = wakeFd_;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFd_, &event);
+    }
+
+    ~EventLoop()
+    {
+        {
+            lock_guard<mutex> lock(ioMutex_);
+            stopping_ = true;
+        }
+        ioWake_.notify_all();
+        for(size_t i = 0; i < ioThreads_.size(); ++i) ioThreads_[i].join();
+
+        for(map<uint32_t, Timer*>::iterator i = timers_.begin(); i != timers_.end(); ++i) delete i->second;
+        for(map<uint32_t, IoRequest*>::iterator i = io_.begin(); i != io_.end(); ++i) delete i->second;
+
+        //Abandoned ones are only in the queues any more
+        for(size_t i = 0; i < ioQueue_.size(); ++i) {
+            if(ioQueue_[i]->generation != ioGeneration_) delete ioQueue_[i];
+        }
+        for(size_t i = 0; i < ioDone_.size(); ++i) {
+            if(ioDone_[i]->generation != ioGeneration_) delete ioDone_[i];
+        }
+
+        close(epollFd_);
+        close(wakeFd_);
+    }
+
+    eMicrotaskPolicy policy() const { return policy_; }
+    void setPolicy(eMicrotaskPolicy policy) { policy_ = policy; }
+
+    //Something still to wait for
+    bool alive() const { return !timers_.empty() || pendingIo_ > 0; }
+
+    //Runs until there are no timers and no file operations left. With
+    //script limits set, the loop as a whole gets one more budget; when it
+    //runs out the watchdog wakes the wait and the remaining timers are
+    //dropped. With idle GC on, waits
+    //for the next timer are offered to the collector first (gcschedule.h).
+    void Run()
+    {
+        Watchdog* watchdog = getWatchdog(isolate_);
+        if(watchdog) {
+            watchdog->Arm(ScriptLimits::defaults());
+            watchdog->setWakeFd(wakeFd_);
+        }
+        GcScheduler* gc = getGcScheduler(isolate_);
+
+        stoppedBy_ = Watchdog::eLIMIT_NONE;
+        Checkpoint();
+
+        while(alive()) {
+            if(watchdog && watchdog->fired()) {
+                Abandon();
+                break;
+            }
+
+            int timeout = timeoutMillis();
+            if(gc && timeout != 0) {
+                //Nothing to run before the next timer, or before some I/O
+                //finishes, let the collector have the wait
+                int slot = timeout;
+                if(timeout < 0 || (pendingIo_ > 0 && timeout > kMaxIdleMillis)) slot = kMaxIdleMillis;
+                gc->Idle(nowMillis() + slot);
+                timeout = timeoutMillis();
+            }
+
+            if(!turn(timeout)) break;
+        }
+
+        if(watchdog) {
+            watchdog->setWakeFd(-1);
+            Watchdog::eLimit limit = watchdog->Disarm();
+            stoppedBy_ = limit;
+            if(limit != Watchdog::eLIMIT_NONE) {
+                getOutputBuffer(isolate_)->Printf("event loop: stopped, over the %s\n", Watchdog::describe(limit));
+                getOutputBuffer(isolate_)->EndMessage();
+            }
+        }
+    }
+
+    //The script limit that stopped the last Run(), if one did
+    Watchdog::eLimit stoppedBy() const { return stoppedBy_; }
+
+    //One turn that doesn't block: timers that are due and file operations
+    //that finished. For hosts that own the thread, like the frame loop.
+    void Poll()
+    {
+        if(alive()) turn(0);
+        Checkpoint();
+    }
+
+    //Run every pending microtask now
+    void Checkpoint()
+    {
+        isolate_->RunMicrotasks();
+    }
+
+    uint32_t AddTimer(Local<Function> callback, double delayMillis, bool repeat, Local<Array> args)
+    {
+        if(!(delayMillis >= 0)) delayMillis = 0;   //also catches NaN
+        if(delayMillis > kMaxTimerDelay) delayMillis = 1;   //as node does
+
+        Timer* timer = new Timer();
+        timer->callback.Reset(isolate_, callback);
+        timer->args.Reset(isolate_, args);
+        timer->interval = repeat ? delayMillis : -1;
+
+        uint32_t id = nextId_++;
+        timers_[id] = timer;
+        schedule(id, nowMillis() + delayMillis);
+        return id;
+    }
+
+    //Forget every timer and every file operation in flight, for a script
+    //that was stopped. Operations still running finish on their thread
+    //but are thrown away, so their promises never settle into whatever
+    //runs on this isolate next.
+    void Abandon()
+    {
+        for(map<uint32_t, Timer*>::iterator i = timers_.begin(); i != timers_.end(); ++i) delete i->second;
+        timers_.clear();
+        heap_.clear();
+
+        for(map<uint32_t, IoRequest*>::iterator i = io_.begin(); i != io_.end(); ++i) i->second->resolver.Reset();
+        io_.clear();
+        pendingIo_ = 0;
+        ioGeneration_++;
+    }
+
+    void ClearTimer(uint32_t id)
+    {
+        map<uint32_t, Timer*>::iterator found = timers_.find(id);
+        if(found == timers_.end()) return;
+        delete found->second;
+        timers_.erase(found);
+    }
+
+    //Queue a file operation, the promise settles on the loop's thread
+    Local<Promise> StartIo(bool write, const string& path, const string& data)
+    {
+        EscapableHandleScope handle_scope(isolate_);
+
+        Local<Promise::Resolver> resolver = Promise::Resolver::New(isolate_);
+
+        IoRequest* request = new IoRequest();
+        request->id = nextId_++;
+        request->write = write;
+        request->path = path;
+        request->data = data;
+        request->error = 0;
+        request->generation = ioGeneration_;
+        request->resolver.Reset(isolate_, resolver);
+        io_[request->id] = request;
+        pendingIo_++;
+
+        startIoThreads();
+        {
+            lock_guard<mutex> lock(ioMutex_);
+            ioQueue_.push_back(request);
+        }
+        ioWake_.notify_one();
+
+        return handle_scope.Escape(resolver->GetPromise());
+    }
+
+private:
+    static const int kIoThreadCount = 4;
+
+    //Longer delays (and intervals) are taken as 1ms, like node
+    static const int kMaxTimerDelay = 0x7fffffff;
+
+    //Longest idle slot while only I/O is pending, its completion can't be
+    //seen until the slot is over
+    static const int kMaxIdleMillis = 10;
+
+    struct Timer {
+        Persistent<Function> callback;
+        Persistent<Array> args;
+        double interval;    //-1 for a one-shot timeout
+
+        ~Timer()
+        {
+            callback.Reset();
+            args.Reset();
+        }
+    };
+
+    struct HeapEntry {
+        double due;
+        uint64_t sequence;  //timers due at the same time fire in the order they were set
+        uint32_t id;
+
+        //std heaps keep the largest on top, we want the earliest
+        bool operator<(const HeapEntry& other) const
+        {
+            return due != other.due ? due > other.due : sequence > other.sequence;
+        }
+    };
+
+    struct IoRequest {
+        uint32_t id;
+        bool write;
+        string path;
+        string data;        //in for writes, out for reads
+        size_t written;
+        int error;          //errno, 0 on success
+        unsigned generation; //ioGeneration_ when started, see Abandon()
+        Persistent<Promise::Resolver> resolver;
+
+        ~IoRequest() { resolver.Reset(); }
+    };
+
+    void schedule(uint32_t id, double due)
+    {
+        HeapEntry entry = { due, sequence_++, id };
+        heap_.push_back(entry);
+        push_heap(heap_.begin(), heap_.end());
+    }
+
+    //How long epoll may sleep: until the next live timer, or for good
+    int timeoutMillis()
+    {
+        while(!heap_.empty() && timers_.find(heap_.front().id) == timers_.end()) {
+            pop_heap(heap_.begin(), heap_.end());
+            heap_.pop_back();
+        }
+        if(heap_.empty()) return -1;
+
+        double wait = heap_.front().due - nowMillis();
+        if(wait <= 0) return 0;
+        return wait >= kMaxTimerDelay - 1 ? kMaxTimerDelay : (int)wait + 1;
+    }
+
+    //Wait up to timeout ms for I/O, then run what is ready. false if
+    //epoll itself failed.
+    bool turn(int timeout)
+    {
+        struct epoll_event events[4];
+        int count = epoll_wait(epollFd_, events, 4, timeout);
+        if(count < 0 && errno != EINTR) return false;
+
+        for(int i = 0; i < count; ++i) {
+            if(events[i].data.fd == wakeFd_) completeIo();
+        }
+
+        runDueTimers();
+
+        if(policy_ == eMICROTASKS_AFTER_TURN) Checkpoint();
+        return true;
+    }
+
+    void runDueTimers()
+    {
+        double now = nowMillis();
+
+        //Timers set by these callbacks wait for the next turn, even at 0ms
+        vector<HeapEntry> due;
+        while(!heap_.empty() && heap_.front().due <= now) {
+            due.push_back(heap_.front());
+            pop_heap(heap_.begin(), heap_.end());
+            heap_.pop_back();
+        }
+
+        for(size_t i = 0; i < due.size(); ++i) {
+            uint32_t id = due[i].id;
+            map<uint32_t, Timer*>::iterator found = timers_.find(id);
+            if(found == timers_.end()) continue;   //cleared
+
+            Timer* timer = found->second;
+            bool repeat = timer->interval >= 0;
+            if(repeat) {
+                schedule(id, now + timer->interval);
+            } else {
+                timers_.erase(found);
+            }
+
+            fire(timer);
+
+            if(!repeat) delete timer;
+            if(policy_ == eMICROTASKS_AFTER_TASK) Checkpoint();
+        }
+    }
+
+    void fire(Timer* timer)
+    {
+        HandleScope handle_scope(isolate_);
+
+        Local<Function> callback = Local<Function>::New(isolate_, timer->callback);
+        Local<Array> args = Local<Array>::New(isolate_, timer->args);
+
+        Local<Context> context = callback->CreationContext();
+        Context::Scope context_scope(context);
+
+        vector<Local<Value> > argv(args->Length());
+        for(uint32_t i = 0; i < args->Length(); ++i) argv[i] = args->Get(i);
+
+        TryCatch try_catch(isolate_);
+        callback->Call(context->Global(), (int)argv.size(), argv.empty() ? NULL : &argv[0]);
+        if(try_catch.HasCaught()) reportException(isolate_, &try_catch);
+    }
+
+    void startIoThreads()
+    {
+        if(!ioThreads_.empty()) return;
+        for(int i = 0; i < kIoThreadCount; ++i) {
+            ioThreads_.push_back(thread(&EventLoop::ioMain, this));
+        }
+    }
+
+    //On an I/O thread, no V8 calls in here
+    void ioMain()
+    {
+        for(;;) {
+            IoRequest* request;
+            {
+                unique_lock<mutex> lock(ioMutex_);
+                ioWake_.wait(lock, [this] { return stopping_ || !ioQueue_.empty(); });
+                if(stopping_) return;
+                request = ioQueue_.front();
+                ioQueue_.pop_front();
+            }
+
+            if(request->write) writeWhole(request);
+            else readWhole(request);
+
+            {
+                lock_guard<mutex> lock(ioMutex_);
+                ioDone_.push_back(request);
+            }
+            uint64_t one = 1;
+            ssize_t ignored = write(wakeFd_, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+
+    static void readWhole(IoRequest* request)
+    {
+        int fd = open(request->path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0) {
+            request->error = errno;
+            return;
+        }
+
+        char buffer[64 * 1024];
+        for(;;) {
+            ssize_t got = read(fd, buffer, sizeof(buffer));
+            if(got < 0 && errno == EINTR) continue;
+            if(got < 0) request->error = errno;
+            if(got <= 0) break;
+            request->data.append(buffer, got);
+        }
+        close(fd);
+    }
+
+    static void writeWhole(IoRequest* request)
+    {
+        int fd = open(request->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0) {
+            request->error = errno;
+            return;
+        }
+
+        request->written = 0;
+        while(request->written < request->data.size()) {
+            ssize_t put = write(fd, request->data.data() + request->written,
+                                request->data.size() - request->written);
+            if(put < 0 && errno == EINTR) continue;
+            if(put < 0) {
+                request->error = errno;
+                break;
+            }
+            request->written += put;
+        }
+        close(fd);
+    }
+
+    //Settle the promises of everything the I/O threads finished
+    void completeIo()
+    {
+        uint64_t count;
+        ssize_t ignored = read(wakeFd_, &count, sizeof(count));
+        (void)ignored;
+
+        deque<IoRequest*> done;
+        {
+            lock_guard<mutex> lock(ioMutex_);
+            done.swap(ioDone_);
+        }
+
+        for(size_t i = 0; i < done.size(); ++i) {
+            IoRequest* request = done[i];
+            if(request->generation != ioGeneration_) {
+                delete request;     //started by a script that was stopped
+                continue;
+            }
+
+            io_.erase(request->id);
+            pendingIo_--;
+
+            settle(request);
+            delete request;
+
+            if(policy_ == eMICROTASKS_AFTER_TASK) Checkpoint();
+        }
+    }
+
+    void settle(IoRequest* request)
+    {
+        HandleScope handle_scope(isolate_);
+
+        Local<Promise::Resolver> resolver = Local<Promise::Resolver>::New(isolate_, request->resolver);
+        Context::Scope context_scope(resolver->CreationContext());
+
+        if(request->error != 0) {
+            string message = request->path + ": " + strerror(request->error);
+            resolver->Reject(Exception::Error(String::NewFromUtf8(isolate_, message.c_str())));
+        } else if(request->write) {
+            resolver->Resolve(Number::New(isolate_, (double)request->written));
+        } else {
+            resolver->Resolve(newString(isolate_, request->data));
+        }
+    }
+
+    Isolate* isolate_;
+    eMicrotaskPolicy policy_;
+    int epollFd_;
+    int wakeFd_;
+
+    uint32_t nextId_;
+    uint64_t sequence_;
+    map<uint32_t, Timer*> timers_;
+    vector<HeapEntry> heap_;
+
+    map<uint32_t, IoRequest*> io_;
+    size_t pendingIo_;
+    unsigned ioGeneration_;
+    Watchdog::eLimit stoppedBy_;
+
+    //Shared with the I/O threads, guarded by ioMutex_
+    vector<thread> ioThreads_;
+    mutex ioMutex_;
+    condition_variable ioWake_;
+    deque<IoRequest*> ioQueue_;
+    deque<IoRequest*> ioDone_;
+    bool stopping_;
+};
+
+    /* The loop of this isolate, created on first use */
+EventLoop* getEventLoop(Isolate* isolate)
+{
+    IsolateData* data = getIsolateData(isolate);
+    if(data->loop == NULL) {
+        data->loop = data->Own(new EventLoop(isolate));
+    }
+    return data->loop;
+}
+
+    /* setTimeout and setInterval share everything but repeat */
+static void addTimer(const FunctionCallbackInfo<Value>& args, bool repeat)
+{
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+
+    if(args.Length() < 1 || !args[0]->IsFunction()) {
+        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "Timer callback must be a function")));
+        return;
+    }
+
+    //Anything after the delay is handed to the callback
+    int extra = args.Length() > 2 ? args.Length() - 2 : 0;
+    Local<Array> callbackArgs = Array::New(isolate, extra);
+    for(int i = 0; i < extra; ++i) callbackArgs->Set(i, args[i + 2]);
+
+    double delay = args.Length() > 1 ? args[1]->NumberValue() : 0;
+    uint32_t id = getEventLoop(isolate)->AddTimer(Local<Function>::Cast(args[0]), delay, repeat, callbackArgs);
+    args.GetReturnValue().Set(id);
+}
+
+static void setTimeoutCallback(const FunctionCallbackInfo<Value>& args) { addTimer(args, false); }
+static void setIntervalCallback(const FunctionCallbackInfo<Value>& args) { addTimer(args, true); }
+
+    /* clearTimeout and clearInterval, ids are shared so either clears both */
+static void clearTimerCallback(const FunctionCallbackInfo<Value>& args)
+{
+    if(args.Length() < 1 || !args[0]->IsNumber()) return;
+    getEventLoop(args.GetIsolate())->ClearTimer(args[0]->Uint32Value());
+}
+
+static void readFileAsyncCallback(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+
+    String::Utf8Value path(args[0]);
+    args.GetReturnValue().Set(getEventLoop(isolate)->StartIo(false, *path, string()));
+}
+
+static void writeFileAsyncCallback(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+
+    String::Utf8Value path(args[0]);
+    String::Utf8Value text(args[1]);
+    args.GetReturnValue().Set(getEventLoop(isolate)->StartIo(true, *path, string(*text, text.length())));
+}
+
+    /* Install the timer and async file functions on a global template */
+static void exposeEventLoop(Isolate* isolate, Handle<ObjectTemplate> global)
+{
+    HandleScope scope(isolate);
+
+    bindFunction(isolate, global, "setTimeout", setTimeoutCallback);
+    bindFunction(isolate, global, "setInterval", setIntervalCallback);
+    bindFunction(isolate, global, "clearTimeout", clearTimerCallback);
+    bindFunction(isolate, global, "clearInterval", clearTimerCallback);
+    bindFunction(isolate, global, "readFileAsync", readFileAsyncCallback);
+    bindFunction(isolate, global, "writeFileAsync", writeFileAsyncCallback);
+}
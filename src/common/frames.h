@@ -0,0 +1,129 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string>
+
+using namespace std;
+
+/*
+    The wire format between the cli-script daemon and cli-client.
+
+    Everything on the socket is a frame: one type byte, the payload length
+    as a 32 bit integer in host order (both ends are on the same machine),
+    then the payload.
+
+        client -> daemon
+            'F'  absolute path of a script to run
+            'S'  script source to run
+            'T'  tenant name for the requests after it on this connection,
+                 empty for one-shot contexts (the default)
+
+        daemon -> client
+            'O'  a piece of the script's stdout, any number of these
+            'R'  the request is done: int32 status (0 when the script ran,
+                 otherwise its eScriptExecResult, with eSCRIPT_ERROR_UNKNOWN
+                 sent as eSCRIPT_ERROR_COUNT since it is 0) and uint32
+                 microseconds the daemon spent on it
+
+    A connection can send any number of requests, one after the other.
+    Payloads are at most kMaxFramePayload bytes. No V8 in here, the client does not link against it.
+
+    The default socket lives in a directory only its user can enter,
+    $XDG_RUNTIME_DIR or else /tmp/cli-script-<uid>, since whoever can
+    connect runs scripts as the daemon's user.
+*/
+
+static const size_t kFrameHeaderSize = 5;
+
+//Larger frames are refused, so one header can't make the other end
+//allocate up to 4GB
+static const uint32_t kMaxFramePayload = 64 * 1024 * 1024;
+
+    /* The directory of the default socket, see above */
+inline string daemonSocketDir()
+{
+    const char* runtime = getenv("XDG_RUNTIME_DIR");
+    if(runtime && runtime[0] == '/') return runtime;
+
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/tmp/cli-script-%u", (unsigned)getuid());
+    return dir;
+}
+
+inline string defaultDaemonSocket()
+{
+    return daemonSocketDir() + "/cli-script.sock";
+}
+
+enum eFrameType {
+    eFRAME_FILE = 'F',
+    eFRAME_SOURCE = 'S',
+    eFRAME_TENANT = 'T',
+    eFRAME_OUTPUT = 'O',
+    eFRAME_RESULT = 'R'
+};
+
+struct ResultFrame {
+    int32_t status;
+    uint32_t micros;
+};
+
+inline void packFrameHeader(char* header, char type, uint32_t length)
+{
+    header[0] = type;
+    memcpy(header + 1, &length, sizeof(length));
+}
+
+    /* write() until everything is out, false if the other end went away */
+inline bool writeFully(int fd, const char* data, size_t length)
+{
+    while(length > 0) {
+        ssize_t written = write(fd, data, length);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+    /* read() exactly length bytes, false on EOF or error */
+inline bool readFully(int fd, char* data, size_t length)
+{
+    while(length > 0) {
+        ssize_t got = read(fd, data, length);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) return false;
+        data += got;
+        length -= got;
+    }
+    return true;
+}
+
+inline bool writeFrame(int fd, char type, const void* payload, uint32_t length)
+{
+    char header[kFrameHeaderSize];
+    packFrameHeader(header, type, length);
+    return writeFully(fd, header, sizeof(header)) &&
+           writeFully(fd, static_cast<const char*>(payload), length);
+}
+
+inline bool readFrame(int fd, char* type, string* payload)
+{
+    char header[kFrameHeaderSize];
+    if(!readFully(fd, header, sizeof(header))) return false;
+
+    uint32_t length;
+    *type = header[0];
+    memcpy(&length, header + 1, sizeof(length));
+    if(length > kMaxFramePayload) return false;
+
+    payload->resize(length);
+    return length == 0 || readFully(fd, &(*payload)[0], length);
+}
@@ -0,0 +1,165 @@
+#pragma once
+#include "include/v8.h"
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+#include <mutex>
+
+#include "common.h"
+#include "print.h"
+#include "binding.h"
+#include "wrappers.h"
+
+using namespace v8;
+using namespace std;
+
+//Here will be a simple game class, with one method
+//that we will expose to scripts. This is a direct function
+//being exposed, under a 'c++ game class', in scripts. 
+//In other words - the script side game object - will actually
+//represent an instance of this class. What it doesn't mean -
+//that game is now a type! This is a common catch - you are not
+//exposing a type, simply injecting a global object. Once
+//you injected that object - you injected a function into that
+//objects property set. Imagine the following javascript instead :
+
+//  var game = {}; 
+//      game.start = function() { print('game started!'); }
+
+
+//One input or game event, handed to update() as 4 numbers in a row.
+//time is when it was queued, in nowMillis() here and
+//in milliseconds since the frame loop started by the time script sees it.
+struct GameEvent {
+    double type;
+    double time;
+    double a;
+    double b;
+};
+
+static const int kGameEventStride = sizeof(GameEvent) / sizeof(double);
+
+//Events past this many in the queue are dropped. Only the frame loop
+//drains the queue, so a script calling game.emit() without --game
+//would otherwise grow it for as long as the process lives.
+static const size_t kMaxQueuedEvents = 64 * 1024;
+
+//Aligned so Wrap() can store it in an internal field as is,
+//v8 needs the low bit of the pointer clear.
+class alignas(8) Game {
+
+public:
+    Game() : stopped_(false) { }
+    ~Game() { }
+
+    //Queue an event for the next frame. Safe from any thread, so input
+    //or network threads can feed the game while a frame runs.
+    //Returns false when the queue is full and the event was dropped.
+    bool QueueEvent(double type, double a, double b)
+    {
+        GameEvent event = { type, nowMillis(), a, b };
+        lock_guard<mutex> lock(eventsMutex_);
+        if(events_.size() >= kMaxQueuedEvents) return false;
+        events_.push_back(event);
+        return true;
+    }
+
+    //Everything queued since the last call, in order. The vectors are
+    //swapped, so the queue keeps its capacity from frame to frame.
+    void TakeEvents(vector<GameEvent>* out)
+    {
+        out->clear();
+        lock_guard<mutex> lock(eventsMutex_);
+        events_.swap(*out);
+    }
+
+    bool stopped() const { return stopped_; }
+    void resume() { stopped_ = false; }
+
+    //Forget the last run's events and game.stop(). A worker that keeps
+    //one game for every request calls this first, so one request (or
+    //tenant) never sees what another left behind.
+    void Reset()
+    {
+        lock_guard<mutex> lock(eventsMutex_);
+        events_.clear();
+        stopped_ = false;
+    }
+
+    //game.emit(type, a, b) from script, seen by update() next frame
+    void emit(double type, double a, double b)
+    {
+        QueueEvent(type, a, b);
+    }
+
+    //game.stop() ends the frame loop after the current frame
+    void stop()
+    {
+        stopped_ = true;
+    }
+
+    //The direct function of this class 
+    //that will get called on. It writes through the isolate's
+    //output buffer so it lines up with what scripts print().
+    //
+    //There is no hand written v8 handler for it: binding.h generates
+    //one (Method<...>::Call) that unwraps the c++ instance from
+    //args.Holder() - the 'game' in game.start() - and calls this.
+    void start(Isolate* isolate) 
+    {
+        getOutputBuffer(isolate)->Write("Game started!\n", 14);
+        getOutputBuffer(isolate)->EndMessage();
+    }
+
+private:
+    //Shared with threads calling QueueEvent, guarded by eventsMutex_
+    mutex eventsMutex_;
+    vector<GameEvent> events_;
+    bool stopped_;
+};
+
+//The generated callbacks for game.start(), game.emit() and game.stop()
+typedef Method<void (Game::*)(Isolate*), &Game::start> GameStart;
+typedef Method<void (Game::*)(double, double, double), &Game::emit> GameEmit;
+typedef Method<void (Game::*)(), &Game::stop> GameStop;
+
+
+//The game object's methods, on the template every game wrapper shares
+template<> struct WrapperTraits<Game> {
+    static void Build(Isolate* isolate, Local<ObjectTemplate> templ)
+    {
+        bindMethod<void (Game::*)(Isolate*), &Game::start>(isolate, templ, "start");
+        bindMethod<void (Game::*)(double, double, double), &Game::emit>(isolate, templ, "emit");
+        bindMethod<void (Game::*)(), &Game::stop>(isolate, templ, "stop");
+    }
+};
+
+//Here is a helper function to ease the process - This inserts a named property with a callback
+//into the object requested. For example, game.start <- this would be simpler using the function here.
+//The function template behind it is made once per isolate and callback.
+void ExposeProperty(Isolate* isolate, Local<Object> intoObject, const char* name, FunctionCallback callback)
+{
+    HandleScope handle_scope(isolate);
+    Local<Function> fn = getWrapperRegistry(isolate)->Function(callback, name)->GetFunction();
+    Local<String> fn_name = internName(isolate, name);
+    fn->SetName(fn_name);
+    intoObject->Set(fn_name, fn);
+}
+
+//This will expose an object with the type Game, into the global scope.
+//It will return a handle to the JS object that represents this c++ instance.
+//The template (the wrapper fields, plus start, emit and stop) is built on the
+//first call on an isolate and shared by every game object after that.
+Handle<Object> WrapGameObject(Isolate* isolate, Game *gameInstance )
+{
+    //The c++ pointer is stored inside the JS object. It is aligned,
+    //so v8 can keep it in the field directly without an External.
+    return wrapNative(isolate, gameInstance);
+}
+
+//This will return the c++ object that WrapGameObject stored, 
+//from an existing jsObject.
+Game* UnwrapGameObject(Local<Object> jsObject ) 
+{
+    return Unwrap<Game>( jsObject );
+}
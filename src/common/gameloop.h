@@ -0,0 +1,309 @@
+#pragma once
+#include "include/v8.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <vector>
+
+#include "common.h"
+#include "game.h"
+#include "eventloop.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    A fixed timestep frame loop for the game object.
+
+    After the main script ran, the loop calls the script's global update()
+    at a fixed rate, always with the same dt (in seconds), and sleeps until
+    the next frame is due:
+
+        function update(dt, events) {
+            for (var i = 0; i < events.length; i += 4) {
+                var type = events[i], time = events[i + 1];
+                var a = events[i + 2], b = events[i + 3];
+                ...
+            }
+            for (var e = 0; e < entities.length; e++) entities[e].step(dt);
+            if (done) game.stop();
+        }
+
+    Events queued since the previous frame (Game::QueueEvent from native
+    code on any thread, game.emit(type, a, b) from script) are handed over
+    in one Float64Array, four numbers per event, instead of one call per
+    event. The array is a view on a buffer the loop owns and reuses, so a
+    frame allocates no more than the view itself.
+
+    When a frame runs long the following ones run back to back to catch up,
+    so the simulation keeps its rate. Past kMaxCatchUpFrames behind, the
+    missed frames are dropped instead, rather than spiralling further
+    behind. Timers and file operations get a nonblocking turn of the event
+    loop after each frame.
+
+    With script limits set (watchdog.h), every frame, update() and its
+    event loop turn, gets the whole budget. A frame that runs out is
+    terminated, the remaining timers are dropped and the loop stops.
+
+    Every frame's time (update() plus the event loop turn) goes into a
+    histogram, with counters for frames over budget and frames dropped.
+
+    With idle GC on (gcschedule.h), the time left before the next frame is
+    offered to the collector before the loop sleeps, and collections are
+    counted by whether they paused a frame or ran in that spare time.
+*/
+
+class FrameStats {
+
+public:
+    explicit FrameStats(double budgetMillis)
+        : budget_(budgetMillis), width_(budgetMillis / kBucketsPerBudget),
+          frames_(0), overruns_(0), dropped_(0), total_(0), max_(0)
+    {
+        memset(buckets_, 0, sizeof(buckets_));
+    }
+
+    void Record(double millis)
+    {
+        int bucket = (int)(millis / width_);
+        if(bucket >= kBuckets) bucket = kBuckets - 1;
+        buckets_[bucket]++;
+
+        frames_++;
+        total_ += millis;
+        if(millis > max_) max_ = millis;
+        if(millis > budget_) overruns_++;
+    }
+
+    void AddDropped(uint64_t frames) { dropped_ += frames; }
+
+    uint64_t frames() const { return frames_; }
+    uint64_t overruns() const { return overruns_; }
+    uint64_t dropped() const { return dropped_; }
+
+    //Upper edge of the bucket holding the p-th percentile frame
+    double Percentile(double p) const
+    {
+        if(frames_ == 0) return 0;
+        uint64_t rank = (uint64_t)(p / 100.0 * (frames_ - 1)) + 1;
+        uint64_t seen = 0;
+        for(int i = 0; i < kBuckets; ++i) {
+            seen += buckets_[i];
+            if(seen >= rank) return i == kBuckets - 1 ? max_ : (i + 1) * width_;
+        }
+        return max_;
+    }
+
+    void Print(FILE* out, double hz) const
+    {
+        fprintf(out, "frames: %llu at %.0fHz (%.2fms budget), %llu over budget (%.1f%%), %llu dropped\n",
+                (unsigned long long)frames_, hz, budget_, (unsigned long long)overruns_,
+                frames_ ? 100.0 * overruns_ / frames_ : 0.0, (unsigned long long)dropped_);
+        fprintf(out, "frame time: mean %.2fms p50 %.2fms p90 %.2fms p99 %.2fms max %.2fms\n",
+                frames_ ? total_ / frames_ : 0.0, Percentile(50), Percentile(90), Percentile(99), max_);
+
+        for(int i = 0; i < kBuckets; ++i) {
+            if(buckets_[i] == 0) continue;
+            if(i == kBuckets - 1) {
+                fprintf(out, "  %6.2fms+        %llu\n", i * width_, (unsigned long long)buckets_[i]);
+            } else {
+                fprintf(out, "  %6.2f-%6.2fms  %llu\n", i * width_, (i + 1) * width_,
+                        (unsigned long long)buckets_[i]);
+            }
+        }
+    }
+
+private:
+    //Buckets cover four frame budgets, anything slower lands in the last
+    static const int kBucketsPerBudget = 16;
+    static const int kBuckets = kBucketsPerBudget * 4 + 1;
+
+    double budget_;
+    double width_;
+    uint64_t buckets_[kBuckets];
+    uint64_t frames_;
+    uint64_t overruns_;
+    uint64_t dropped_;
+    double total_;
+    double max_;
+};
+
+class GameLoop {
+
+public:
+    GameLoop(Isolate* isolate, Local<Context> context, Game* game, double hz)
+        : isolate_(isolate), game_(game), hz_(hz > 0 ? hz : 60), step_(1000.0 / hz_),
+          stats_(step_), gc_(getGcScheduler(isolate)), limit_(Watchdog::eLIMIT_NONE), capacity_(0)
+    {
+        context_.Reset(isolate, context);
+    }
+
+    ~GameLoop()
+    {
+        if(!buffer_.IsEmpty()) {
+            HandleScope handle_scope(isolate_);
+            Local<ArrayBuffer>::New(isolate_, buffer_)->Neuter();
+        }
+        context_.Reset();
+        update_.Reset();
+        buffer_.Reset();
+    }
+
+    //Runs frames until game.stop(), update() throws or maxFrames frames
+    //ran (0 for no limit). false if the script has no update function.
+    bool Run(uint64_t maxFrames)
+    {
+        HandleScope handle_scope(isolate_);
+        Local<Context> context = Local<Context>::New(isolate_, context_);
+        Context::Scope context_scope(context);
+
+        Local<Value> update = context->Global()->Get(internName(isolate_, "update"));
+        if(!update->IsFunction()) {
+            getOutputBuffer(isolate_)->Printf("game loop: the script defines no update(dt, events)\n");
+            getOutputBuffer(isolate_)->EndMessage();
+            return false;
+        }
+        update_.Reset(isolate_, update.As<Function>());
+
+        EventLoop* loop = getEventLoop(isolate_);
+        Watchdog* watchdog = getWatchdog(isolate_);
+        game_->resume();
+        limit_ = Watchdog::eLIMIT_NONE;
+
+        start_ = nowMillis();
+        double next = start_;
+
+        for(uint64_t ran = 0; !game_->stopped() && (maxFrames == 0 || ran < maxFrames); ++ran) {
+            double now = nowMillis();
+            if(now < next) {
+                if(gc_) gc_->Idle(next);
+                sleepUntil(next);
+                now = nowMillis();
+            }
+
+            //Too far behind to catch up, skip to the present
+            double behind = (now - next) / step_;
+            if(behind > kMaxCatchUpFrames) {
+                uint64_t skipped = (uint64_t)behind;
+                stats_.AddDropped(skipped);
+                next += skipped * step_;
+            }
+
+            double frameStart = nowMillis();
+            if(gc_) gc_->BeginFrame();
+            if(watchdog) watchdog->Arm(ScriptLimits::defaults());
+
+            bool ok = frame(context);
+            loop->Poll();
+
+            Watchdog::eLimit limit = watchdog ? watchdog->Disarm() : Watchdog::eLIMIT_NONE;
+            if(gc_) gc_->EndFrame();
+            stats_.Record(nowMillis() - frameStart);
+
+            if(limit != Watchdog::eLIMIT_NONE) {
+                //The frame was terminated, its timers would only run into the same wall
+                loop->Abandon();
+                getOutputBuffer(isolate_)->Printf("game loop: stopped, over the %s\n", Watchdog::describe(limit));
+                getOutputBuffer(isolate_)->EndMessage();
+                limit_ = limit;
+                break;
+            }
+
+            if(!ok) break;
+            next += step_;
+        }
+
+        return true;
+    }
+
+    const FrameStats& stats() const { return stats_; }
+
+    //The script limit that stopped the last Run(), if one did
+    Watchdog::eLimit stoppedBy() const { return limit_; }
+    double hz() const { return hz_; }
+
+    void PrintStats(FILE* out) const { stats_.Print(out, hz_); }
+
+private:
+    static const int kMaxCatchUpFrames = 5;
+
+    static void sleepUntil(double millis)
+    {
+        struct timespec ts;
+        ts.tv_sec = (time_t)(millis / 1e3);
+        ts.tv_nsec = (long)((millis - ts.tv_sec * 1e3) * 1e6);
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) { }
+    }
+
+    //One update(dt, events) call, false if it threw
+    bool frame(Local<Context> context)
+    {
+        HandleScope handle_scope(isolate_);
+        Context::Scope context_scope(context);
+
+        game_->TakeEvents(&events_);
+
+        Local<Value> argv[2] = {
+            Number::New(isolate_, step_ / 1000.0),
+            eventsView()
+        };
+
+        TryCatch try_catch(isolate_);
+        Local<Function> update = Local<Function>::New(isolate_, update_);
+        update->Call(context->Global(), 2, argv);
+
+        if(try_catch.HasCaught()) {
+            reportException(isolate_, &try_catch);
+            return false;
+        }
+        return true;
+    }
+
+    //The frame's events packed into the shared buffer, as a Float64Array
+    //of exactly the events
+    Local<Float64Array> eventsView()
+    {
+        size_t count = events_.size() * kGameEventStride;
+
+        if(count > capacity_ || buffer_.IsEmpty()) {
+            //Script may still hold the old view, neuter it before the
+            //memory under it goes away
+            if(!buffer_.IsEmpty()) Local<ArrayBuffer>::New(isolate_, buffer_)->Neuter();
+
+            capacity_ = count > capacity_ * 2 ? count : capacity_ * 2;
+            if(capacity_ < kMinEventCapacity) capacity_ = kMinEventCapacity;
+            storage_.assign(capacity_, 0);
+
+            buffer_.Reset(isolate_, ArrayBuffer::New(isolate_, &storage_[0], capacity_ * sizeof(double)));
+        }
+
+        for(size_t i = 0; i < events_.size(); ++i) {
+            GameEvent event = events_[i];
+            event.time -= start_;
+            memcpy(&storage_[i * kGameEventStride], &event, sizeof(event));
+        }
+
+        return Float64Array::New(Local<ArrayBuffer>::New(isolate_, buffer_), 0, count);
+    }
+
+    static const size_t kMinEventCapacity = 256 * kGameEventStride;
+
+    Isolate* isolate_;
+    Game* game_;
+    double hz_;
+    double step_;
+    double start_;
+    FrameStats stats_;
+    GcScheduler* gc_;   //NULL with idle GC off
+    Watchdog::eLimit limit_;
+
+    Persistent<Context> context_;
+    Persistent<Function> update_;
+
+    //Events of the current frame, and the memory script sees them in
+    vector<GameEvent> events_;
+    vector<double> storage_;
+    size_t capacity_;
+    Persistent<ArrayBuffer> buffer_;
+};
@@ -0,0 +1,322 @@
+#pragma once
+#include "include/v8.h"
+#include "include/v8-platform.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "isolatedata.h"
+#include "streaming.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    Garbage collection moved off the frame, into time nobody else uses.
+
+    Hosts that know when they are about to wait (the frame loop before it
+    sleeps until the next frame, the event loop before it blocks for the
+    next timer) call Idle(deadline) with the time the wait will end. The
+    isolate gets that time, minus a little margin, through
+    IdleNotificationDeadline to run incremental marking steps, sweeping
+    and idle scavenges, so the work is done before a frame has to trip
+    over it.
+
+    In the same slots the memory use of the process is sampled, at most
+    every GcPolicy::pressurePollMillis, from whichever source exists:
+
+        /sys/fs/cgroup/memory.current / memory.max              cgroup v2
+        /sys/fs/cgroup/memory/memory.usage_in_bytes / .limit    cgroup v1
+        /proc/meminfo, MemTotal - MemAvailable over MemTotal    no limit set
+
+    Past kModeratePressure of the limit is moderate pressure, past
+    kCriticalPressure critical. V8 5.2 and later get both levels as
+    MemoryPressureNotification. Older builds have no such call, there a
+    critical level is forwarded as LowMemoryNotification (a full,
+    compacting collection, at most once per critical episode) and a
+    moderate one is only counted.
+
+    Every pause is timed from the GC prologue to the epilogue and counted
+    by where it happened: inside a frame, in an idle slot, in a pressure
+    collection, or anywhere else (the main script, timer callbacks):
+
+        gc: 12 in frames (3.10ms, max 0.61ms), 40 idle (8.22ms), 1 pressure (14.0ms), 6 elsewhere (1.02ms)
+        idle: 2310 slots, 1650.4ms offered, pressure moderate 0 critical 1
+
+    Off unless turned on for the process in GcPolicy::defaults() (cli-script
+    --idle-gc, --gc-stats).
+*/
+
+#if V8_MAJOR_VERSION > 5 || (V8_MAJOR_VERSION == 5 && V8_MINOR_VERSION >= 2)
+#define HAVE_MEMORY_PRESSURE_NOTIFICATION 1
+#endif
+
+//Idle slots end this long before the deadline, so the caller is back on
+//time, and shorter slots aren't worth the call
+static const double kIdleMarginMillis = 0.5;
+static const double kMinIdleMillis = 1.0;
+
+//After V8 says it has no idle work left, slots are offered again after
+//this long, or as soon as a GC outside the idle slots makes new work
+static const double kIdleBackoffMillis = 100.0;
+
+//Fractions of the memory limit in use
+static const double kModeratePressure = 0.85;
+static const double kCriticalPressure = 0.95;
+
+//cgroup v1 reports "no limit" as a page aligned number near 2^63
+static const double kNoMemoryLimit = 1e18;
+
+struct GcPolicy {
+    GcPolicy() : idleTime(false), memoryPressure(false), track(false), pressurePollMillis(500) { }
+
+    bool idleTime;              //hand idle slots to V8
+    bool memoryPressure;        //sample memory use and forward pressure
+    bool track;                 //count pauses even with neither of the above
+    double pressurePollMillis;
+
+    //The policy of every isolate in the process
+    static GcPolicy& defaults()
+    {
+        static GcPolicy policy;
+        return policy;
+    }
+
+    bool any() const { return idleTime || memoryPressure || track; }
+};
+
+class GcScheduler {
+
+public:
+    enum ePhase {
+        eGC_PHASE_ELSEWHERE = 0,
+        eGC_PHASE_FRAME,
+        eGC_PHASE_IDLE,
+        eGC_PHASE_PRESSURE,
+        eGC_PHASE_COUNT
+    };
+
+    enum ePressure {
+        ePRESSURE_NONE = 0,
+        ePRESSURE_MODERATE,
+        ePRESSURE_CRITICAL
+    };
+
+    GcScheduler(Isolate* isolate, const GcPolicy& policy)
+        : isolate_(isolate), policy_(policy), phase_(eGC_PHASE_ELSEWHERE), gcStart_(0),
+          idleSlots_(0), idleOffered_(0), idleDone_(false), idleDoneAt_(0), lastPoll_(0),
+          pressure_(ePRESSURE_NONE)
+    {
+        memset(counts_, 0, sizeof(counts_));
+        memset(pauses_, 0, sizeof(pauses_));
+        memset(maxPauses_, 0, sizeof(maxPauses_));
+        memset(notified_, 0, sizeof(notified_));
+
+        isolate_->AddGCPrologueCallback(OnGCStart);
+        isolate_->AddGCEpilogueCallback(OnGCEnd);
+    }
+
+    ~GcScheduler()
+    {
+        isolate_->RemoveGCPrologueCallback(OnGCStart);
+        isolate_->RemoveGCEpilogueCallback(OnGCEnd);
+    }
+
+    //Brackets one frame, pauses in between count against the frame
+    void BeginFrame() { phase_ = eGC_PHASE_FRAME; }
+    void EndFrame() { phase_ = eGC_PHASE_ELSEWHERE; }
+
+    //The caller is about to wait until deadline (nowMillis()).
+    //Returns once V8 is done or the deadline is near, whichever is first.
+    void Idle(double deadline)
+    {
+        double now = nowMillis();
+
+        if(policy_.memoryPressure && now - lastPoll_ >= policy_.pressurePollMillis) {
+            lastPoll_ = now;
+            forwardPressure(samplePressure());
+            now = nowMillis();
+        }
+
+        if(!policy_.idleTime) return;
+
+        double slot = deadline - kIdleMarginMillis - now;
+        if(slot < kMinIdleMillis) return;
+
+        //V8 said it had nothing left. That is only a hint, allocation
+        //since then makes new work, so ask again once the backoff is over.
+        if(idleDone_ && now - idleDoneAt_ < kIdleBackoffMillis) return;
+
+        idleSlots_++;
+        idleOffered_ += slot;
+
+        phase_ = eGC_PHASE_IDLE;
+        idleDone_ = isolate_->IdleNotificationDeadline(platformSeconds(now) + slot / 1000.0);
+        phase_ = eGC_PHASE_ELSEWHERE;
+        if(idleDone_) idleDoneAt_ = now;
+    }
+
+    uint64_t count(ePhase phase) const { return counts_[phase]; }
+    double pauseMillis(ePhase phase) const { return pauses_[phase]; }
+    uint64_t idleSlots() const { return idleSlots_; }
+
+    void Print(FILE* out) const
+    {
+        fprintf(out, "gc: %llu in frames (%.2fms, max %.2fms), %llu idle (%.2fms), "
+                     "%llu pressure (%.2fms), %llu elsewhere (%.2fms)\n",
+                (unsigned long long)counts_[eGC_PHASE_FRAME], pauses_[eGC_PHASE_FRAME], maxPauses_[eGC_PHASE_FRAME],
+                (unsigned long long)counts_[eGC_PHASE_IDLE], pauses_[eGC_PHASE_IDLE],
+                (unsigned long long)counts_[eGC_PHASE_PRESSURE], pauses_[eGC_PHASE_PRESSURE],
+                (unsigned long long)counts_[eGC_PHASE_ELSEWHERE], pauses_[eGC_PHASE_ELSEWHERE]);
+        fprintf(out, "idle: %llu slots, %.1fms offered, pressure moderate %llu critical %llu\n",
+                (unsigned long long)idleSlots_, idleOffered_,
+                (unsigned long long)notified_[ePRESSURE_MODERATE],
+                (unsigned long long)notified_[ePRESSURE_CRITICAL]);
+    }
+
+    //Where the process stands against its memory limit right now
+    static ePressure samplePressure()
+    {
+        double used = 0, limit = 0;
+
+        if(!readUsage("/sys/fs/cgroup/memory.current", "/sys/fs/cgroup/memory.max", &used, &limit) &&
+           !readUsage("/sys/fs/cgroup/memory/memory.usage_in_bytes",
+                      "/sys/fs/cgroup/memory/memory.limit_in_bytes", &used, &limit) &&
+           !readMeminfo(&used, &limit)) {
+            return ePRESSURE_NONE;
+        }
+
+        double fraction = used / limit;
+        if(fraction >= kCriticalPressure) return ePRESSURE_CRITICAL;
+        if(fraction >= kModeratePressure) return ePRESSURE_MODERATE;
+        return ePRESSURE_NONE;
+    }
+
+private:
+    //now, on the clock IdleNotificationDeadline measures deadlines with
+    static double platformSeconds(double millis)
+    {
+        Platform* platform = streamingPlatform();
+        return platform ? platform->MonotonicallyIncreasingTime() : millis / 1000.0;
+    }
+
+    static bool readNumber(const char* path, double* value)
+    {
+        FILE* file = fopen(path, "r");
+        if(file == NULL) return false;
+
+        char text[64];
+        bool ok = fgets(text, sizeof(text), file) != NULL;
+        fclose(file);
+
+        //"max" in cgroup v2 means no limit
+        if(!ok || text[0] < '0' || text[0] > '9') return false;
+        *value = strtod(text, NULL);
+        return true;
+    }
+
+    static bool readUsage(const char* usagePath, const char* limitPath, double* used, double* limit)
+    {
+        if(!readNumber(limitPath, limit) || *limit <= 0 || *limit >= kNoMemoryLimit) return false;
+        return readNumber(usagePath, used);
+    }
+
+    static bool readMeminfo(double* used, double* limit)
+    {
+        FILE* file = fopen("/proc/meminfo", "r");
+        if(file == NULL) return false;
+
+        double total = -1, available = -1;
+        char line[128];
+        while(fgets(line, sizeof(line), file) && (total < 0 || available < 0)) {
+            unsigned long long kb;
+            if(sscanf(line, "MemTotal: %llu kB", &kb) == 1) total = kb * 1024.0;
+            else if(sscanf(line, "MemAvailable: %llu kB", &kb) == 1) available = kb * 1024.0;
+        }
+        fclose(file);
+
+        if(total <= 0 || available < 0) return false;
+        *limit = total;
+        *used = total - available;
+        return true;
+    }
+
+    //Tell V8 when the level goes up, once per level until it drops again
+    void forwardPressure(ePressure level)
+    {
+        ePressure previous = pressure_;
+        pressure_ = level;
+        if(level <= previous) return;
+
+        notified_[level]++;
+        phase_ = eGC_PHASE_PRESSURE;
+#ifdef HAVE_MEMORY_PRESSURE_NOTIFICATION
+        isolate_->MemoryPressureNotification(level == ePRESSURE_CRITICAL ?
+            MemoryPressureLevel::kCritical : MemoryPressureLevel::kModerate);
+#else
+        if(level == ePRESSURE_CRITICAL) isolate_->LowMemoryNotification();
+#endif
+        phase_ = eGC_PHASE_ELSEWHERE;
+    }
+
+    static GcScheduler* of(Isolate* isolate)
+    {
+        return getIsolateData(isolate)->gc;
+    }
+
+    static void OnGCStart(Isolate* isolate, GCType type, GCCallbackFlags flags)
+    {
+        GcScheduler* self = of(isolate);
+        if(self) self->gcStart_ = nowMillis();
+    }
+
+    static void OnGCEnd(Isolate* isolate, GCType type, GCCallbackFlags flags)
+    {
+        GcScheduler* self = of(isolate);
+        if(self == NULL || self->gcStart_ == 0) return;
+
+        double pause = nowMillis() - self->gcStart_;
+        self->gcStart_ = 0;
+
+        ePhase phase = self->phase_;
+        self->counts_[phase]++;
+        self->pauses_[phase] += pause;
+        if(pause > self->maxPauses_[phase]) self->maxPauses_[phase] = pause;
+
+        //Allocation since the idle work finished, there may be more to do
+        if(phase != eGC_PHASE_IDLE) self->idleDone_ = false;
+    }
+
+    Isolate* isolate_;
+    GcPolicy policy_;
+    ePhase phase_;
+    double gcStart_;
+
+    uint64_t counts_[eGC_PHASE_COUNT];
+    double pauses_[eGC_PHASE_COUNT];
+    double maxPauses_[eGC_PHASE_COUNT];
+
+    uint64_t idleSlots_;
+    double idleOffered_;
+    bool idleDone_;
+    double idleDoneAt_;
+
+    double lastPoll_;
+    ePressure pressure_;
+    uint64_t notified_[ePRESSURE_CRITICAL + 1];
+};
+
+    /* The scheduler of this isolate, or NULL when GcPolicy::defaults() is off */
+GcScheduler* getGcScheduler(Isolate* isolate)
+{
+    if(!GcPolicy::defaults().any()) return NULL;
+
+    IsolateData* data = getIsolateData(isolate);
+    if(data->gc == NULL) {
+        data->gc = data->Own(new GcScheduler(isolate, GcPolicy::defaults()));
+    }
+    return data->gc;
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include "include/v8.h"
+#include <string>
+#include <vector>
+
+using namespace v8;
+using namespace std;
+
+/*
+    Per isolate state for the runtime helpers.
+
+    V8 only has a handful of isolate data slots, so everything we hang off
+    an isolate goes through this one struct in slot 0. Helpers are created
+    on first use, and whatever the struct owns is deleted (in reverse order)
+    by disposeIsolate, right before the isolate itself goes away.
+*/
+
+class OutputBuffer;
+class ObjectArena;
+class EventLoop;
+class MetricsRecorder;
+class Watchdog;
+class SharedBufferViews;
+class ModuleLoader;
+class NameCache;
+class WrapperRegistry;
+class GcScheduler;
+
+struct IsolateData {
+
+    IsolateData() : output(NULL), arena(NULL), loop(NULL), metrics(NULL), watchdog(NULL),
+                    sharedViews(NULL), modules(NULL), names(NULL), wrappers(NULL), gc(NULL) { }
+
+    ~IsolateData()
+    {
+        for(size_t i = owned_.size(); i > 0; --i) {
+            owned_[i - 1].destroy(owned_[i - 1].object);
+        }
+    }
+
+    //Hand a helper to the isolate, it is deleted along with it
+    template<class T> T* Own(T* object)
+    {
+        Owned entry = { object, &destroyObject<T> };
+        owned_.push_back(entry);
+        return object;
+    }
+
+    OutputBuffer* output;
+    ObjectArena* arena;
+    EventLoop* loop;
+    MetricsRecorder* metrics;
+    Watchdog* watchdog;
+    SharedBufferViews* sharedViews;
+    ModuleLoader* modules;
+    NameCache* names;
+    WrapperRegistry* wrappers;
+    GcScheduler* gc;
+
+    //The last error reportException printed, for per script summaries
+    string lastError;
+
+    //Element views handed out by PointArray.get()
+    Eternal<ObjectTemplate> pointViewTemplate;
+
+    //The runtime global, built once and stamped on every context
+    Eternal<ObjectTemplate> globalTemplate;
+
+private:
+    struct Owned {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    template<class T> static void destroyObject(void* object)
+    {
+        delete static_cast<T*>(object);
+    }
+
+    vector<Owned> owned_;
+};
+
+static const uint32_t kIsolateDataSlot = 0;
+
+IsolateData* getIsolateData(Isolate* isolate)
+{
+    IsolateData* data = static_cast<IsolateData*>(isolate->GetData(kIsolateDataSlot));
+    if(data == NULL) {
+        data = new IsolateData();
+        isolate->SetData(kIsolateDataSlot, data);
+    }
+    return data;
+}
+
+    /* Use instead of isolate->Dispose(), so buffered output gets flushed
+       and the helpers attached to the isolate are freed */
+void disposeIsolate(Isolate* isolate)
+{
+    IsolateData* data = static_cast<IsolateData*>(isolate->GetData(kIsolateDataSlot));
+    isolate->SetData(kIsolateDataSlot, NULL);
+    delete data;
+
+    isolate->Dispose();
+}
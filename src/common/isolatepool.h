@@ -0,0 +1,230 @@
+#pragma once
+#include "include/v8.h"
+#include <pthread.h>
+#include <sched.h>
+#include <deque>
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "runtime.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    A pool of isolates for running many independent scripts at once.
+
+    Every worker thread creates its own isolate and keeps it for the life of
+    the pool, so an isolate is only ever entered from the one thread it was
+    made on. A batch of scripts is dealt out round robin onto the per-worker
+    queues; a worker takes from the front of its own queue and, when that runs
+    dry, steals from the back of someone else's, so one slow script does not
+    leave the other cores idle. Each script runs in a fresh runtime context,
+    with the same source options (--copy-source, --stream, --module) as a
+    single script, and fails like a batch file does when one of its timer
+    callbacks throws or its event loop is stopped by the script limits.
+
+    Workers are pinned round robin to the CPUs the process may run on
+    (sched_getaffinity, so a cpuset or taskset is respected), and by default
+    there is one worker per such CPU.
+*/
+
+class IsolatePool {
+
+public:
+    //threads == 0 means one worker per CPU we may run on
+    IsolatePool(int threads, StartupData* snapshot = NULL, CodeCache* cache = NULL,
+                bool mapSource = true, bool stream = false, bool modules = false)
+        : snapshot_(snapshot), cache_(cache), mapSource_(mapSource), stream_(stream), modules_(modules),
+          scripts_(NULL), results_(NULL),
+          remaining_(0), generation_(0), stopping_(false)
+    {
+        cpus_ = allowedCpus();
+
+        if(threads <= 0) threads = (int)cpus_.size();
+        if(threads <= 0) threads = (int)thread::hardware_concurrency();
+        if(threads <= 0) threads = 1;
+
+        for(int i = 0; i < threads; ++i) {
+            workers_.push_back(new Worker());
+        }
+        for(int i = 0; i < threads; ++i) {
+            workers_[i]->runner = thread(&IsolatePool::workerMain, this, i);
+        }
+    }
+
+    ~IsolatePool()
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+
+        for(size_t i = 0; i < workers_.size(); ++i) {
+            workers_[i]->runner.join();
+            delete workers_[i];
+        }
+    }
+
+    int size() const { return (int)workers_.size(); }
+
+    //Runs every script and returns their results in the same order.
+    //Blocks until the whole batch is done.
+    vector<eScriptExecResult> Run(const vector<string> &scripts)
+    {
+        vector<eScriptExecResult> results(scripts.size(), eSCRIPT_ERROR_UNKNOWN);
+        if(scripts.empty()) return results;
+
+        unique_lock<mutex> lock(mutex_);
+        scripts_ = &scripts;
+        results_ = &results;
+        remaining_ = scripts.size();
+
+        for(size_t i = 0; i < scripts.size(); ++i) {
+            Worker* w = workers_[i % workers_.size()];
+            lock_guard<mutex> queueLock(w->lock);
+            w->jobs.push_back(i);
+        }
+
+        generation_++;
+        wake_.notify_all();
+        done_.wait(lock, [this] { return remaining_ == 0; });
+
+        scripts_ = NULL;
+        results_ = NULL;
+        return results;
+    }
+
+private:
+    struct Worker {
+        thread runner;
+        mutex lock;
+        deque<size_t> jobs;
+    };
+
+    //Own queue first, oldest job first. Otherwise steal the newest
+    //job of the next worker that has one.
+    bool nextJob(int index, size_t* job)
+    {
+        Worker* self = workers_[index];
+        {
+            lock_guard<mutex> lock(self->lock);
+            if(!self->jobs.empty()) {
+                *job = self->jobs.front();
+                self->jobs.pop_front();
+                return true;
+            }
+        }
+
+        for(size_t i = 1; i < workers_.size(); ++i) {
+            Worker* victim = workers_[(index + i) % workers_.size()];
+            lock_guard<mutex> lock(victim->lock);
+            if(!victim->jobs.empty()) {
+                *job = victim->jobs.back();
+                victim->jobs.pop_back();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void workerMain(int index)
+    {
+        //Keep each worker on its own CPU, out of the ones we are allowed
+        if(!cpus_.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus_[index % cpus_.size()], &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+
+        Isolate* isolate = createIsolate(snapshot_);
+        {
+            //reportException takes a Locker, so the isolate
+            //has to be locked by its thread the whole time.
+            Locker locker(isolate);
+            Isolate::Scope isolate_scope(isolate);
+
+            Game game;
+            CodeCache cache(cache_ ? cache_->dir() : string());
+            cache.setEnabled(cache_ != NULL && cache_->enabled());
+
+            unsigned seen = 0;
+            for(;;) {
+                {
+                    unique_lock<mutex> lock(mutex_);
+                    wake_.wait(lock, [&] { return stopping_ || generation_ != seen; });
+                    if(stopping_) break;
+                    seen = generation_;
+                }
+
+                size_t job;
+                while(nextJob(index, &job)) {
+                    eScriptExecResult result;
+                    {
+                        HandleScope handle_scope(isolate);
+                        game.Reset();
+                        Local<Context> context = createRuntimeContext(isolate, &game);
+                        Context::Scope context_scope(context);
+                        result = runScript(isolate, context, (*scripts_)[job], &cache);
+                    }
+
+                    lock_guard<mutex> lock(mutex_);
+                    (*results_)[job] = result;
+                    if(cache_) cache_->MergeStats(cache);
+                    if(--remaining_ == 0) done_.notify_all();
+                }
+            }
+        }
+        disposeIsolate(isolate);
+    }
+
+    //One script and its event loop. Like batch.h, a script that ran fine
+    //still fails when its callbacks threw or the loop ran over the limits.
+    eScriptExecResult runScript(Isolate* isolate, Local<Context> context,
+                                const string& filename, CodeCache* cache)
+    {
+        IsolateData* data = getIsolateData(isolate);
+        data->lastError.clear();
+
+        eScriptExecResult result = modules_
+            ? executeModule(isolate, context, filename)
+            : executeScript(isolate, context, filename, cache, mapSource_, NULL, stream_);
+
+        data->lastError.clear();
+        EventLoop* loop = getEventLoop(isolate);
+        loop->Run();
+
+        if(result == eSCRIPT_ERROR_NONE) {
+            if(loop->stoppedBy() != Watchdog::eLIMIT_NONE) {
+                result = limitResult(loop->stoppedBy());
+            } else if(!data->lastError.empty()) {
+                result = eSCRIPT_ERROR_CALLBACK_FAILED;
+            }
+        }
+        return result;
+    }
+
+    StartupData* snapshot_;
+    CodeCache* cache_;
+    bool mapSource_;
+    bool stream_;
+    bool modules_;
+    vector<Worker*> workers_;
+    vector<int> cpus_;          //the process's affinity mask, as CPU numbers
+
+    //Batch state, guarded by mutex_
+    mutex mutex_;
+    condition_variable wake_;
+    condition_variable done_;
+    const vector<string>* scripts_;
+    vector<eScriptExecResult>* results_;
+    size_t remaining_;
+    unsigned generation_;
+    bool stopping_;
+};
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdio.h>
+#include <string>
+
+using namespace std;
+
+    /* Append text as a quoted JSON string, for the hand written JSON
+       the metrics and profiles are made of */
+inline void appendJsonString(string* line, const string& text)
+{
+    *line += '"';
+    for(size_t i = 0; i < text.size(); ++i) {
+        unsigned char c = text[i];
+        if(c == '"' || c == '\\') {
+            *line += '\\';
+            *line += c;
+        } else if(c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            *line += escaped;
+        } else {
+            *line += c;
+        }
+    }
+    *line += '"';
+}
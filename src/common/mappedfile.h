@@ -0,0 +1,195 @@
+#pragma once
+#include "include/v8.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+
+using namespace v8;
+using namespace std;
+
+/*
+    Zero copy script loading.
+
+    The file is mapped read only and handed to V8 as an external string, so
+    the source bytes live in the page cache instead of being copied into a
+    std::string and then again onto the JS heap. Pure ASCII files (nearly all
+    generated code) are used in place as a one byte string. Files with other
+    UTF-8 in them are decoded once into a two byte buffer that V8 also treats
+    as external. Either way V8 disposes the resource when the string dies.
+*/
+
+class MappedFile {
+
+public:
+    //Returns NULL if the file can't be opened or mapped. A copy on write
+    //mapping can be written to, the changes stay private to the process.
+    static MappedFile* Open(const string &fileName, bool copyOnWrite = false)
+    {
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if(fd < 0) return NULL;
+
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            close(fd);
+            return NULL;
+        }
+
+        size_t size = (size_t)st.st_size;
+        void* data = NULL;
+
+        //mmap refuses empty files, an empty mapping is fine for us
+        if(size > 0) {
+            int protection = copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ;
+            data = mmap(NULL, size, protection, MAP_PRIVATE, fd, 0);
+            if(data == MAP_FAILED) {
+                close(fd);
+                return NULL;
+            }
+            madvise(data, size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+
+        return new MappedFile(static_cast<const char*>(data), size);
+    }
+
+    ~MappedFile()
+    {
+        if(data_) munmap(const_cast<char*>(data_), size_);
+    }
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    //True when every byte is 7 bit, checked a word at a time
+    bool isAscii() const
+    {
+        size_t i = 0;
+        for(; i + sizeof(uint64_t) <= size_; i += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, data_ + i, sizeof(word));
+            if(word & 0x8080808080808080ULL) return false;
+        }
+        for(; i < size_; ++i) {
+            if(data_[i] & 0x80) return false;
+        }
+        return true;
+    }
+
+private:
+    MappedFile(const char* data, size_t size) : data_(data), size_(size) { }
+
+    const char* data_;
+    size_t size_;
+};
+
+    /* Length of a UTF-8 byte order mark at the start of text, 0 or 3.
+       V8 would keep one as U+FEFF. Every loader skips it, so a file gives
+       the same string, and the same character positions as the streaming
+       parser, whichever way it is read. */
+static size_t utf8BomLength(const char* text, size_t size)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(text);
+    return size >= 3 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF ? 3 : 0;
+}
+
+    /* An ASCII file, used by V8 straight out of the mapping */
+class MappedOneByteResource : public String::ExternalOneByteStringResource {
+public:
+    explicit MappedOneByteResource(MappedFile* file) : file_(file) { }
+    virtual ~MappedOneByteResource() { delete file_; }
+
+    virtual const char* data() const { return file_->data(); }
+    virtual size_t length() const { return file_->size(); }
+
+private:
+    MappedFile* file_;
+};
+
+    /* A UTF-8 file with non ASCII text, decoded once to UTF-16 off the heap */
+class DecodedTwoByteResource : public String::ExternalStringResource {
+public:
+    explicit DecodedTwoByteResource(const MappedFile* file) : data_(NULL), length_(0)
+    {
+        //UTF-16 never needs more units than UTF-8 has bytes
+        data_ = static_cast<uint16_t*>(malloc(file->size() * sizeof(uint16_t)));
+        length_ = decode(reinterpret_cast<const uint8_t*>(file->data()), file->size(), data_);
+    }
+    virtual ~DecodedTwoByteResource() { free(data_); }
+
+    virtual const uint16_t* data() const { return data_; }
+    virtual size_t length() const { return length_; }
+
+private:
+    //Well formed UTF-8 only. Overlong forms, UTF-16 surrogates, code
+    //points past U+10FFFF and cut off sequences become one U+FFFD per
+    //offending byte, the way V8's own decoder treats them, so a file
+    //decodes to the same string here as through NewFromUtf8 or the
+    //streaming parser.
+    static size_t decode(const uint8_t* in, size_t size, uint16_t* out)
+    {
+        size_t o = 0;
+        size_t i = utf8BomLength(reinterpret_cast<const char*>(in), size);
+
+        while(i < size) {
+            uint32_t c = in[i];
+            if(c < 0x80) {
+                out[o++] = (uint16_t)c;
+                i++;
+                continue;
+            }
+
+            int extra;
+            uint32_t min;
+            if((c & 0xE0) == 0xC0) { c &= 0x1F; extra = 1; min = 0x80; }
+            else if((c & 0xF0) == 0xE0) { c &= 0x0F; extra = 2; min = 0x800; }
+            else if((c & 0xF8) == 0xF0) { c &= 0x07; extra = 3; min = 0x10000; }
+            else { extra = -1; min = 0; }
+
+            bool valid = extra > 0 && i + extra < size;
+            for(int k = 1; valid && k <= extra; ++k) {
+                if((in[i + k] & 0xC0) != 0x80) valid = false;
+                else c = (c << 6) | (in[i + k] & 0x3F);
+            }
+            if(valid && (c < min || (c >= 0xD800 && c <= 0xDFFF) || c > 0x10FFFF)) valid = false;
+
+            if(!valid) {
+                out[o++] = 0xFFFD;
+                i += 1;
+                continue;
+            }
+            i += 1 + extra;
+
+            if(c >= 0x10000) {
+                c -= 0x10000;
+                out[o++] = (uint16_t)(0xD800 + (c >> 10));
+                out[o++] = (uint16_t)(0xDC00 + (c & 0x3FF));
+            } else {
+                out[o++] = (uint16_t)c;
+            }
+        }
+
+        return o;
+    }
+
+    uint16_t* data_;
+    size_t length_;
+};
+
+struct SourceLoadInfo {
+    SourceLoadInfo() : bytes(0), micros(0), external(false), twoByte(false) { }
+
+    size_t bytes;       //size of the file
+    double micros;      //time to map (and decode) it
+    bool external;      //the string points outside the V8 heap
+    bool twoByte;       //the file was not pure ASCII
+};
+
+//Below this a plain copy is cheaper than setting up a mapping
+//and an external string for V8 to track.
+static const size_t kMinMappedSourceSize = 16 * 1024;
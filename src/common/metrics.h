@@ -0,0 +1,211 @@
+#pragma once
+#include "include/v8.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+//Included from common.h, after nowMicros()
+#include "isolatedata.h"
+#include "json.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    Per script metrics, written as one JSON line per script.
+
+    Turned on for the whole process with MetricsRecorder::output() (cli-script
+    --stats). Each isolate then gets a recorder on first use, which hooks GC
+    prologue/epilogue callbacks to time every pause. executeScript brackets
+    each script with Begin/End, which take HeapStatistics and per space
+    numbers on both sides; executeString adds its compile and run times.
+
+        {"script":"a.js","result":4,"compile_us":812.0,"run_us":90.5,
+         "gc":{"count":1,"scavenges":1,"mark_sweeps":0,"pause_us":310.2,"max_pause_us":310.2},
+         "heap_before":{...},"heap_after":{...},"spaces":[{"name":"new_space",...}]}
+
+    Times come from nowMicros() (common.h), in microseconds.
+*/
+
+class MetricsRecorder {
+
+public:
+    //Where JSON lines go, NULL (the default) records nothing
+    static FILE*& output()
+    {
+        static FILE* out = NULL;
+        return out;
+    }
+
+    explicit MetricsRecorder(Isolate* isolate) : isolate_(isolate), active_(false), gcStart_(0)
+    {
+        isolate_->AddGCPrologueCallback(OnGCStart);
+        isolate_->AddGCEpilogueCallback(OnGCEnd);
+    }
+
+    ~MetricsRecorder()
+    {
+        isolate_->RemoveGCPrologueCallback(OnGCStart);
+        isolate_->RemoveGCEpilogueCallback(OnGCEnd);
+    }
+
+    void Begin(const string& script)
+    {
+        script_ = script;
+        current_ = Current();
+        isolate_->GetHeapStatistics(&current_.heapBefore);
+        snapshotSpaces(&spacesBefore_);
+        active_ = true;
+    }
+
+    void AddCompile(double micros) { if(active_) current_.compileMicros += micros; }
+    void AddRun(double micros) { if(active_) current_.runMicros += micros; }
+
+    void End(int result)
+    {
+        if(!active_) return;
+        active_ = false;
+
+        isolate_->GetHeapStatistics(&current_.heapAfter);
+        vector<Space> spacesAfter;
+        snapshotSpaces(&spacesAfter);
+
+        string line;
+        char number[256];
+
+        line += "{\"script\":";
+        appendJsonString(&line, script_);
+        snprintf(number, sizeof(number), ",\"result\":%d,\"compile_us\":%.1f,\"run_us\":%.1f",
+                 result, current_.compileMicros, current_.runMicros);
+        line += number;
+
+        snprintf(number, sizeof(number),
+                 ",\"gc\":{\"count\":%d,\"scavenges\":%d,\"mark_sweeps\":%d,\"pause_us\":%.1f,\"max_pause_us\":%.1f}",
+                 current_.gcCount, current_.scavenges, current_.markSweeps,
+                 current_.gcPauseMicros, current_.gcMaxPauseMicros);
+        line += number;
+
+        line += ",\"heap_before\":";
+        appendHeap(&line, current_.heapBefore);
+        line += ",\"heap_after\":";
+        appendHeap(&line, current_.heapAfter);
+
+        line += ",\"spaces\":[";
+        for(size_t i = 0; i < spacesAfter.size(); ++i) {
+            const Space& after = spacesAfter[i];
+            Space before = i < spacesBefore_.size() ? spacesBefore_[i] : Space();
+
+            if(i > 0) line += ",";
+            line += "{\"name\":";
+            appendJsonString(&line, after.name);
+            snprintf(number, sizeof(number),
+                     ",\"size_before\":%zu,\"size_after\":%zu,\"used_before\":%zu,\"used_after\":%zu}",
+                     before.size, after.size, before.used, after.used);
+            line += number;
+        }
+        line += "]}\n";
+
+        //One write per line, so isolates on other threads don't interleave
+        FILE* out = output();
+        if(out) {
+            fwrite(line.data(), 1, line.size(), out);
+            fflush(out);
+        }
+    }
+
+private:
+    struct Space {
+        Space() : size(0), used(0) { }
+        string name;
+        size_t size;
+        size_t used;
+    };
+
+    struct Current {
+        Current() : compileMicros(0), runMicros(0), gcCount(0), scavenges(0), markSweeps(0),
+                    gcPauseMicros(0), gcMaxPauseMicros(0) { }
+
+        double compileMicros;
+        double runMicros;
+        int gcCount;
+        int scavenges;
+        int markSweeps;
+        double gcPauseMicros;
+        double gcMaxPauseMicros;
+        HeapStatistics heapBefore;
+        HeapStatistics heapAfter;
+    };
+
+    static MetricsRecorder* of(Isolate* isolate)
+    {
+        return getIsolateData(isolate)->metrics;
+    }
+
+    static void OnGCStart(Isolate* isolate, GCType type, GCCallbackFlags flags)
+    {
+        MetricsRecorder* self = of(isolate);
+        if(self) self->gcStart_ = nowMicros();
+    }
+
+    static void OnGCEnd(Isolate* isolate, GCType type, GCCallbackFlags flags)
+    {
+        MetricsRecorder* self = of(isolate);
+        if(self == NULL || !self->active_ || self->gcStart_ == 0) return;
+
+        double pause = nowMicros() - self->gcStart_;
+        self->gcStart_ = 0;
+
+        Current& current = self->current_;
+        current.gcCount++;
+        if(type == kGCTypeScavenge) current.scavenges++;
+        if(type == kGCTypeMarkSweepCompact) current.markSweeps++;
+        current.gcPauseMicros += pause;
+        if(pause > current.gcMaxPauseMicros) current.gcMaxPauseMicros = pause;
+    }
+
+    void snapshotSpaces(vector<Space>* spaces)
+    {
+        spaces->clear();
+        for(size_t i = 0; i < isolate_->NumberOfHeapSpaces(); ++i) {
+            HeapSpaceStatistics stats;
+            if(!isolate_->GetHeapSpaceStatistics(&stats, i)) continue;
+
+            Space space;
+            space.name = stats.space_name();
+            space.size = stats.space_size();
+            space.used = stats.space_used_size();
+            spaces->push_back(space);
+        }
+    }
+
+    static void appendHeap(string* line, HeapStatistics& heap)
+    {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer),
+                 "{\"total\":%zu,\"total_executable\":%zu,\"physical\":%zu,\"available\":%zu,\"used\":%zu,\"limit\":%zu}",
+                 heap.total_heap_size(), heap.total_heap_size_executable(), heap.total_physical_size(),
+                 heap.total_available_size(), heap.used_heap_size(), heap.heap_size_limit());
+        *line += buffer;
+    }
+
+    Isolate* isolate_;
+    string script_;
+    bool active_;
+    double gcStart_;
+    Current current_;
+    vector<Space> spacesBefore_;
+};
+
+    /* The recorder of this isolate, or NULL when metrics are off */
+MetricsRecorder* getMetricsRecorder(Isolate* isolate)
+{
+    if(MetricsRecorder::output() == NULL) return NULL;
+
+    IsolateData* data = getIsolateData(isolate);
+    if(data->metrics == NULL) {
+        data->metrics = data->Own(new MetricsRecorder(isolate));
+    }
+    return data->metrics;
+}
@@ -0,0 +1,520 @@
+#pragma once
+#include "include/v8.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "isolatedata.h"
+#include "common.h"
+#include "mappedfile.h"
+#include "streaming.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    Modules split over many files, loaded with require().
+
+        // main.js, run with cli-script --module main.js
+        var physics = require('./physics');      // ./physics.js
+        var ui = require('./ui');                // ./ui/index.js
+        module.exports = { ... };
+
+    This V8 has no ES module API (no import/export, no CompileModule), so
+    modules are the CommonJS kind: each file is compiled as the body of a
+    function(exports, require, module, __filename, __dirname), run once per
+    context, and what it leaves in module.exports is what require() returns.
+    Specifiers are paths, relative to the requiring file ('./x', '../x') or
+    absolute; '.js' and '/index.js' are tried after the name as given.
+
+    Compiled modules are kept per isolate, keyed by canonical path (symlinks
+    and '..' resolved), and reused by every later context on the isolate as
+    long as the file's size and modification time are unchanged. In the
+    daemon and in pools that means a module is compiled once per process.
+
+    Before the entry module runs, its import graph is prefetched:
+    a few threads read the files and pick out require('...') calls with a
+    quick scan (no parse, so a require in a comment is prefetched too,
+    which only costs the work). Each file found is handed straight to a
+    streamed compile (streaming.h), so the parses run on the platform's
+    background threads while the graph is still being walked. By the time
+    require() asks for a module its parse is usually done, and only the
+    finalize runs on the isolate's thread.
+*/
+
+class ModuleLoader {
+
+public:
+    struct Stats {
+        Stats() : compiled(0), streamed(0), cacheHits(0), discovered(0), discoveryMicros(0) { }
+        size_t compiled;        //modules compiled from source
+        size_t streamed;        //of those, parsed ahead by the prefetch
+        size_t cacheHits;       //require()s served by an earlier compile
+        size_t discovered;      //files found by the last prefetch
+        double discoveryMicros;
+    };
+
+    explicit ModuleLoader(Isolate* isolate) : isolate_(isolate) { }
+
+    ~ModuleLoader()
+    {
+        DropPending();
+        for(map<string, Compiled>::iterator i = compiled_.begin(); i != compiled_.end(); ++i) {
+            i->second.script.Reset();
+        }
+    }
+
+    const Stats& stats() const { return stats_; }
+
+    //Forget the parses the prefetch started for modules that were never
+    //required. The loader outlives the program, and a later program must
+    //not finish one of them against a file that changed since.
+    void DropPending()
+    {
+        for(map<string, Pending>::iterator i = pending_.begin(); i != pending_.end(); ++i) {
+            delete i->second.streamed;
+        }
+        pending_.clear();
+    }
+
+    void PrintStats(FILE* out) const
+    {
+        fprintf(out, "modules: %zu compiled (%zu streamed ahead), %zu cache hits, "
+                     "%zu files found in %.0fus\n",
+                stats_.compiled, stats_.streamed, stats_.cacheHits,
+                stats_.discovered, stats_.discoveryMicros);
+    }
+
+    //The wrapper around every module. The prefix stays on the first line,
+    //so line numbers in errors match the file.
+    static const char* prefix() { return "(function (exports, require, module, __filename, __dirname) { "; }
+    static const char* suffix() { return "\n})"; }
+
+    //The canonical path a specifier names, from a module in fromDir.
+    //Empty when there is no such file.
+    static string Resolve(const string& fromDir, const string& specifier)
+    {
+        string base;
+        if(!specifier.empty() && specifier[0] == '/') {
+            base = specifier;
+        } else if(specifier == "." || specifier == ".." ||
+                  specifier.compare(0, 2, "./") == 0 || specifier.compare(0, 3, "../") == 0) {
+            base = fromDir + "/" + specifier;
+        } else {
+            return string();
+        }
+
+        static const char* const extensions[] = { "", ".js", "/index.js" };
+        for(size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); ++i) {
+            string candidate = base + extensions[i];
+            struct stat st;
+            if(stat(candidate.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+            char canonical[PATH_MAX];
+            if(realpath(candidate.c_str(), canonical)) return canonical;
+        }
+        return string();
+    }
+
+    static string Dirname(const string& path)
+    {
+        size_t slash = path.rfind('/');
+        if(slash == string::npos) return ".";
+        if(slash == 0) return "/";
+        return path.substr(0, slash);
+    }
+
+    //Walk the import graph from entry (a canonical path) and start a
+    //streamed compile for every module that isn't compiled yet
+    void Prefetch(const string& entry)
+    {
+        double start = nowMicros();
+
+        Discovery discovery;
+        discovery.seen.insert(entry);
+        discovery.queue.push_back(entry);
+        discovery.found.push_back(entry);
+
+        unsigned threads = thread::hardware_concurrency();
+        if(threads == 0) threads = 2;
+        if(threads > kMaxDiscoveryThreads) threads = kMaxDiscoveryThreads;
+
+        vector<thread> walkers;
+        for(unsigned i = 0; i < threads; ++i) walkers.push_back(thread(discover, &discovery));
+
+        //Start parses as files turn up, while the walk goes on
+        unique_lock<mutex> lock(discovery.guard);
+        for(;;) {
+            discovery.foundSignal.wait(lock, [&] { return !discovery.found.empty() || discovery.done; });
+            if(discovery.found.empty()) break;
+
+            deque<string> batch;
+            batch.swap(discovery.found);
+            lock.unlock();
+            for(size_t i = 0; i < batch.size(); ++i) startStream(batch[i]);
+            lock.lock();
+        }
+        lock.unlock();
+
+        for(size_t i = 0; i < walkers.size(); ++i) walkers[i].join();
+
+        stats_.discovered = discovery.seen.size();
+        stats_.discoveryMicros = nowMicros() - start;
+    }
+
+    //module.exports of the module at path (canonical), running it in the
+    //current context if this context hasn't yet. cache is the context's
+    //module table. An empty handle means an exception was thrown.
+    Local<Value> Require(Local<Object> cache, const string& path)
+    {
+        EscapableHandleScope handle_scope(isolate_);
+
+        Local<String> key = String::NewFromUtf8(isolate_, path.c_str());
+        Local<String> exportsName = internName(isolate_, "exports");
+
+        //Already run here, or running (a cycle gets the partial exports)
+        Local<Value> loaded = cache->Get(key);
+        if(loaded->IsObject()) return handle_scope.Escape(loaded.As<Object>()->Get(exportsName));
+
+        Local<UnboundScript> unbound = compile(path);
+        if(unbound.IsEmpty()) return Local<Value>();
+
+        Local<Value> wrapper = unbound->BindToCurrentContext()->Run();
+        if(wrapper.IsEmpty() || !wrapper->IsFunction()) return Local<Value>();
+
+        Local<Object> module = Object::New(isolate_);
+        Local<Object> exports = Object::New(isolate_);
+        module->Set(exportsName, exports);
+        module->Set(internName(isolate_, "id"), key);
+        cache->Set(key, module);
+
+        Local<String> dirname = String::NewFromUtf8(isolate_, Dirname(path).c_str());
+        Local<Value> argv[5] = { exports, newRequire(cache, dirname), module, key, dirname };
+
+        if(wrapper.As<Function>()->Call(exports, 5, argv).IsEmpty()) {
+            //Let a later require() try again
+            cache->Delete(key);
+            return Local<Value>();
+        }
+
+        return handle_scope.Escape(module->Get(exportsName));
+    }
+
+    //A require function for modules in dirname, sharing the context's table
+    Local<Function> newRequire(Local<Object> cache, Local<String> dirname)
+    {
+        EscapableHandleScope handle_scope(isolate_);
+
+        Local<Array> data = Array::New(isolate_, 2);
+        data->Set(0, cache);
+        data->Set(1, dirname);
+
+        Local<Function> require = Function::New(isolate_, RequireCallback, data);
+        require->SetName(internName(isolate_, "require"));
+        return handle_scope.Escape(require);
+    }
+
+private:
+    static const unsigned kMaxDiscoveryThreads = 8;
+
+    struct Compiled {
+        Compiled() : size(0), mtime(0) { }
+        Persistent<UnboundScript, CopyablePersistentTraits<UnboundScript> > script;
+        off_t size;
+        time_t mtime;
+    };
+
+    //A parse started by the prefetch, and the file as it was then
+    struct Pending {
+        StreamedCompile* streamed;
+        off_t size;
+        time_t mtime;
+    };
+
+    //Shared by the walker threads and the thread starting parses
+    struct Discovery {
+        Discovery() : busy(0), done(false) { }
+        mutex guard;
+        condition_variable workSignal;
+        condition_variable foundSignal;
+        deque<string> queue;    //files still to scan
+        deque<string> found;    //files for the main thread to start parsing
+        set<string> seen;
+        int busy;
+        bool done;
+    };
+
+    static void discover(Discovery* discovery)
+    {
+        unique_lock<mutex> lock(discovery->guard);
+        for(;;) {
+            discovery->workSignal.wait(lock, [&] {
+                return !discovery->queue.empty() || discovery->busy == 0;
+            });
+
+            if(discovery->queue.empty()) {
+                //Nothing queued and nobody scanning, the walk is over
+                discovery->done = true;
+                discovery->workSignal.notify_all();
+                discovery->foundSignal.notify_all();
+                return;
+            }
+
+            string path = discovery->queue.front();
+            discovery->queue.pop_front();
+            discovery->busy++;
+            lock.unlock();
+
+            vector<string> dependencies;
+            scanFile(path, &dependencies);
+
+            lock.lock();
+            for(size_t i = 0; i < dependencies.size(); ++i) {
+                if(!discovery->seen.insert(dependencies[i]).second) continue;
+                discovery->queue.push_back(dependencies[i]);
+                discovery->found.push_back(dependencies[i]);
+            }
+            discovery->busy--;
+            discovery->workSignal.notify_all();
+            if(!dependencies.empty()) discovery->foundSignal.notify_one();
+        }
+    }
+
+    //The resolved paths of every require('literal') in a file
+    static void scanFile(const string& path, vector<string>* dependencies)
+    {
+        MappedFile* file = MappedFile::Open(path);
+        if(file == NULL) return;
+
+        const char* text = file->data();
+        size_t size = file->size();
+        string dir = Dirname(path);
+
+        static const char keyword[] = "require";
+        const size_t length = sizeof(keyword) - 1;
+
+        const char* at = text;
+        const char* end = text + size;
+        while((at = (const char*)memmem(at, end - at, keyword, length)) != NULL) {
+            //Not part of a longer name, and not a method called require
+            bool standalone = at == text || !(isalnum((unsigned char)at[-1]) || at[-1] == '_' ||
+                                              at[-1] == '$' || at[-1] == '.');
+            const char* p = at + length;
+            at = p;
+            if(!standalone) continue;
+
+            while(p < end && isspace((unsigned char)*p)) p++;
+            if(p >= end || *p != '(') continue;
+            p++;
+            while(p < end && isspace((unsigned char)*p)) p++;
+            if(p >= end || (*p != '\'' && *p != '"')) continue;
+
+            char quote = *p++;
+            const char* close = (const char*)memchr(p, quote, end - p);
+            if(close == NULL) break;
+
+            string resolved = Resolve(dir, string(p, close - p));
+            if(!resolved.empty()) dependencies->push_back(resolved);
+        }
+
+        delete file;
+    }
+
+    void startStream(const string& path)
+    {
+        if(pending_.count(path) || isFresh(path)) return;
+
+        struct stat st;
+        if(stat(path.c_str(), &st) != 0) return;
+
+        StreamedCompile* streamed = new StreamedCompile(isolate_, path, prefix(), suffix());
+        if(!streamed->Start()) {
+            delete streamed;
+            return;
+        }
+        Pending& entry = pending_[path];
+        entry.streamed = streamed;
+        entry.size = st.st_size;
+        entry.mtime = st.st_mtime;
+    }
+
+    bool isFresh(const string& path)
+    {
+        map<string, Compiled>::iterator found = compiled_.find(path);
+        if(found == compiled_.end()) return false;
+
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 &&
+               st.st_size == found->second.size && st.st_mtime == found->second.mtime;
+    }
+
+    //The compiled wrapper of a module, from the cache when the file is unchanged
+    Local<UnboundScript> compile(const string& path)
+    {
+        EscapableHandleScope handle_scope(isolate_);
+
+        if(isFresh(path)) {
+            stats_.cacheHits++;
+            return handle_scope.Escape(Local<UnboundScript>::New(isolate_, compiled_[path].script));
+        }
+
+        //Taken before the read, so a change while compiling makes it stale
+        struct stat st;
+        if(stat(path.c_str(), &st) != 0) {
+            st.st_size = 0;
+            st.st_mtime = 0;
+        }
+
+        Local<String> body = readFile(isolate_, path);
+        if(body.IsEmpty()) {
+            string message = "Cannot read module " + path;
+            isolate_->ThrowException(Exception::Error(String::NewFromUtf8(isolate_, message.c_str())));
+            return Local<UnboundScript>();
+        }
+
+        Local<String> source = String::Concat(String::Concat(String::NewFromUtf8(isolate_, prefix()), body),
+                                              String::NewFromUtf8(isolate_, suffix()));
+        ScriptOrigin origin(String::NewFromUtf8(isolate_, path.c_str()));
+
+        //A parse of the file as it was when the prefetch ran is only
+        //used when the file is still the same
+        StreamedCompile* streamed = NULL;
+        map<string, Pending>::iterator pending = pending_.find(path);
+        if(pending != pending_.end()) {
+            if(pending->second.size == st.st_size && pending->second.mtime == st.st_mtime) {
+                streamed = pending->second.streamed;
+            } else {
+                delete pending->second.streamed;
+            }
+            pending_.erase(pending);
+        }
+
+        Local<Script> script;
+        if(streamed) {
+            script = streamed->Finish(source, origin);
+            delete streamed;
+            stats_.streamed++;
+        } else {
+            ScriptCompiler::Source plain(source, origin);
+            script = ScriptCompiler::Compile(isolate_, &plain);
+        }
+        if(script.IsEmpty()) return Local<UnboundScript>();
+
+        stats_.compiled++;
+
+        Local<UnboundScript> unbound = script->GetUnboundScript();
+        Compiled& entry = compiled_[path];
+        entry.script.Reset(isolate_, unbound);
+        entry.size = st.st_size;
+        entry.mtime = st.st_mtime;
+
+        return handle_scope.Escape(unbound);
+    }
+
+    static void RequireCallback(const FunctionCallbackInfo<Value>& args);
+
+    Isolate* isolate_;
+    map<string, Compiled> compiled_;
+    map<string, Pending> pending_;
+    Stats stats_;
+};
+
+//Where a context keeps its module table
+static const int kModuleCacheSlot = 1;
+
+    /* The module loader of this isolate, created on first use */
+ModuleLoader* getModuleLoader(Isolate* isolate)
+{
+    IsolateData* data = getIsolateData(isolate);
+    if(data->modules == NULL) {
+        data->modules = data->Own(new ModuleLoader(isolate));
+    }
+    return data->modules;
+}
+
+    /* require(specifier) for scripts and modules */
+void ModuleLoader::RequireCallback(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+
+    Local<Array> data = args.Data().As<Array>();
+    Local<Object> cache = data->Get(0).As<Object>();
+    String::Utf8Value dirname(data->Get(1));
+    String::Utf8Value specifier(args[0]);
+
+    string path = *specifier ? Resolve(*dirname, *specifier) : string();
+    if(path.empty()) {
+        string message = string("Cannot find module '") + (*specifier ? *specifier : "") + "' from " + *dirname;
+        isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, message.c_str())));
+        return;
+    }
+
+    Local<Value> exports = getModuleLoader(isolate)->Require(cache, path);
+    if(!exports.IsEmpty()) args.GetReturnValue().Set(exports);
+}
+
+    /* Give a new context its module table and a global require() that
+       resolves from the working directory */
+void exposeRequire(Isolate* isolate, Local<Context> context)
+{
+    HandleScope handle_scope(isolate);
+
+    Local<Object> cache = Object::New(isolate);
+    context->SetEmbedderData(kModuleCacheSlot, cache);
+
+    char cwd[PATH_MAX];
+    const char* dir = getcwd(cwd, sizeof(cwd)) ? cwd : ".";
+
+    Local<Function> require = getModuleLoader(isolate)->newRequire(cache, String::NewFromUtf8(isolate, dir));
+    context->Global()->Set(internName(isolate, "require"), require);
+}
+
+    /* Run filename as the entry module of a program in context. The
+       import graph is prefetched first, see the top of this file. */
+eScriptExecResult executeModule(Isolate* isolate,
+                                Local<Context> context,
+                                const string &filename)
+{
+    return superviseScript(isolate, filename, [&]() {
+        HandleScope handle_scope(isolate);
+        Context::Scope context_scope(context);
+
+        char canonical[PATH_MAX];
+        if ( realpath(filename.c_str(), canonical) == NULL )
+        {
+            getOutputBuffer(isolate)->Printf("File dos not exist! %s\n", filename.c_str());
+            getOutputBuffer(isolate)->EndMessage();
+            return eSCRIPT_ERROR_NOT_FOUND;
+        }
+
+        ModuleLoader* loader = getModuleLoader(isolate);
+        loader->Prefetch(canonical);
+
+        TryCatch try_catch(isolate);
+        Local<Object> cache = context->GetEmbedderData(kModuleCacheSlot).As<Object>();
+        bool failed = loader->Require(cache, canonical).IsEmpty();
+
+        //Whatever the program didn't require by now was prefetched for nothing
+        loader->DropPending();
+
+        if ( failed )
+        {
+            reportException(isolate, &try_catch);
+            return eSCRIPT_ERROR_COMPILE_FAILED;
+        }
+        return eSCRIPT_ERROR_NONE;
+    });
+}
@@ -0,0 +1,259 @@
+#pragma once
+#include "include/v8.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "isolatedata.h"
+#include "stringconv.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    Pooled native objects that are freed when their JS wrapper is collected.
+
+    newWrapped<T>() places a T in a size class slot of the isolate's arena,
+    together with a weak handle to its wrapper. Once the garbage collector
+    finds the wrapper unreachable the T is destroyed and its slot goes back
+    on the free list for the next object of that size, so a script that keeps
+    making temporary points settles at a steady footprint instead of growing.
+    The native bytes are reported to V8 as external memory, which lets the
+    collector account for them when deciding when to run.
+
+    Objects whose wrapper is still alive when the isolate is disposed are
+    destroyed with the arena, pooled or not, so what they own is freed too.
+*/
+
+class ObjectArena;
+
+//Header of every object in an arena, linking the live ones together
+struct ArenaObject {
+    ArenaObject* prev;
+    ArenaObject* next;
+    void (*destroy)(ObjectArena* arena, ArenaObject* object);
+};
+
+class ObjectArena {
+
+public:
+    struct Counters {
+        size_t live;            //objects currently bound to a wrapper
+        size_t pooled;          //free slots ready for reuse
+        size_t freed;           //objects reclaimed after their wrapper died
+        int64_t externalBytes;  //what we told V8 about
+    };
+
+    ObjectArena() : objects_(NULL)
+    {
+        memset(&counters_, 0, sizeof(counters_));
+        for(int i = 0; i < kClassCount; ++i) freeLists_[i] = NULL;
+    }
+
+    ~ObjectArena()
+    {
+        //Wrappers the GC never got to, the isolate is going away
+        while(objects_ != NULL) {
+            ArenaObject* object = objects_;
+            Untrack(object);
+            object->destroy(this, object);
+        }
+
+        for(size_t i = 0; i < blocks_.size(); ++i) free(blocks_[i]);
+    }
+
+    const Counters& counters() const { return counters_; }
+
+    void* Allocate(size_t size)
+    {
+        counters_.live++;
+
+        int sizeClass = classOf(size);
+        if(sizeClass < 0) return malloc(size);
+
+        if(freeLists_[sizeClass] == NULL) refill(sizeClass);
+
+        Slot* slot = freeLists_[sizeClass];
+        freeLists_[sizeClass] = slot->next;
+        counters_.pooled--;
+        return slot;
+    }
+
+    void Free(void* memory, size_t size)
+    {
+        counters_.live--;
+        counters_.freed++;
+
+        int sizeClass = classOf(size);
+        if(sizeClass < 0) {
+            free(memory);
+            return;
+        }
+
+        Slot* slot = static_cast<Slot*>(memory);
+        slot->next = freeLists_[sizeClass];
+        freeLists_[sizeClass] = slot;
+        counters_.pooled++;
+    }
+
+    //Link a constructed object in, destroy runs it down and frees it
+    //if it is still here when the arena goes
+    void Track(ArenaObject* object, void (*destroy)(ObjectArena*, ArenaObject*))
+    {
+        object->destroy = destroy;
+        object->prev = NULL;
+        object->next = objects_;
+        if(objects_) objects_->prev = object;
+        objects_ = object;
+    }
+
+    void Untrack(ArenaObject* object)
+    {
+        if(object->prev) object->prev->next = object->next;
+        else objects_ = object->next;
+        if(object->next) object->next->prev = object->prev;
+    }
+
+    void AdjustExternal(Isolate* isolate, int64_t bytes)
+    {
+        counters_.externalBytes += bytes;
+        isolate->AdjustAmountOfExternalAllocatedMemory(bytes);
+    }
+
+    void PrintCounters(FILE* out) const
+    {
+        fprintf(out, "native objects: %zu live, %zu pooled, %zu freed, %lld external bytes\n",
+                counters_.live, counters_.pooled, counters_.freed,
+                (long long)counters_.externalBytes);
+    }
+
+private:
+    //Size classes of 16, 32, 64 ... 512 bytes, larger objects use malloc
+    static const int kClassCount = 6;
+    static const size_t kMinClassSize = 16;
+    static const size_t kBlockSize = 16 * 1024;
+
+    struct Slot {
+        Slot* next;
+    };
+
+    static int classOf(size_t size)
+    {
+        size_t classSize = kMinClassSize;
+        for(int i = 0; i < kClassCount; ++i, classSize *= 2) {
+            if(size <= classSize) return i;
+        }
+        return -1;
+    }
+
+    //Carve a fresh block into slots of one class
+    void refill(int sizeClass)
+    {
+        size_t classSize = kMinClassSize << sizeClass;
+        char* block = static_cast<char*>(malloc(kBlockSize));
+        if(block == NULL) abort();
+        blocks_.push_back(block);
+
+        for(size_t offset = 0; offset + classSize <= kBlockSize; offset += classSize) {
+            Slot* slot = reinterpret_cast<Slot*>(block + offset);
+            slot->next = freeLists_[sizeClass];
+            freeLists_[sizeClass] = slot;
+            counters_.pooled++;
+        }
+    }
+
+    Slot* freeLists_[kClassCount];
+    vector<char*> blocks_;
+    ArenaObject* objects_;
+    Counters counters_;
+};
+
+    /* The arena of this isolate, created on first use */
+ObjectArena* getObjectArena(Isolate* isolate)
+{
+    IsolateData* data = getIsolateData(isolate);
+    if(data->arena == NULL) {
+        data->arena = data->Own(new ObjectArena());
+    }
+    return data->arena;
+}
+
+//How many bytes an object holds outside the JS heap. Types that own
+//buffers of their own overload this.
+template<class T> size_t externalSize(const T* object) { return sizeof(T); }
+
+//A native object and the weak handle to its wrapper, in one slot
+template<class T> struct Wrapped : public ArenaObject {
+
+    template<class... Args> Wrapped(Args&&... args) : object(std::forward<Args>(args)...) { }
+
+    //First pass, the wrapper is dead. V8 only allows dropping the handle here.
+    static void WeakCallback(const WeakCallbackInfo<Wrapped<T> >& info)
+    {
+        Wrapped<T>* wrapped = info.GetParameter();
+        wrapped->handle.Reset();
+        info.SetSecondPassCallback(FreeCallback);
+    }
+
+    //Second pass, now the object can be destroyed and its slot recycled
+    static void FreeCallback(const WeakCallbackInfo<Wrapped<T> >& info)
+    {
+        Wrapped<T>* wrapped = info.GetParameter();
+        Isolate* isolate = info.GetIsolate();
+        ObjectArena* arena = getObjectArena(isolate);
+
+        arena->AdjustExternal(isolate, -(int64_t)externalSize(&wrapped->object));
+        arena->Untrack(wrapped);
+        Destroy(arena, wrapped);
+    }
+
+    //Also called by the arena for objects still alive at isolate teardown
+    static void Destroy(ObjectArena* arena, ArenaObject* object)
+    {
+        Wrapped<T>* wrapped = static_cast<Wrapped<T>*>(object);
+        wrapped->handle.Reset();    //no weak callback into freed memory later
+        wrapped->~Wrapped<T>();
+        arena->Free(wrapped, sizeof(Wrapped<T>));
+    }
+
+    Persistent<Object> handle;
+    T object;
+};
+
+    /* Make a T for the wrapper object, owned by the wrapper from now on.
+       The caller still stores the pointer in the wrapper's internal field. */
+template<class T, class... Args>
+T* newWrapped(Isolate* isolate, Local<Object> wrapper, Args&&... args)
+{
+    ObjectArena* arena = getObjectArena(isolate);
+
+    void* memory = arena->Allocate(sizeof(Wrapped<T>));
+    Wrapped<T>* wrapped = new (memory) Wrapped<T>(std::forward<Args>(args)...);
+    arena->Track(wrapped, Wrapped<T>::Destroy);
+
+    wrapped->handle.Reset(isolate, wrapper);
+    wrapped->handle.SetWeak(wrapped, Wrapped<T>::WeakCallback, WeakCallbackType::kParameter);
+
+    arena->AdjustExternal(isolate, (int64_t)externalSize(&wrapped->object));
+    return &wrapped->object;
+}
+
+    /* nativeStats() for scripts, the arena counters as an object */
+static void nativeStats(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+
+    const ObjectArena::Counters& counters = getObjectArena(isolate)->counters();
+
+    Local<Object> stats = Object::New(isolate);
+    stats->Set(internName(isolate, "live"), Number::New(isolate, (double)counters.live));
+    stats->Set(internName(isolate, "pooled"), Number::New(isolate, (double)counters.pooled));
+    stats->Set(internName(isolate, "freed"), Number::New(isolate, (double)counters.freed));
+    stats->Set(internName(isolate, "externalBytes"), Number::New(isolate, (double)counters.externalBytes));
+    args.GetReturnValue().Set(stats);
+}
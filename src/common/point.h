@@ -0,0 +1,40 @@
+#pragma once
+#include "include/v8.h"
+
+#include "binding.h"
+
+using namespace v8;
+
+/*
+    A simple native type, exposed to scripts as a constructor.
+    Used by expose-types, and installed by the runtime for cli-script.
+
+        var position = new Point(10, 15);
+        position.x = 20;
+*/
+
+class Point {
+    public:
+        Point(int x, int y) : x_(x), y_(y) { }
+        int x_, y_;
+};
+
+//The constructor and the x/y accessors are generated from the members
+//by binding.h, so there is no hand written callback to get out of sync.
+static void exposePoint(Isolate* isolate, Handle<ObjectTemplate> context) {
+    HandleScope scope(isolate);
+
+    //new Point(x, y) makes a pooled Point, which goes back to the isolate's
+    //pool once the script drops the last reference to it.
+    Local<FunctionTemplate> point_templ = FunctionTemplate::New(isolate, Constructor<Point, int, int>::New);
+    point_templ->SetClassName(internName(isolate, "Point"));
+    Local<ObjectTemplate> obj = point_templ->InstanceTemplate();
+    obj->SetInternalFieldCount(kWrapperFieldCount);
+
+    // Set accessors
+    bindField<Point, int, &Point::x_>(isolate, obj, "x");
+    bindField<Point, int, &Point::y_>(isolate, obj, "y");
+
+    // Register constructor
+    context->Set(internName(isolate, "Point"), point_templ);
+}
@@ -0,0 +1,442 @@
+#pragma once
+#include "include/v8.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "isolatedata.h"
+#include "binding.h"
+
+using namespace v8;
+
+/*
+    Many points at once, stored as a structure of arrays.
+
+    Where a Point is one heap object per position, a PointArray keeps every x
+    in one contiguous buffer and every y in another, so the bulk operations
+    below run as SIMD loops over plain doubles and never touch the JS heap.
+
+        var points = new PointArray(100000);
+        points.set(0, 10, 15);
+        points.translate(1, -1);
+        points.scale(2);
+        var d = points.distanceTo(0, 0);   // Float64Array, one per point
+        var box = points.bounds();         // { minX, minY, maxX, maxY }
+
+    get(i) returns a view on element i with the same x and y as a Point.
+    Every call makes a new view, a small object with two internal fields
+    from a template shared by the isolate, so views behave like separate
+    points:
+
+        var a = points.get(5), b = points.get(6);
+        a.x += b.x;
+
+    Lengths above kMaxPointArrayLength, and anything that isn't a finite
+    number, throw a RangeError, as does running out of memory.
+*/
+
+//2^27 points, 2GB of coordinates
+static const size_t kMaxPointArrayLength = (size_t)1 << 27;
+
+class PointArray {
+
+public:
+    //Check length() afterwards, it stays 0 when the memory can't be had
+    explicit PointArray(size_t length) : xs_(NULL), ys_(NULL), length_(0), capacity_(0)
+    {
+        if(!reserve(length)) return;
+        memset(xs_, 0, length * sizeof(double));
+        memset(ys_, 0, length * sizeof(double));
+        length_ = length;
+    }
+
+    ~PointArray()
+    {
+        free(xs_);
+        free(ys_);
+    }
+
+    size_t length() const { return length_; }
+    size_t capacityBytes() const { return capacity_ * 2 * sizeof(double); }
+    double* xs() { return xs_; }
+    double* ys() { return ys_; }
+
+    //false when the array is full or out of memory
+    bool push(double x, double y)
+    {
+        if(length_ == capacity_) {
+            if(length_ >= kMaxPointArrayLength) return false;
+            size_t grown = capacity_ ? capacity_ * 2 : 16;
+            if(grown > kMaxPointArrayLength) grown = kMaxPointArrayLength;
+            if(!reserve(grown)) return false;
+        }
+        xs_[length_] = x;
+        ys_[length_] = y;
+        length_++;
+        return true;
+    }
+
+    void translate(double dx, double dy)
+    {
+        size_t i = 0;
+#ifdef __SSE2__
+        __m128d vdx = _mm_set1_pd(dx);
+        __m128d vdy = _mm_set1_pd(dy);
+        for(; i + 2 <= length_; i += 2) {
+            _mm_store_pd(xs_ + i, _mm_add_pd(_mm_load_pd(xs_ + i), vdx));
+            _mm_store_pd(ys_ + i, _mm_add_pd(_mm_load_pd(ys_ + i), vdy));
+        }
+#endif
+        for(; i < length_; ++i) {
+            xs_[i] += dx;
+            ys_[i] += dy;
+        }
+    }
+
+    void scale(double sx, double sy)
+    {
+        size_t i = 0;
+#ifdef __SSE2__
+        __m128d vsx = _mm_set1_pd(sx);
+        __m128d vsy = _mm_set1_pd(sy);
+        for(; i + 2 <= length_; i += 2) {
+            _mm_store_pd(xs_ + i, _mm_mul_pd(_mm_load_pd(xs_ + i), vsx));
+            _mm_store_pd(ys_ + i, _mm_mul_pd(_mm_load_pd(ys_ + i), vsy));
+        }
+#endif
+        for(; i < length_; ++i) {
+            xs_[i] *= sx;
+            ys_[i] *= sy;
+        }
+    }
+
+    //out needs room for length() doubles
+    void distanceTo(double px, double py, double* out) const
+    {
+        size_t i = 0;
+#ifdef __SSE2__
+        __m128d vpx = _mm_set1_pd(px);
+        __m128d vpy = _mm_set1_pd(py);
+        for(; i + 2 <= length_; i += 2) {
+            __m128d dx = _mm_sub_pd(_mm_load_pd(xs_ + i), vpx);
+            __m128d dy = _mm_sub_pd(_mm_load_pd(ys_ + i), vpy);
+            __m128d d2 = _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy));
+            _mm_storeu_pd(out + i, _mm_sqrt_pd(d2));
+        }
+#endif
+        for(; i < length_; ++i) {
+            double dx = xs_[i] - px;
+            double dy = ys_[i] - py;
+            out[i] = sqrt(dx * dx + dy * dy);
+        }
+    }
+
+    //Returns false for an empty array
+    bool bounds(double* minX, double* minY, double* maxX, double* maxY) const
+    {
+        if(length_ == 0) return false;
+
+        double lx = DBL_MAX, ly = DBL_MAX, hx = -DBL_MAX, hy = -DBL_MAX;
+        size_t i = 0;
+#ifdef __SSE2__
+        __m128d vlx = _mm_set1_pd(lx), vly = _mm_set1_pd(ly);
+        __m128d vhx = _mm_set1_pd(hx), vhy = _mm_set1_pd(hy);
+        for(; i + 2 <= length_; i += 2) {
+            __m128d x = _mm_load_pd(xs_ + i);
+            __m128d y = _mm_load_pd(ys_ + i);
+            vlx = _mm_min_pd(vlx, x);
+            vhx = _mm_max_pd(vhx, x);
+            vly = _mm_min_pd(vly, y);
+            vhy = _mm_max_pd(vhy, y);
+        }
+
+        //Fold the two lanes together
+        double lanes[2];
+        _mm_storeu_pd(lanes, vlx); lx = fmin(lanes[0], lanes[1]);
+        _mm_storeu_pd(lanes, vly); ly = fmin(lanes[0], lanes[1]);
+        _mm_storeu_pd(lanes, vhx); hx = fmax(lanes[0], lanes[1]);
+        _mm_storeu_pd(lanes, vhy); hy = fmax(lanes[0], lanes[1]);
+#endif
+        for(; i < length_; ++i) {
+            lx = fmin(lx, xs_[i]);
+            hx = fmax(hx, xs_[i]);
+            ly = fmin(ly, ys_[i]);
+            hy = fmax(hy, ys_[i]);
+        }
+
+        *minX = lx; *minY = ly; *maxX = hx; *maxY = hy;
+        return true;
+    }
+
+private:
+    //false, with the array unchanged, when the memory can't be had
+    bool reserve(size_t capacity)
+    {
+        if(capacity <= capacity_ && xs_ != NULL) return true;
+        if(capacity == 0) capacity = 1;
+        if(capacity > kMaxPointArrayLength) return false;
+
+        //16 byte alignment so the SIMD loops can use aligned loads
+        double* xs = NULL;
+        double* ys = NULL;
+        if(posix_memalign((void**)&xs, 16, capacity * sizeof(double)) != 0) return false;
+        if(posix_memalign((void**)&ys, 16, capacity * sizeof(double)) != 0) {
+            free(xs);
+            return false;
+        }
+
+        if(length_ > 0) {
+            memcpy(xs, xs_, length_ * sizeof(double));
+            memcpy(ys, ys_, length_ * sizeof(double));
+        }
+        free(xs_);
+        free(ys_);
+
+        xs_ = xs;
+        ys_ = ys;
+        capacity_ = capacity;
+        return true;
+    }
+
+    double* xs_;
+    double* ys_;
+    size_t length_;
+    size_t capacity_;
+};
+
+//The coordinate buffers count as external memory too
+template<> size_t externalSize(const PointArray* points)
+{
+    return sizeof(PointArray) + points->capacityBytes();
+}
+
+//Internal fields of a PointArray wrapper, and of an element view. A view
+//keeps its array alive through its field, no persistent handle needed.
+enum {
+    kPointArrayNative = kNativeField,
+    kPointArrayType = kTypeField,
+    kPointArrayFieldCount
+};
+
+enum {
+    kPointViewArray = 0,
+    kPointViewIndex,
+    kPointViewFieldCount
+};
+
+static PointArray* UnwrapPointArray(Local<Object> jsObject)
+{
+    return Unwrap<PointArray>(jsObject);
+}
+
+static bool checkPointIndex(Isolate* isolate, PointArray* points, Local<Value> value, size_t* index)
+{
+    double i = value->NumberValue();
+    if(!(i >= 0 && i < (double)points->length())) {
+        isolate->ThrowException(Exception::RangeError(String::NewFromUtf8(isolate, "PointArray index out of range")));
+        return false;
+    }
+    *index = (size_t)i;
+    return true;
+}
+
+static double numberArg(const FunctionCallbackInfo<Value>& args, int index, double fallback)
+{
+    if(args.Length() > index && args[index]->IsNumber()) return args[index]->NumberValue();
+    return fallback;
+}
+
+static void PointArrayConstructor(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+
+    if(!args.IsConstructCall()) {
+        isolate->ThrowException(Exception::TypeError(String::NewFromUtf8(isolate, "PointArray needs new")));
+        return;
+    }
+
+    //Checked as a double, a NaN or huge length has no size_t to become
+    double length = numberArg(args, 0, 0);
+    if(!(length >= 0 && length <= (double)kMaxPointArrayLength)) {
+        isolate->ThrowException(Exception::RangeError(String::NewFromUtf8(isolate, "Invalid PointArray length")));
+        return;
+    }
+
+    PointArray* points = newWrapped<PointArray>(isolate, args.This(), (size_t)length);
+    Wrap(args.This(), points);
+
+    if(points->length() != (size_t)length) {
+        isolate->ThrowException(Exception::RangeError(String::NewFromUtf8(isolate, "PointArray: out of memory")));
+    }
+}
+
+static void GetPointArrayLength(Local<String> property,
+             const PropertyCallbackInfo<Value>& info) {
+    info.GetReturnValue().Set((double)UnwrapPointArray(info.Holder())->length());
+}
+
+static void PointArrayGet(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    PointArray* points = UnwrapPointArray(args.Holder());
+
+    size_t index;
+    if(!checkPointIndex(isolate, points, args[0], &index)) return;
+
+    //A fresh view pointing back at the array, plus the index it shows
+    Local<ObjectTemplate> viewTemplate = getIsolateData(isolate)->pointViewTemplate.Get(isolate);
+    Local<Object> view = viewTemplate->NewInstance();
+    view->SetInternalField(kPointViewArray, args.Holder());
+    view->SetInternalField(kPointViewIndex, Integer::New(isolate, (int)index));
+    args.GetReturnValue().Set(view);
+}
+
+static void PointArraySet(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    PointArray* points = UnwrapPointArray(args.Holder());
+
+    size_t index;
+    if(!checkPointIndex(isolate, points, args[0], &index)) return;
+
+    points->xs()[index] = numberArg(args, 1, 0);
+    points->ys()[index] = numberArg(args, 2, 0);
+}
+
+static void PointArrayPush(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    PointArray* points = UnwrapPointArray(args.Holder());
+
+    //Growing the buffers changes how much external memory we hold
+    size_t before = points->capacityBytes();
+    if(!points->push(numberArg(args, 0, 0), numberArg(args, 1, 0))) {
+        isolate->ThrowException(Exception::RangeError(String::NewFromUtf8(isolate, "PointArray: out of memory")));
+        return;
+    }
+    if(points->capacityBytes() != before) {
+        getObjectArena(isolate)->AdjustExternal(isolate, (int64_t)points->capacityBytes() - (int64_t)before);
+    }
+
+    args.GetReturnValue().Set((double)points->length());
+}
+
+static void PointArrayTranslate(const FunctionCallbackInfo<Value>& args)
+{
+    UnwrapPointArray(args.Holder())->translate(numberArg(args, 0, 0), numberArg(args, 1, 0));
+}
+
+static void PointArrayScale(const FunctionCallbackInfo<Value>& args)
+{
+    //scale(s) scales both axes, scale(sx, sy) each on its own
+    double sx = numberArg(args, 0, 1);
+    UnwrapPointArray(args.Holder())->scale(sx, numberArg(args, 1, sx));
+}
+
+static void PointArrayDistanceTo(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+    PointArray* points = UnwrapPointArray(args.Holder());
+
+    //The kernel writes straight into the backing store of the result
+    size_t length = points->length();
+    Local<ArrayBuffer> buffer = ArrayBuffer::New(isolate, length * sizeof(double));
+    points->distanceTo(numberArg(args, 0, 0), numberArg(args, 1, 0),
+                       static_cast<double*>(buffer->GetContents().Data()));
+
+    args.GetReturnValue().Set(Float64Array::New(buffer, 0, length));
+}
+
+static void PointArrayBounds(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+
+    double minX, minY, maxX, maxY;
+    if(!UnwrapPointArray(args.Holder())->bounds(&minX, &minY, &maxX, &maxY)) return;
+
+    Local<Object> box = Object::New(isolate);
+    box->Set(internName(isolate, "minX"), Number::New(isolate, minX));
+    box->Set(internName(isolate, "minY"), Number::New(isolate, minY));
+    box->Set(internName(isolate, "maxX"), Number::New(isolate, maxX));
+    box->Set(internName(isolate, "maxY"), Number::New(isolate, maxY));
+    args.GetReturnValue().Set(box);
+}
+
+//The view accessors, x and y of whichever element the view is on
+static PointArray* UnwrapPointView(Local<Object> view, int* index)
+{
+    *index = view->GetInternalField(kPointViewIndex)->Int32Value();
+    return UnwrapPointArray(Local<Object>::Cast(view->GetInternalField(kPointViewArray)));
+}
+
+static void GetPointViewX(Local<String> property,
+             const PropertyCallbackInfo<Value>& info) {
+    int index;
+    PointArray* points = UnwrapPointView(info.Holder(), &index);
+    info.GetReturnValue().Set(points->xs()[index]);
+}
+
+static void SetPointViewX(Local<String> property, Local<Value> value,
+             const PropertyCallbackInfo<void>& info) {
+    int index;
+    PointArray* points = UnwrapPointView(info.Holder(), &index);
+    points->xs()[index] = value->NumberValue();
+}
+
+static void GetPointViewY(Local<String> property,
+             const PropertyCallbackInfo<Value>& info) {
+    int index;
+    PointArray* points = UnwrapPointView(info.Holder(), &index);
+    info.GetReturnValue().Set(points->ys()[index]);
+}
+
+static void SetPointViewY(Local<String> property, Local<Value> value,
+             const PropertyCallbackInfo<void>& info) {
+    int index;
+    PointArray* points = UnwrapPointView(info.Holder(), &index);
+    points->ys()[index] = value->NumberValue();
+}
+
+static void exposePointArray(Isolate* isolate, Handle<ObjectTemplate> context) {
+    HandleScope scope(isolate);
+
+    Local<FunctionTemplate> array_templ = FunctionTemplate::New(isolate, PointArrayConstructor);
+    array_templ->SetClassName(internName(isolate, "PointArray"));
+    Local<ObjectTemplate> obj = array_templ->InstanceTemplate();
+    obj->SetInternalFieldCount(kPointArrayFieldCount);
+    obj->SetAccessor(internName(isolate, "length"), GetPointArrayLength);
+
+    // Bulk operations live on the prototype, shared by every array. The
+    // signature keeps them from being called on anything but a PointArray.
+    Local<ObjectTemplate> proto = array_templ->PrototypeTemplate();
+    Local<Signature> self = Signature::New(isolate, array_templ);
+    bindFunction(isolate, proto, "get", PointArrayGet, self);
+    bindFunction(isolate, proto, "set", PointArraySet, self);
+    bindFunction(isolate, proto, "push", PointArrayPush, self);
+    bindFunction(isolate, proto, "translate", PointArrayTranslate, self);
+    bindFunction(isolate, proto, "scale", PointArrayScale, self);
+    bindFunction(isolate, proto, "distanceTo", PointArrayDistanceTo, self);
+    bindFunction(isolate, proto, "bounds", PointArrayBounds, self);
+
+    // The element view, same x and y as Point. One template per isolate,
+    // however many contexts get PointArray.
+    IsolateData* data = getIsolateData(isolate);
+    if(data->pointViewTemplate.IsEmpty()) {
+        Local<ObjectTemplate> view = ObjectTemplate::New(isolate);
+        view->SetInternalFieldCount(kPointViewFieldCount);
+        view->SetAccessor(internName(isolate, "x"), GetPointViewX, SetPointViewX);
+        view->SetAccessor(internName(isolate, "y"), GetPointViewY, SetPointViewY);
+        data->pointViewTemplate.Set(isolate, view);
+    }
+
+    // Register constructor
+    context->Set(internName(isolate, "PointArray"), array_templ);
+}
@@ -0,0 +1,265 @@
+#pragma once
+#include "include/v8.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <vector>
+
+#include "isolatedata.h"
+#include "frames.h"
+#include "stringconv.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    Buffered output for print() and everything else a runner writes to stdout.
+
+    Text is appended to per isolate chunks and written out with one writev
+    once a batch has built up, at exit, or when a script calls flush(). In
+    line buffered mode (the default when stdout is a terminal) every print is
+    written straight away, like the old printf was. All stdout writes made
+    while a script runs should go through here, or they will come out of order.
+
+    Pointed at a daemon client's socket, each flush goes out as one output
+    frame (see frames.h) instead of raw bytes.
+*/
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+class OutputBuffer {
+
+public:
+    enum eOutputMode {
+        eOUTPUT_AUTO = 0,       //line buffered on a terminal, batched otherwise
+        eOUTPUT_LINE_BUFFERED,
+        eOUTPUT_BATCHED
+    };
+
+    OutputBuffer(int fd = STDOUT_FILENO)
+        : fd_(fd), frameType_(0), batchSize_(kDefaultBatchSize), active_(0), pending_(0)
+    {
+        eOutputMode mode = defaultMode();
+        lineBuffered_ = mode == eOUTPUT_AUTO ? isatty(fd) != 0 : mode == eOUTPUT_LINE_BUFFERED;
+    }
+
+    //The mode new buffers start in, for every isolate in the process
+    static eOutputMode& defaultMode()
+    {
+        static eOutputMode mode = eOUTPUT_AUTO;
+        return mode;
+    }
+
+    ~OutputBuffer()
+    {
+        Flush();
+        for(size_t i = 0; i < chunks_.size(); ++i) free(chunks_[i].data);
+    }
+
+    int fd() const { return fd_; }
+    void setFd(int fd) { Flush(); fd_ = fd; }
+
+    //Wrap every flush in a frame of this type, 0 writes raw bytes
+    void setFramed(char frameType) { Flush(); frameType_ = frameType; }
+
+    bool lineBuffered() const { return lineBuffered_; }
+    void setLineBuffered(bool lineBuffered) { lineBuffered_ = lineBuffered; }
+    void setBatchSize(size_t bytes) { batchSize_ = bytes; }
+
+    //Room for at least length bytes. Nothing is written until Commit.
+    char* Reserve(size_t length)
+    {
+        if(active_ < chunks_.size()) {
+            Chunk& chunk = chunks_[active_];
+            if(chunk.capacity - chunk.used >= length) return chunk.data + chunk.used;
+            if(chunk.used > 0) active_++;
+        }
+
+        //Reuse the chunks from the last flush where they are large enough
+        while(active_ < chunks_.size() && chunks_[active_].capacity < length) {
+            free(chunks_[active_].data);
+            chunks_.erase(chunks_.begin() + active_);
+        }
+
+        if(active_ == chunks_.size()) {
+            Chunk chunk;
+            chunk.capacity = length > kChunkSize ? length : kChunkSize;
+            chunk.data = static_cast<char*>(malloc(chunk.capacity));
+            chunk.used = 0;
+            chunks_.push_back(chunk);
+        }
+
+        return chunks_[active_].data + chunks_[active_].used;
+    }
+
+    void Commit(size_t length)
+    {
+        chunks_[active_].used += length;
+        pending_ += length;
+        if(pending_ >= batchSize_) Flush();
+    }
+
+    void Write(const char* data, size_t length)
+    {
+        memcpy(Reserve(length), data, length);
+        Commit(length);
+    }
+
+    void Printf(const char* format, ...)
+    {
+        va_list args;
+        va_start(args, format);
+
+        va_list attempt;
+        va_copy(attempt, args);
+        char* out = Reserve(kPrintfGuess);
+        int length = vsnprintf(out, kPrintfGuess, format, attempt);
+        va_end(attempt);
+
+        if(length >= (int)kPrintfGuess) {
+            out = Reserve(length + 1);
+            vsnprintf(out, length + 1, format, args);
+        }
+        va_end(args);
+
+        if(length > 0) Commit(length);
+    }
+
+    //One complete message was written, line buffered output goes out now
+    void EndMessage()
+    {
+        if(lineBuffered_) Flush();
+    }
+
+    //Write everything pending, in as few system calls as we can
+    void Flush()
+    {
+        if(pending_ == 0) return;
+
+        size_t count = active_ < chunks_.size() ? active_ + 1 : chunks_.size();
+        vector<struct iovec> iov;
+        iov.reserve(count + 1);
+
+        char header[kFrameHeaderSize];
+        if(frameType_) {
+            packFrameHeader(header, frameType_, (uint32_t)pending_);
+            struct iovec v = { header, sizeof(header) };
+            iov.push_back(v);
+        }
+        for(size_t i = 0; i < count; ++i) {
+            if(chunks_[i].used == 0) continue;
+            struct iovec v = { chunks_[i].data, chunks_[i].used };
+            iov.push_back(v);
+        }
+
+        size_t first = 0;
+        while(first < iov.size()) {
+            int batch = (int)(iov.size() - first > IOV_MAX ? IOV_MAX : iov.size() - first);
+            ssize_t written = writev(fd_, &iov[first], batch);
+
+            if(written < 0) {
+                if(errno == EINTR) continue;
+                break; //Nowhere to report it, drop the output
+            }
+
+            //Skip whatever was fully written, trim a partial write
+            while(written > 0 && first < iov.size()) {
+                if((size_t)written >= iov[first].iov_len) {
+                    written -= iov[first].iov_len;
+                    first++;
+                } else {
+                    iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + written;
+                    iov[first].iov_len -= written;
+                    written = 0;
+                }
+            }
+        }
+
+        for(size_t i = 0; i < chunks_.size(); ++i) chunks_[i].used = 0;
+        active_ = 0;
+        pending_ = 0;
+    }
+
+private:
+    static const size_t kChunkSize = 64 * 1024;
+    static const size_t kDefaultBatchSize = 256 * 1024;
+    static const size_t kPrintfGuess = 256;
+
+    struct Chunk {
+        char* data;
+        size_t used;
+        size_t capacity;
+    };
+
+    int fd_;
+    char frameType_;
+    bool lineBuffered_;
+    size_t batchSize_;
+    vector<Chunk> chunks_;
+    size_t active_;
+    size_t pending_;
+};
+
+    /* The output buffer of this isolate, created on first use */
+OutputBuffer* getOutputBuffer(Isolate* isolate)
+{
+    IsolateData* data = getIsolateData(isolate);
+    if(data->output == NULL) {
+        data->output = data->Own(new OutputBuffer());
+    }
+    return data->output;
+}
+
+    /* Flush the output of this isolate, used before exit or handing over stdout */
+void flushOutput(Isolate* isolate)
+{
+    getOutputBuffer(isolate)->Flush();
+}
+
+    /* a simple print function, for printing information to stdout */
+static void printMessage(const FunctionCallbackInfo<Value>& args)
+{
+    //The arguments that are handed in have some valuable information
+    //tucked away inside it. Such as the function or object that it was
+    //called from (in this case, global) and also can be a variable length.
+    //Most times, you can access the arguments directly as args[ index ].
+    //Also note how you can use To(Type)->(Type)Value() to get the value.
+    //For example, args[1]->ToBoolean()->BooleanValue();
+
+    if( args.Length() == 0) return;
+
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+
+    Local<String> value = args[0]->ToString();
+    int length = value->Length();
+
+    if( length == 0) return;
+
+    static const char prefix[] = "From v8: ";
+    static const size_t prefixLength = sizeof(prefix) - 1;
+
+    //Room for the prefix, the text as UTF-8 and the newline
+    OutputBuffer* out = getOutputBuffer(isolate);
+    char* dst = out->Reserve(prefixLength + maxUtf8Length(value) + 1);
+    memcpy(dst, prefix, prefixLength);
+
+    size_t textLength = writeUtf8(value, dst + prefixLength);
+
+    dst[prefixLength + textLength] = '\n';
+    out->Commit(prefixLength + textLength + 1);
+    out->EndMessage();
+}
+
+    /* flush() for scripts, push out everything print()ed so far */
+static void flushMessages(const FunctionCallbackInfo<Value>& args)
+{
+    flushOutput(args.GetIsolate());
+}
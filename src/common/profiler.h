@@ -0,0 +1,195 @@
+#pragma once
+#include "include/v8.h"
+#include "include/v8-profiler.h"
+#include <stdio.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+
+#include "json.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    CPU profiles of a script run, for Chrome DevTools and flamegraph tools.
+
+    Wraps V8's sampling CPU profiler. Stop() writes two files:
+
+        name.cpuprofile   the JSON DevTools loads (Performance or JavaScript
+                          Profiler panel, "Load profile")
+        name.collapsed    one line per stack, "root;outer;inner count", the
+                          input flamegraph.pl and speedscope take. A ';' in
+                          a function name becomes ':' and whitespace '_',
+                          so names can't split frames or lines
+
+    Native callbacks appear as frames named after their JS function (print,
+    setTimeout, start ...), see bindFunction in binding.h.
+*/
+
+class ScriptProfiler {
+
+public:
+    //intervalMicros == 0 keeps V8's default sampling interval
+    ScriptProfiler(Isolate* isolate, int intervalMicros)
+        : isolate_(isolate), profiler_(isolate->GetCpuProfiler()), title_("cli-script")
+    {
+        if(intervalMicros > 0) profiler_->SetSamplingInterval(intervalMicros);
+    }
+
+    void Start()
+    {
+        HandleScope handle_scope(isolate_);
+        profiler_->StartProfiling(String::NewFromUtf8(isolate_, title_), true);
+    }
+
+    //Stops sampling and writes path (.cpuprofile) and its .collapsed twin
+    bool Stop(const string& path)
+    {
+        HandleScope handle_scope(isolate_);
+        CpuProfile* profile = profiler_->StopProfiling(String::NewFromUtf8(isolate_, title_));
+        if(profile == NULL) return false;
+
+        string json;
+        writeCpuProfile(profile, &json);
+
+        string collapsed;
+        vector<string> stack;
+        writeCollapsed(profile->GetTopDownRoot(), &stack, &collapsed);
+
+        profile->Delete();
+
+        return writeFile(path, json) && writeFile(collapsedPath(path), collapsed);
+    }
+
+    //x.cpuprofile -> x.collapsed, anything else gets .collapsed added
+    static string collapsedPath(const string& path)
+    {
+        static const string extension = ".cpuprofile";
+        if(path.size() > extension.size() &&
+           path.compare(path.size() - extension.size(), extension.size(), extension) == 0) {
+            return path.substr(0, path.size() - extension.size()) + ".collapsed";
+        }
+        return path + ".collapsed";
+    }
+
+private:
+    static string utf8(Local<String> value)
+    {
+        String::Utf8Value text(value);
+        return *text ? string(*text, text.length()) : string();
+    }
+
+    //As a frame of a collapsed stack line, where ';' and whitespace are separators
+    static string functionName(const CpuProfileNode* node)
+    {
+        string name = utf8(node->GetFunctionName());
+        if(name.empty()) return "(anonymous)";
+
+        for(size_t i = 0; i < name.size(); ++i) {
+            if(name[i] == ';') name[i] = ':';
+            else if(isspace((unsigned char)name[i])) name[i] = '_';
+        }
+        return name;
+    }
+
+    //The DevTools format: a flat node list with child ids, and the samples
+    //as node ids with the time since the previous sample
+    static void writeCpuProfile(const CpuProfile* profile, string* out)
+    {
+        char number[64];
+
+        *out += "{\"nodes\":[";
+        bool first = true;
+        writeNodes(profile->GetTopDownRoot(), &first, out);
+        *out += "]";
+
+        snprintf(number, sizeof(number), ",\"startTime\":%lld,\"endTime\":%lld",
+                 (long long)profile->GetStartTime(), (long long)profile->GetEndTime());
+        *out += number;
+
+        *out += ",\"samples\":[";
+        for(int i = 0; i < profile->GetSamplesCount(); ++i) {
+            snprintf(number, sizeof(number), i ? ",%u" : "%u", profile->GetSample(i)->GetNodeId());
+            *out += number;
+        }
+
+        *out += "],\"timeDeltas\":[";
+        int64_t previous = profile->GetStartTime();
+        for(int i = 0; i < profile->GetSamplesCount(); ++i) {
+            int64_t timestamp = profile->GetSampleTimestamp(i);
+            snprintf(number, sizeof(number), i ? ",%lld" : "%lld", (long long)(timestamp - previous));
+            *out += number;
+            previous = timestamp;
+        }
+        *out += "]}\n";
+    }
+
+    static void writeNodes(const CpuProfileNode* node, bool* first, string* out)
+    {
+        char number[128];
+
+        if(!*first) *out += ",";
+        *first = false;
+
+        snprintf(number, sizeof(number), "{\"id\":%u,\"callFrame\":{\"functionName\":", node->GetNodeId());
+        *out += number;
+        appendJsonString(out, utf8(node->GetFunctionName()));
+
+        //DevTools counts lines and columns from 0, V8 here from 1
+        snprintf(number, sizeof(number), ",\"scriptId\":\"%d\",\"url\":", node->GetScriptId());
+        *out += number;
+        appendJsonString(out, utf8(node->GetScriptResourceName()));
+        snprintf(number, sizeof(number), ",\"lineNumber\":%d,\"columnNumber\":%d},\"hitCount\":%u,\"children\":[",
+                 node->GetLineNumber() - 1, node->GetColumnNumber() - 1, node->GetHitCount());
+        *out += number;
+
+        for(int i = 0; i < node->GetChildrenCount(); ++i) {
+            snprintf(number, sizeof(number), i ? ",%u" : "%u", node->GetChild(i)->GetNodeId());
+            *out += number;
+        }
+        *out += "]}";
+
+        for(int i = 0; i < node->GetChildrenCount(); ++i) {
+            writeNodes(node->GetChild(i), first, out);
+        }
+    }
+
+    //Every node with samples of its own is the top of one stack
+    static void writeCollapsed(const CpuProfileNode* node, vector<string>* stack, string* out)
+    {
+        stack->push_back(functionName(node));
+
+        if(node->GetHitCount() > 0) {
+            for(size_t i = 0; i < stack->size(); ++i) {
+                if(i > 0) *out += ";";
+                *out += (*stack)[i];
+            }
+            char count[32];
+            snprintf(count, sizeof(count), " %u\n", node->GetHitCount());
+            *out += count;
+        }
+
+        for(int i = 0; i < node->GetChildrenCount(); ++i) {
+            writeCollapsed(node->GetChild(i), stack, out);
+        }
+
+        stack->pop_back();
+    }
+
+    static bool writeFile(const string& path, const string& contents)
+    {
+        FILE* f = fopen(path.c_str(), "wb");
+        if(!f) {
+            fprintf(stderr, "Could not write %s\n", path.c_str());
+            return false;
+        }
+        bool ok = fwrite(contents.data(), 1, contents.size(), f) == contents.size();
+        ok = fclose(f) == 0 && ok;
+        return ok;
+    }
+
+    Isolate* isolate_;
+    CpuProfiler* profiler_;
+    const char* title_;
+};
@@ -0,0 +1,191 @@
+#pragma once
+#include "include/v8.h"
+#include "include/libplatform/libplatform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "point.h"
+#include "pointarray.h"
+#include "game.h"
+#include "eventloop.h"
+#include "shared.h"
+#include "modules.h"
+#include "dataload.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    Shared startup path for the runners.
+
+    Instead of each main() building its own global template, this installs
+    print, Point, PointArray, the timers, sharedBuffer, load and game in one
+    place, and can boot the isolate from a startup snapshot written by
+    snapshot-builder. Every runner, the expose-* examples included, starts
+    through here.
+
+    The snapshot holds everything the prelude scripts set up on the JS side
+    (already parsed, compiled and run). The serializer in this V8 has no table
+    of external references, so native callbacks can not be stored in the blob:
+    the prelude runs without print, Point, game or any other binding, and
+    only functions it defines can use them, once they are called after boot.
+    What is left per process is the native side: the global template is built
+    once per isolate (getGlobalTemplate) and only instantiated per context,
+    and game comes from the shared wrapper template. snapshot-builder times a
+    boot from the blob against running the prelude from source.
+*/
+
+    /* Plain malloc backed allocator, isolates need one for ArrayBuffers */
+class MallocArrayBufferAllocator : public ArrayBuffer::Allocator {
+public:
+    virtual void* Allocate(size_t length) { return calloc(length, 1); }
+    virtual void* AllocateUninitialized(size_t length) { return malloc(length); }
+    virtual void Free(void* data, size_t) { free(data); }
+};
+
+    /* Read a snapshot blob written by snapshot-builder. The data stays
+       allocated for as long as isolates created from it are alive. */
+bool loadSnapshotBlob(const string &fileName, StartupData* blob)
+{
+    FILE* f = fopen(fileName.c_str(), "rb");
+    if(!f) {
+        printf("Snapshot does not exist! %s\n", fileName.c_str());
+        return false;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char* data = new char[size];
+    if(size <= 0 || fread(data, 1, size, f) != (size_t)size) {
+        printf("Could not read snapshot %s\n", fileName.c_str());
+        delete[] data;
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+
+    blob->data = data;
+    blob->raw_size = (int)size;
+    return true;
+}
+
+    /* For the single script runners: loads the blob named by a leading
+       --snapshot=FILE and drops that argument. False if it can't be read. */
+bool takeSnapshotArg(int* argc, char*** argv, StartupData* blob)
+{
+    static const char kFlag[] = "--snapshot=";
+    if(*argc < 2 || strncmp((*argv)[1], kFlag, sizeof(kFlag) - 1) != 0) return true;
+
+    if(!loadSnapshotBlob((*argv)[1] + sizeof(kFlag) - 1, blob)) return false;
+
+    (*argv)[1] = (*argv)[0];
+    --*argc;
+    ++*argv;
+    return true;
+}
+
+//Room above --heap-limit for the GC to finish before the watchdog stops a script
+static const int kHeapLimitHeadroomMB = 32;
+
+    /* Create an isolate, from the custom snapshot if one is given. With a
+       heap limit set, V8's own old space ceiling sits above it, so the
+       watchdog stops the script before V8 gives up on the process. */
+Isolate* createIsolate(StartupData* snapshot = NULL)
+{
+    static MallocArrayBufferAllocator allocator;
+
+    Isolate::CreateParams params;
+    params.array_buffer_allocator = &allocator;
+    params.snapshot_blob = snapshot;
+
+    size_t heapLimit = ScriptLimits::defaults().heapBytes;
+    if(heapLimit > 0) {
+        int limitMB = (int)(heapLimit / (1024 * 1024));
+        params.constraints.set_max_old_space_size(limitMB + limitMB / 2 + kHeapLimitHeadroomMB);
+    }
+
+    return Isolate::New(params);
+}
+
+    /* The CPUs this process may run on, from sched_getaffinity so a cpuset
+       or taskset is respected. Empty if the mask can't be read. */
+vector<int> allowedCpus()
+{
+    vector<int> cpus;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if(CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+    /* The global template every runner context is stamped with */
+Local<ObjectTemplate> createGlobalTemplate(Isolate* isolate)
+{
+    EscapableHandleScope handle_scope(isolate);
+
+    Local<ObjectTemplate> global = ObjectTemplate::New(isolate);
+
+    bindFunction(isolate, global, "print", printMessage);
+    bindFunction(isolate, global, "flush", flushMessages);
+    bindFunction(isolate, global, "nativeStats", nativeStats);
+    bindFunction(isolate, global, "sharedBuffer", sharedBufferBinding);
+    bindFunction(isolate, global, "releaseSharedBuffer", releaseSharedBufferBinding);
+    bindFunction(isolate, global, "load", loadBinding);
+    exposePoint(isolate, global);
+    exposePointArray(isolate, global);
+    exposeEventLoop(isolate, global);
+
+    return handle_scope.Escape(global);
+}
+
+    /* The global template of this isolate, built on first use. Templates
+       can be instantiated any number of times, so every context shares it. */
+Local<ObjectTemplate> getGlobalTemplate(Isolate* isolate)
+{
+    IsolateData* data = getIsolateData(isolate);
+    if(data->globalTemplate.IsEmpty()) {
+        HandleScope handle_scope(isolate);
+        data->globalTemplate.Set(isolate, createGlobalTemplate(isolate));
+    }
+    return data->globalTemplate.Get(isolate);
+}
+
+    /* A new context with print, Point, require and a game object wrapping gameInstance.
+       Pass the global proxy of a detached context to have it reused. */
+Local<Context> createRuntimeContext(Isolate* isolate, Game* gameInstance,
+                                    Local<Object> globalProxy = Local<Object>())
+{
+    EscapableHandleScope handle_scope(isolate);
+
+    //Microtasks are the event loop's to run from here on, see eventloop.h
+    getEventLoop(isolate);
+
+    //With idle GC or GC stats on, pauses are counted from the first script
+    getGcScheduler(isolate);
+
+    Local<Context> context = Context::New(isolate, NULL, getGlobalTemplate(isolate), globalProxy);
+
+    //The game object is an instance, not a type, so it is
+    //created inside the context rather than on the template.
+    Context::Scope context_scope(context);
+
+    //start, emit and stop come with the shared wrapper template
+    Handle<Object> jsGame = WrapGameObject(isolate, gameInstance);
+    context->Global()->Set(internName(isolate, "game"), jsGame);
+
+    //Every context has its own module table, compiled modules are shared
+    exposeRequire(isolate, context);
+
+    return handle_scope.Escape(context);
+}
@@ -0,0 +1,357 @@
+#pragma once
+#include "include/v8.h"
+#include <stdlib.h>
+#include <string.h>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "isolatedata.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    Native memory that scripts see as an ArrayBuffer, with no copies.
+
+    A SharedBuffer is a block of C++ memory with a reference count. Named
+    buffers live in a process wide registry, so any isolate on any thread
+    can attach to the same memory by name:
+
+        var state = sharedBuffer("entities", 1 << 20);   // create or attach
+        var ints = new Int32Array(state);
+        Atomics.add(ints, 0, 1);                          // with --shared-memory
+
+    Native code gets at the same bytes through the registry, and can hand
+    memory it already owns to scripts with Adopt(), giving a release
+    function that runs once the last user is gone.
+
+    A named buffer is pinned by the registry itself, so it stays attachable
+    however the isolates that made it come and go, or whenever their views
+    are collected. It lives until it is unlinked, from native code with
+    Unlink(name) or from script with releaseSharedBuffer(name):
+
+        releaseSharedBuffer("entities");   // the name is free again
+
+    Every JS buffer made over the memory holds one reference, dropped when
+    the garbage collector finds the buffer unreachable or when its isolate
+    is disposed, whichever comes first. The memory is freed after the last
+    reference, the registry's, native or JS, is released.
+
+    With shared memory turned on (enableSharedMemory(), cli-script
+    --shared-memory) scripts get a SharedArrayBuffer and the Atomics object
+    for synchronizing across isolates. V8 before 4.6 has no
+    SharedArrayBuffer in its API, those builds always hand out a plain
+    ArrayBuffer over the same shared memory.
+*/
+
+#if V8_MAJOR_VERSION > 4 || (V8_MAJOR_VERSION == 4 && V8_MINOR_VERSION >= 6)
+#define HAVE_SHARED_ARRAY_BUFFER 1
+#endif
+
+class SharedBufferRegistry;
+
+class SharedBuffer {
+
+public:
+    //Called once the last reference is gone, for memory given to Adopt()
+    typedef void (*ReleaseCallback)(void* data, size_t size, void* hint);
+
+    const string& name() const { return name_; }
+    void* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    friend class SharedBufferRegistry;
+
+    SharedBuffer(const string& name, void* data, size_t size, ReleaseCallback release, void* hint)
+        : name_(name), data_(data), size_(size), release_(release), hint_(hint), refs_(1) { }
+
+    ~SharedBuffer()
+    {
+        if(release_) release_(data_, size_, hint_);
+        else free(data_);
+    }
+
+    string name_;
+    void* data_;
+    size_t size_;
+    ReleaseCallback release_;
+    void* hint_;
+
+    //Guarded by the registry's mutex
+    int refs_;
+};
+
+class SharedBufferRegistry {
+
+public:
+    //The registry every isolate in the process shares
+    static SharedBufferRegistry& get()
+    {
+        static SharedBufferRegistry registry;
+        return registry;
+    }
+
+    //The buffer called name, made zero filled with size bytes if there is
+    //none yet. NULL when size is 0 and there is no such buffer, or when
+    //the existing buffer has another size. The caller owns one reference,
+    //a new named buffer also gets the registry's pin.
+    SharedBuffer* Acquire(const string& name, size_t size)
+    {
+        lock_guard<mutex> lock(mutex_);
+
+        map<string, SharedBuffer*>::iterator found = named_.find(name);
+        if(found != named_.end()) {
+            SharedBuffer* buffer = found->second;
+            if(size != 0 && size != buffer->size_) return NULL;
+            buffer->refs_++;
+            return buffer;
+        }
+
+        if(size == 0) return NULL;
+
+        void* data = NULL;
+        if(posix_memalign(&data, kAlignment, size) != 0) return NULL;
+        memset(data, 0, size);
+
+        SharedBuffer* buffer = new SharedBuffer(name, data, size, NULL, NULL);
+        pin(buffer);
+        return buffer;
+    }
+
+    //Share memory the caller already owns. release(data, size, hint) is
+    //called after the last reference is dropped. NULL if name is taken.
+    SharedBuffer* Adopt(const string& name, void* data, size_t size,
+                        SharedBuffer::ReleaseCallback release, void* hint)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if(!name.empty() && named_.count(name)) return NULL;
+
+        SharedBuffer* buffer = new SharedBuffer(name, data, size, release, hint);
+        pin(buffer);
+        return buffer;
+    }
+
+    void Retain(SharedBuffer* buffer)
+    {
+        lock_guard<mutex> lock(mutex_);
+        buffer->refs_++;
+    }
+
+    void Release(SharedBuffer* buffer)
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            if(--buffer->refs_ > 0) return;
+        }
+        delete buffer;
+    }
+
+    //Drop the registry's pin on a named buffer and free the name. The
+    //memory stays until every other reference is released too. false if
+    //there is no such buffer.
+    bool Unlink(const string& name)
+    {
+        SharedBuffer* buffer;
+        {
+            lock_guard<mutex> lock(mutex_);
+            map<string, SharedBuffer*>::iterator found = named_.find(name);
+            if(found == named_.end()) return false;
+            buffer = found->second;
+            named_.erase(found);
+            if(--buffer->refs_ > 0) return true;
+        }
+        delete buffer;
+        return true;
+    }
+
+    size_t count()
+    {
+        lock_guard<mutex> lock(mutex_);
+        return named_.size();
+    }
+
+private:
+    //Called with mutex_ held. Named buffers get a reference of the
+    //registry's own, so they outlive every user until Unlink().
+    void pin(SharedBuffer* buffer)
+    {
+        if(buffer->name_.empty()) return;
+        buffer->refs_++;
+        named_[buffer->name_] = buffer;
+    }
+
+    //Enough for any SIMD load, and a cache line so isolates on different
+    //cores don't share one with unrelated data
+    static const size_t kAlignment = 64;
+
+    mutex mutex_;
+    map<string, SharedBuffer*> named_;
+};
+
+    /* Whether scripts get SharedArrayBuffer and Atomics */
+bool& sharedMemory()
+{
+    static bool enabled = false;
+    return enabled;
+}
+
+    /* Turn on SharedArrayBuffer and Atomics, before any isolate is made.
+       false when this V8 has no SharedArrayBuffer in its API. */
+bool enableSharedMemory()
+{
+#ifdef HAVE_SHARED_ARRAY_BUFFER
+    static const char flags[] = "--harmony-sharedarraybuffer --harmony-atomics";
+    V8::SetFlagsFromString(flags, (int)strlen(flags));
+    sharedMemory() = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+    The JS buffers of one isolate and the references they hold. The
+    isolate owns it, so the references of buffers that were still alive
+    are given back when the isolate is disposed.
+*/
+class SharedBufferViews {
+
+public:
+    explicit SharedBufferViews(Isolate* isolate) : isolate_(isolate) { }
+
+    ~SharedBufferViews()
+    {
+        for(list<View*>::iterator i = views_.begin(); i != views_.end(); ++i) {
+            (*i)->handle.Reset();
+            SharedBufferRegistry::get().Release((*i)->buffer);
+            delete *i;
+        }
+    }
+
+    //A JS buffer over the memory, holding a reference of its own. Only
+    //shareable memory becomes a SharedArrayBuffer with shared memory on.
+    Local<Object> Wrap(SharedBuffer* buffer, bool shareable = true)
+    {
+        EscapableHandleScope handle_scope(isolate_);
+
+        Local<Object> object;
+#ifdef HAVE_SHARED_ARRAY_BUFFER
+        if(shareable && sharedMemory()) object = SharedArrayBuffer::New(isolate_, buffer->data(), buffer->size());
+#endif
+        if(object.IsEmpty()) object = ArrayBuffer::New(isolate_, buffer->data(), buffer->size());
+
+        SharedBufferRegistry::get().Retain(buffer);
+
+        View* view = new View();
+        view->owner = this;
+        view->buffer = buffer;
+        views_.push_back(view);
+        view->position = --views_.end();
+
+        view->handle.Reset(isolate_, object);
+        view->handle.SetWeak(view, WeakCallback, WeakCallbackType::kParameter);
+
+        return handle_scope.Escape(object);
+    }
+
+    size_t count() const { return views_.size(); }
+
+private:
+    struct View {
+        Persistent<Object> handle;
+        SharedBuffer* buffer;
+        SharedBufferViews* owner;
+        list<View*>::iterator position;
+    };
+
+    //First pass, the JS buffer is dead. V8 only allows dropping the handle here.
+    static void WeakCallback(const WeakCallbackInfo<View>& info)
+    {
+        info.GetParameter()->handle.Reset();
+        info.SetSecondPassCallback(ReleaseCallback);
+    }
+
+    //Second pass, give its reference back
+    static void ReleaseCallback(const WeakCallbackInfo<View>& info)
+    {
+        View* view = info.GetParameter();
+        view->owner->views_.erase(view->position);
+        SharedBufferRegistry::get().Release(view->buffer);
+        delete view;
+    }
+
+    Isolate* isolate_;
+    list<View*> views_;
+};
+
+    /* The shared buffer views of this isolate, created on first use */
+SharedBufferViews* getSharedBufferViews(Isolate* isolate)
+{
+    IsolateData* data = getIsolateData(isolate);
+    if(data->sharedViews == NULL) {
+        data->sharedViews = data->Own(new SharedBufferViews(isolate));
+    }
+    return data->sharedViews;
+}
+
+    /* A JS buffer over native memory, see SharedBufferViews::Wrap */
+Local<Object> wrapSharedBuffer(Isolate* isolate, SharedBuffer* buffer, bool shareable = true)
+{
+    return getSharedBufferViews(isolate)->Wrap(buffer, shareable);
+}
+
+    /* sharedBuffer(name, byteLength) creates or attaches, sharedBuffer(name)
+       only attaches to a buffer some isolate already made */
+static void sharedBufferBinding(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+
+    if(args.Length() < 1 || !args[0]->IsString()) {
+        isolate->ThrowException(Exception::TypeError(
+            String::NewFromUtf8(isolate, "sharedBuffer(name, byteLength) needs a name")));
+        return;
+    }
+
+    String::Utf8Value name(args[0]);
+    double size = args.Length() > 1 ? args[1]->NumberValue() : 0;
+    if(!(size >= 0) || size > (double)0x7fffffff) {
+        isolate->ThrowException(Exception::RangeError(
+            String::NewFromUtf8(isolate, "sharedBuffer: invalid byteLength")));
+        return;
+    }
+
+    SharedBuffer* buffer = SharedBufferRegistry::get().Acquire(string(*name, name.length()), (size_t)size);
+    if(buffer == NULL) {
+        string message = string("sharedBuffer: ") + *name +
+                         (size > 0 ? " exists with another byteLength" : " does not exist");
+        isolate->ThrowException(Exception::Error(String::NewFromUtf8(isolate, message.c_str())));
+        return;
+    }
+
+    //The view holds its own reference, ours was only to keep it alive until now
+    Local<Object> object = wrapSharedBuffer(isolate, buffer);
+    SharedBufferRegistry::get().Release(buffer);
+
+    args.GetReturnValue().Set(object);
+}
+
+    /* releaseSharedBuffer(name) unpins a named buffer, true if there was one.
+       Views already made keep the memory until they are collected. */
+static void releaseSharedBufferBinding(const FunctionCallbackInfo<Value>& args)
+{
+    Isolate* isolate = args.GetIsolate();
+    HandleScope scope(isolate);
+
+    if(args.Length() < 1 || !args[0]->IsString()) {
+        isolate->ThrowException(Exception::TypeError(
+            String::NewFromUtf8(isolate, "releaseSharedBuffer(name) needs a name")));
+        return;
+    }
+
+    String::Utf8Value name(args[0]);
+    args.GetReturnValue().Set(SharedBufferRegistry::get().Unlink(string(*name, name.length())));
+}
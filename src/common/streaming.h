@@ -0,0 +1,204 @@
+#pragma once
+#include "include/v8.h"
+#include "include/v8-platform.h"
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+
+#include "mappedfile.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    Streaming compilation for large scripts.
+
+    A StreamedCompile reads the file in chunks on a platform background
+    thread and hands each chunk to V8's parser as soon as it is read, so the
+    disk reads and the parse overlap, and the main thread is free while both
+    happen. The main thread meanwhile loads the same file as a string (V8
+    still wants the whole source for Function.prototype.toString and error
+    messages), then waits for the parse and finalizes the compile, which is
+    the only part that has to run on the isolate's thread.
+
+        StreamedCompile streamed(isolate, filename);
+        if(!streamed.Start()) ...
+        Local<String> source = readFile(isolate, filename);
+        Local<Script> script = streamed.Finish(source, origin);
+
+    The streamer decodes UTF-8 itself; a byte order mark is skipped, the
+    same as every readFile path does (utf8BomLength in mappedfile.h), so
+    both sides agree on character positions.
+
+    A prefix and suffix can be streamed around the file, for sources that
+    get wrapped before they are compiled (modules.h). The string given to
+    Finish() then has to carry the same wrapper.
+*/
+
+    /* The platform the runner initialized V8 with, for background tasks.
+       Without one the parse runs on the calling thread and nothing overlaps. */
+Platform*& streamingPlatform()
+{
+    static Platform* platform = NULL;
+    return platform;
+}
+
+    /* File chunks for the parser, read() on whichever thread V8 asks from */
+class FileSourceStream : public ScriptCompiler::ExternalSourceStream {
+public:
+    explicit FileSourceStream(int fd, const string& prefix = string(), const string& suffix = string())
+        : fd_(fd), first_(true), prefix_(prefix), suffix_(suffix) { }
+    virtual ~FileSourceStream() { if(fd_ >= 0) close(fd_); }
+
+    //V8 takes ownership of the chunk and delete[]s it. 0 means the end.
+    virtual size_t GetMoreData(const uint8_t** src)
+    {
+        if(!prefix_.empty()) return take(&prefix_, src);
+        if(fd_ < 0) return suffix_.empty() ? 0 : take(&suffix_, src);
+
+        uint8_t* chunk = new uint8_t[kChunkSize];
+        ssize_t got;
+        do {
+            got = read(fd_, chunk, kChunkSize);
+        } while(got < 0 && errno == EINTR);
+
+        if(got <= 0) {
+            delete[] chunk;
+            close(fd_);
+            fd_ = -1;
+            return suffix_.empty() ? 0 : take(&suffix_, src);
+        }
+
+        size_t length = (size_t)got;
+        if(first_) {
+            first_ = false;
+            size_t bom = utf8BomLength(reinterpret_cast<const char*>(chunk), length);
+            if(bom) {
+                memmove(chunk, chunk + bom, length - bom);
+                length -= bom;
+            }
+        }
+
+        *src = chunk;
+        return length;
+    }
+
+private:
+    static const size_t kChunkSize = 64 * 1024;
+
+    //Hand out a wrapper string as one chunk, once
+    static size_t take(string* text, const uint8_t** src)
+    {
+        size_t length = text->size();
+        uint8_t* chunk = new uint8_t[length];
+        memcpy(chunk, text->data(), length);
+        text->clear();
+        *src = chunk;
+        return length;
+    }
+
+    int fd_;
+    bool first_;
+    string prefix_;
+    string suffix_;
+};
+
+class StreamedCompile {
+
+public:
+    StreamedCompile(Isolate* isolate, const string& filename,
+                    const string& prefix = string(), const string& suffix = string())
+        : isolate_(isolate), filename_(filename), prefix_(prefix), suffix_(suffix),
+          source_(NULL), task_(NULL), started_(false), done_(false) { }
+
+    ~StreamedCompile()
+    {
+        //The background thread may still be reading
+        Wait();
+        delete task_;
+        delete source_;
+    }
+
+    //Opens the file and starts the parse, false if the file can't be read
+    bool Start()
+    {
+        int fd = open(filename_.c_str(), O_RDONLY);
+        if(fd < 0) return false;
+
+        source_ = new ScriptCompiler::StreamedSource(new FileSourceStream(fd, prefix_, suffix_),
+                                                     ScriptCompiler::StreamedSource::UTF8);
+        started_ = true;
+        task_ = ScriptCompiler::StartStreamingScript(isolate_, source_);
+        if(task_ == NULL) {
+            finished();
+            return true;
+        }
+
+        Platform* platform = streamingPlatform();
+        if(platform) {
+            platform->CallOnBackgroundThread(new BackgroundParse(this), Platform::kLongRunningTask);
+        } else {
+            task_->Run();
+            finished();
+        }
+        return true;
+    }
+
+    //Waits for the parse, then compiles on this thread. source has to be the
+    //full text of the same file. An empty handle means a syntax error, which
+    //is thrown like a normal compile error.
+    Local<Script> Finish(Local<String> source, const ScriptOrigin& origin)
+    {
+        Wait();
+        if(task_ == NULL) {
+            //V8 turned the stream down, compile the usual way
+            ScriptCompiler::Source plain(source, origin);
+            return ScriptCompiler::Compile(isolate_, &plain);
+        }
+        return ScriptCompiler::Compile(isolate_, source_, source, origin);
+    }
+
+private:
+    class BackgroundParse : public Task {
+    public:
+        explicit BackgroundParse(StreamedCompile* owner) : owner_(owner) { }
+        virtual void Run()
+        {
+            owner_->task_->Run();
+            owner_->finished();
+        }
+    private:
+        StreamedCompile* owner_;
+    };
+
+    void finished()
+    {
+        lock_guard<mutex> lock(mutex_);
+        done_ = true;
+        doneSignal_.notify_all();
+    }
+
+    void Wait()
+    {
+        if(!started_) return;
+        unique_lock<mutex> lock(mutex_);
+        doneSignal_.wait(lock, [this] { return done_; });
+    }
+
+    Isolate* isolate_;
+    string filename_;
+    string prefix_;
+    string suffix_;
+    ScriptCompiler::StreamedSource* source_;
+    ScriptCompiler::ScriptStreamingTask* task_;
+    bool started_;
+
+    mutex mutex_;
+    condition_variable doneSignal_;
+    bool done_;
+};
@@ -0,0 +1,156 @@
+#pragma once
+#include "include/v8.h"
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+
+#include "isolatedata.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    Strings across the binding boundary.
+
+    Property and function names: internName(isolate, "x") returns the
+    internalized string for a literal, made once per isolate and kept in an
+    Eternal, so setting up templates and objects stops allocating (and
+    hashing) the same names again. The cache is keyed on the literal's
+    address, so only pass string literals or other text that lives as long
+    as the isolate.
+
+    Native text to JS: newString() checks for ASCII a word at a time and
+    makes a one byte string straight from the bytes, only text with other
+    UTF-8 in it goes through V8's decoder.
+
+    JS text to native: writeUtf8() copies one byte strings out as Latin-1
+    and widens the few bytes above 0x7f in place, instead of making V8
+    measure the UTF-8 length first; two byte strings use V8's encoder.
+*/
+
+class NameCache {
+
+public:
+    explicit NameCache(Isolate* isolate) : isolate_(isolate) { }
+
+    Local<String> Get(const char* literal)
+    {
+        unordered_map<const char*, Eternal<String> >::iterator found = names_.find(literal);
+        if(found != names_.end()) return found->second.Get(isolate_);
+
+        Local<String> name = String::NewFromUtf8(isolate_, literal, String::kInternalizedString);
+        names_[literal].Set(isolate_, name);
+        return name;
+    }
+
+    size_t size() const { return names_.size(); }
+
+private:
+    Isolate* isolate_;
+    unordered_map<const char*, Eternal<String> > names_;
+};
+
+    /* The names of this isolate, created on first use */
+NameCache* getNameCache(Isolate* isolate)
+{
+    IsolateData* data = getIsolateData(isolate);
+    if(data->names == NULL) {
+        data->names = data->Own(new NameCache(isolate));
+    }
+    return data->names;
+}
+
+    /* The internalized string for a name literal, see the top of this file */
+Local<String> internName(Isolate* isolate, const char* literal)
+{
+    return getNameCache(isolate)->Get(literal);
+}
+
+    /* True when every byte is 7 bit, checked a word at a time */
+bool isAsciiText(const char* data, size_t length)
+{
+    size_t i = 0;
+    for(; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if(word & 0x8080808080808080ULL) return false;
+    }
+    for(; i < length; ++i) {
+        if(data[i] & 0x80) return false;
+    }
+    return true;
+}
+
+    /* A JS string from UTF-8 text, one byte without decoding when it is ASCII */
+Local<String> newString(Isolate* isolate, const char* data, size_t length)
+{
+    if(isAsciiText(data, length)) {
+        return String::NewFromOneByte(isolate, reinterpret_cast<const uint8_t*>(data),
+                                      String::kNormalString, (int)length);
+    }
+    return String::NewFromUtf8(isolate, data, String::kNormalString, (int)length);
+}
+
+Local<String> newString(Isolate* isolate, const string& text)
+{
+    return newString(isolate, text.data(), text.size());
+}
+
+    /* A JS string from UTF-16 text, copied as is */
+Local<String> newString(Isolate* isolate, const uint16_t* data, size_t length)
+{
+    return String::NewFromTwoByte(isolate, data, String::kNormalString, (int)length);
+}
+
+    /* Room writeUtf8 may need for value */
+size_t maxUtf8Length(Local<String> value)
+{
+    return value->IsOneByte() ? (size_t)value->Length() * 2 : (size_t)value->Utf8Length();
+}
+
+    /* Write value as UTF-8 to dst, which has maxUtf8Length bytes of room.
+       Returns the bytes written, no terminator. */
+size_t writeUtf8(Local<String> value, char* dst)
+{
+    int length = value->Length();
+
+    if(!value->IsOneByte()) {
+        int utf8Length = value->Utf8Length();
+        value->WriteUtf8(dst, utf8Length, NULL, String::NO_NULL_TERMINATION);
+        return utf8Length;
+    }
+
+    //Latin-1, copy it straight out of the string. Only bytes above
+    //0x7f need work, each of those becomes two bytes of UTF-8.
+    uint8_t* text = reinterpret_cast<uint8_t*>(dst);
+    value->WriteOneByte(text, 0, length, String::NO_NULL_TERMINATION);
+
+    int high = 0;
+    for(int i = 0; i < length; ++i) high += text[i] >> 7;
+    size_t textLength = length + high;
+
+    //Expand from the back, so nothing is overwritten before it is read
+    for(int i = length - 1, o = (int)textLength - 1; high > 0; --i) {
+        uint8_t c = text[i];
+        if(c < 0x80) {
+            text[o--] = c;
+        } else {
+            text[o--] = 0x80 | (c & 0x3F);
+            text[o--] = 0xC0 | (c >> 6);
+            high--;
+        }
+    }
+    return textLength;
+}
+
+    /* A JS value as a UTF-8 std::string, through writeUtf8 */
+string toStdString(Local<Value> value)
+{
+    Local<String> text = value->ToString();
+    if(text.IsEmpty()) return string();
+
+    string out(maxUtf8Length(text), '\0');
+    if(!out.empty()) out.resize(writeUtf8(text, &out[0]));
+    return out;
+}
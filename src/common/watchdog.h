@@ -0,0 +1,256 @@
+#pragma once
+#include "include/v8.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+//Included from common.h, after nowMillis()
+#include "isolatedata.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    Time and heap budgets for scripts.
+
+    A watchdog thread per isolate sleeps until a script is armed, then wakes
+    at the wall clock deadline, and every few milliseconds in between to
+    read the script thread's CPU clock and to ask the isolate (through
+    RequestInterrupt, the only call allowed from another thread besides
+    TerminateExecution) to check its heap. When a budget runs out it calls
+    TerminateExecution; the script unwinds, Disarm() cancels the termination
+    and the isolate is ready for the next script. A thread blocked outside
+    V8 (the event loop in epoll_wait) doesn't see a termination, so it can
+    hand over an eventfd to be bumped when a budget runs out.
+
+    The heap ceiling is a soft one. createIsolate gives V8 a hard limit with
+    headroom above it (ResourceConstraints), and the script is stopped when
+    the used heap passes the ceiling after a GC or at an interrupt check, so
+    it ends with an error instead of taking the process down. This V8 has no
+    near-heap-limit callback, the GC epilogue check stands in for it.
+*/
+
+struct ScriptLimits {
+    ScriptLimits() : wallMillis(0), cpuMillis(0), heapBytes(0) { }
+
+    //The limits for every isolate in the process, 0 means no limit
+    static ScriptLimits& defaults()
+    {
+        static ScriptLimits limits;
+        return limits;
+    }
+
+    bool any() const { return wallMillis > 0 || cpuMillis > 0 || heapBytes > 0; }
+
+    double wallMillis;
+    double cpuMillis;
+    size_t heapBytes;
+};
+
+class Watchdog {
+
+public:
+    enum eLimit {
+        eLIMIT_NONE = 0,
+        eLIMIT_WALL,
+        eLIMIT_CPU,
+        eLIMIT_HEAP
+    };
+
+    explicit Watchdog(Isolate* isolate)
+        : isolate_(isolate), armed_(false), stopping_(false), fired_(eLIMIT_NONE), wakeFd_(-1), depth_(0)
+    {
+        isolate_->AddGCEpilogueCallback(OnGC);
+        runner_ = thread(&Watchdog::watchMain, this);
+    }
+
+    ~Watchdog()
+    {
+        {
+            lock_guard<mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        runner_.join();
+        isolate_->RemoveGCEpilogueCallback(OnGC);
+    }
+
+    //Start the clocks for a script on this thread. Nested arms (a script
+    //run from inside another) share the outer budget.
+    void Arm(const ScriptLimits& limits)
+    {
+        if(depth_++ > 0) return;
+
+        lock_guard<mutex> lock(mutex_);
+        limits_ = limits;
+        fired_ = eLIMIT_NONE;
+        wallStart_ = nowMillis();
+        pthread_getcpuclockid(pthread_self(), &cpuClock_);
+        cpuStart_ = cpuMillis();
+        armed_ = true;
+        wake_.notify_all();
+    }
+
+    //Stop the clocks. Returns the limit that stopped the script, if any,
+    //with the termination already cancelled.
+    eLimit Disarm()
+    {
+        if(--depth_ > 0) return eLIMIT_NONE;
+
+        eLimit fired;
+        {
+            lock_guard<mutex> lock(mutex_);
+            armed_ = false;
+            fired = fired_;
+        }
+
+        if(fired != eLIMIT_NONE) isolate_->CancelTerminateExecution();
+        return fired;
+    }
+
+    //An eventfd to bump when a budget runs out, -1 for none. The owner
+    //clears it before closing the fd.
+    void setWakeFd(int fd)
+    {
+        lock_guard<mutex> lock(mutex_);
+        wakeFd_ = fd;
+    }
+
+    //A budget ran out since Arm(), for loops that should stop early
+    bool fired()
+    {
+        lock_guard<mutex> lock(mutex_);
+        return fired_ != eLIMIT_NONE;
+    }
+
+    static const char* describe(eLimit limit)
+    {
+        switch(limit) {
+            case eLIMIT_WALL: return "time limit";
+            case eLIMIT_CPU: return "CPU time limit";
+            case eLIMIT_HEAP: return "heap limit";
+            default: return "no limit";
+        }
+    }
+
+private:
+    //How often the CPU clock and the heap are looked at
+    static const int kCheckMillis = 10;
+
+    //CPU time of the thread that armed the watchdog, wall time is nowMillis()
+    double cpuMillis() const
+    {
+        struct timespec ts;
+        clock_gettime(cpuClock_, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+    }
+
+    static Watchdog* of(Isolate* isolate)
+    {
+        return getIsolateData(isolate)->watchdog;
+    }
+
+    //Called with mutex_ held
+    void fire(eLimit limit)
+    {
+        if(fired_ != eLIMIT_NONE) return;
+        fired_ = limit;
+        isolate_->TerminateExecution();
+
+        if(wakeFd_ >= 0) {
+            uint64_t one = 1;
+            ssize_t ignored = write(wakeFd_, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+
+    //On the isolate's thread, after every GC and at interrupt checks
+    void checkHeap()
+    {
+        if(limits_.heapBytes == 0) return;
+
+        HeapStatistics stats;
+        isolate_->GetHeapStatistics(&stats);
+        if(stats.used_heap_size() <= limits_.heapBytes) return;
+
+        lock_guard<mutex> lock(mutex_);
+        if(armed_) fire(eLIMIT_HEAP);
+    }
+
+    static void OnGC(Isolate* isolate, GCType type, GCCallbackFlags flags)
+    {
+        Watchdog* self = of(isolate);
+        if(self && self->depth_ > 0) self->checkHeap();
+    }
+
+    static void OnInterrupt(Isolate* isolate, void* data)
+    {
+        Watchdog* self = static_cast<Watchdog*>(data);
+        if(self->depth_ > 0) self->checkHeap();
+    }
+
+    void watchMain()
+    {
+        unique_lock<mutex> lock(mutex_);
+        while(!stopping_) {
+            if(!armed_ || fired_ != eLIMIT_NONE) {
+                wake_.wait(lock);
+                continue;
+            }
+
+            double wall = nowMillis() - wallStart_;
+            if(limits_.wallMillis > 0 && wall >= limits_.wallMillis) {
+                fire(eLIMIT_WALL);
+                continue;
+            }
+
+            if(limits_.cpuMillis > 0 && cpuMillis() - cpuStart_ >= limits_.cpuMillis) {
+                fire(eLIMIT_CPU);
+                continue;
+            }
+
+            if(limits_.heapBytes > 0) isolate_->RequestInterrupt(OnInterrupt, this);
+
+            //Sleep to the wall deadline, or to the next check when the CPU
+            //clock or the heap need looking at
+            double sleep = limits_.wallMillis > 0 ? limits_.wallMillis - wall : kCheckMillis;
+            if((limits_.cpuMillis > 0 || limits_.heapBytes > 0) && sleep > kCheckMillis) sleep = kCheckMillis;
+            wake_.wait_for(lock, chrono::microseconds((long long)(sleep * 1000) + 1));
+        }
+    }
+
+    Isolate* isolate_;
+    thread runner_;
+
+    //Shared with the watchdog thread, guarded by mutex_
+    mutex mutex_;
+    condition_variable wake_;
+    ScriptLimits limits_;
+    bool armed_;
+    bool stopping_;
+    eLimit fired_;
+    double wallStart_;
+    double cpuStart_;
+    clockid_t cpuClock_;
+    int wakeFd_;
+
+    //Only touched on the isolate's thread
+    int depth_;
+};
+
+    /* The watchdog of this isolate, or NULL when no limits are set */
+Watchdog* getWatchdog(Isolate* isolate)
+{
+    if(!ScriptLimits::defaults().any()) return NULL;
+
+    IsolateData* data = getIsolateData(isolate);
+    if(data->watchdog == NULL) {
+        data->watchdog = data->Own(new Watchdog(isolate));
+    }
+    return data->watchdog;
+}
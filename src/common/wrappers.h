@@ -0,0 +1,127 @@
+#pragma once
+#include "include/v8.h"
+#include <unordered_map>
+
+#include "isolatedata.h"
+#include "binding.h"
+#include "stringconv.h"
+
+using namespace v8;
+using namespace std;
+
+/*
+    Wrapper templates, built once per isolate and shared by every instance.
+
+    A native class describes its JS wrapper in a WrapperTraits<T>
+    specialization: internal fields are set up here, Build() adds the
+    methods and accessors. The first wrapNative<T>() on an isolate builds
+    the template, every later one only instantiates it, so all wrappers of
+    a type share one hidden class and one function per method.
+
+        template<> struct WrapperTraits<Game> {
+            static void Build(Isolate* isolate, Local<ObjectTemplate> templ)
+            {
+                bindMethod<void (Game::*)(Isolate*), &Game::start>(isolate, templ, "start");
+            }
+        };
+
+        Local<Object> one = wrapNative(isolate, game);
+        Local<Array> many = wrapNatives(isolate, &games[0], games.size());
+
+    wrapNatives() makes a whole array of wrappers in one call: one template
+    lookup, then a tight loop of instantiate, store the pointer, store the
+    element. The natives stay owned by the caller, as with Wrap().
+
+    Loose functions hung on objects one by one (ExposeProperty) also get
+    their FunctionTemplate from here, one per callback per isolate.
+*/
+
+template<class T> struct WrapperTraits {
+    static void Build(Isolate* isolate, Local<ObjectTemplate> templ) { }
+};
+
+class WrapperRegistry {
+
+public:
+    explicit WrapperRegistry(Isolate* isolate) : isolate_(isolate) { }
+
+    //The instance template for T's wrappers
+    template<class T> Local<ObjectTemplate> Template()
+    {
+        const void* key = typeKey<T>();
+        unordered_map<const void*, Eternal<ObjectTemplate> >::iterator found = objects_.find(key);
+        if(found != objects_.end()) return found->second.Get(isolate_);
+
+        Local<ObjectTemplate> templ = ObjectTemplate::New(isolate_);
+        templ->SetInternalFieldCount(kWrapperFieldCount);
+        WrapperTraits<T>::Build(isolate_, templ);
+
+        objects_[key].Set(isolate_, templ);
+        return templ;
+    }
+
+    //The function template for a callback. The first name it is asked
+    //for becomes its class name.
+    Local<FunctionTemplate> Function(FunctionCallback callback, const char* name)
+    {
+        unordered_map<FunctionCallback, Eternal<FunctionTemplate> >::iterator found = functions_.find(callback);
+        if(found != functions_.end()) return found->second.Get(isolate_);
+
+        Local<FunctionTemplate> fn = FunctionTemplate::New(isolate_, callback);
+        fn->SetClassName(internName(isolate_, name));
+
+        functions_[callback].Set(isolate_, fn);
+        return fn;
+    }
+
+    size_t templates() const { return objects_.size() + functions_.size(); }
+
+private:
+    //One address per type, with no RTTI needed
+    template<class T> static const void* typeKey()
+    {
+        static const char key = 0;
+        return &key;
+    }
+
+    Isolate* isolate_;
+    unordered_map<const void*, Eternal<ObjectTemplate> > objects_;
+    unordered_map<FunctionCallback, Eternal<FunctionTemplate> > functions_;
+};
+
+    /* The wrapper templates of this isolate, created on first use */
+WrapperRegistry* getWrapperRegistry(Isolate* isolate)
+{
+    IsolateData* data = getIsolateData(isolate);
+    if(data->wrappers == NULL) {
+        data->wrappers = data->Own(new WrapperRegistry(isolate));
+    }
+    return data->wrappers;
+}
+
+    /* A JS object wrapping native, from T's shared template */
+template<class T> Local<Object> wrapNative(Isolate* isolate, T* native)
+{
+    EscapableHandleScope handle_scope(isolate);
+
+    Local<Object> object = getWrapperRegistry(isolate)->Template<T>()->NewInstance();
+    Wrap(object, native);
+    return handle_scope.Escape(object);
+}
+
+    /* An array of count wrappers, one per native, built in one pass */
+template<class T> Local<Array> wrapNatives(Isolate* isolate, T* const* natives, size_t count)
+{
+    EscapableHandleScope handle_scope(isolate);
+
+    Local<ObjectTemplate> templ = getWrapperRegistry(isolate)->Template<T>();
+    Local<Array> array = Array::New(isolate, (int)count);
+
+    for(size_t i = 0; i < count; ++i) {
+        Local<Object> object = templ->NewInstance();
+        Wrap(object, natives[i]);
+        array->Set((uint32_t)i, object);
+    }
+
+    return handle_scope.Escape(array);
+}
@@ -0,0 +1,155 @@
+/*
+    Build a custom startup snapshot for the runners.
+    Usage: ./out/snapshot-builder out/snapshot_blob.bin [prelude.js ...]
+
+    The prelude scripts are run once, here, and the resulting heap is
+    serialized. A runner started with --snapshot=out/snapshot_blob.bin
+    boots with everything they defined already in its context, skipping
+    parsing, compiling and running them on every process start.
+
+    The preludes run in a bare context: print, Point, game and the other
+    bindings are native callbacks, which this V8 can't serialize, so they
+    are installed on top of the blob at boot (see runtime.h). A prelude
+    may define functions that call them later, but may not call them while
+    it runs. The preludes are tried in a bare context first, so a prelude
+    that does gets its exception reported and the build fails.
+
+    After writing the blob it boots both ways, kStartupRuns times each, and
+    prints the median time to a ready context: without the blob and running
+    the prelude from source, against booting from the blob.
+*/
+
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include "include/v8.h"
+#include "include/libplatform/libplatform.h"
+#include "common/runtime.h"
+
+using namespace v8;
+using namespace std;
+
+static const int kStartupRuns = 20;
+
+    /* Median microseconds from nothing to a context ready to run a script.
+       Without a blob the prelude is run from source, as runners did before. */
+static double timeStartup(StartupData* blob, const string& prelude)
+{
+    vector<double> times;
+    for(int i = 0; i < kStartupRuns; ++i) {
+        double start = nowMicros();
+        Isolate* isolate = createIsolate(blob);
+        {
+            Isolate::Scope isolate_scope(isolate);
+            HandleScope handle_scope(isolate);
+
+            Game game;
+            Local<Context> context = createRuntimeContext(isolate, &game);
+            if(blob == NULL && !prelude.empty()) {
+                executeString(isolate, context, newString(isolate, prelude));
+            }
+        }
+        times.push_back(nowMicros() - start);
+        disposeIsolate(isolate);
+    }
+
+    sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+    /* Run the prelude the way the snapshot will, without the bindings.
+       False, with the exception reported, when it throws. */
+static bool preludeRunsBare(const string& prelude)
+{
+    bool ok;
+    Isolate* isolate = createIsolate(NULL);
+    {
+        Isolate::Scope isolate_scope(isolate);
+        HandleScope handle_scope(isolate);
+
+        Local<Context> context = Context::New(isolate);
+        ok = executeString(isolate, context, newString(isolate, prelude), "<prelude>");
+    }
+    disposeIsolate(isolate);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2) {
+        printf("Usage: <snapshot.bin> [prelude.js ...] \n Write a startup snapshot with the preludes baked in.");
+        return 1;
+    }
+
+    //All the preludes end up in one source, run in order
+    string prelude;
+    for(int i = 2; i < argc; ++i) {
+        prelude += fileToString(argv[i]);
+        prelude += "\n;\n";
+    }
+
+    // Initialize V8.
+    V8::InitializeICU();
+    Platform* platform = platform::CreateDefaultPlatform();
+    V8::InitializePlatform(platform);
+    V8::Initialize();
+
+    if(!prelude.empty() && !preludeRunsBare(prelude)) {
+        printf("The prelude failed without the bindings. print, Point, game and the\n"
+               "rest are not in the snapshot, a prelude may only call them from\n"
+               "functions that run after boot.\n");
+        V8::Dispose();
+        V8::ShutdownPlatform();
+        delete platform;
+        return 1;
+    }
+
+    //This creates (and throws away) its own isolate, running the prelude
+    //in a fresh context before serializing the heap.
+    StartupData blob = V8::CreateSnapshotDataBlob(prelude.empty() ? NULL : prelude.c_str());
+
+    int status = 0;
+    if(blob.data == NULL) {
+        printf("Creating the snapshot failed, does the prelude throw?\n");
+        status = 1;
+    } else {
+        FILE* out = fopen(argv[1], "wb");
+        if(!out || fwrite(blob.data, 1, blob.raw_size, out) != (size_t)blob.raw_size) {
+            printf("Could not write %s\n", argv[1]);
+            status = 1;
+        } else {
+            printf("Wrote %d bytes to %s\n", blob.raw_size, argv[1]);
+        }
+        if(out) fclose(out);
+
+        //Make sure the blob boots, and that the bindings install on top of it
+        Isolate* isolate = createIsolate(&blob);
+        {
+            Isolate::Scope isolate_scope(isolate);
+            HandleScope handle_scope(isolate);
+
+            Game game;
+            Local<Context> context = createRuntimeContext(isolate, &game);
+            if(context.IsEmpty()) {
+                printf("The snapshot does not boot!\n");
+                status = 1;
+            }
+        }
+        disposeIsolate(isolate);
+
+        if(status == 0) {
+            double cold = timeStartup(NULL, prelude);
+            double warm = timeStartup(&blob, prelude);
+            printf("startup: default + prelude %.0fus, snapshot %.0fus (median of %d)\n",
+                   cold, warm, kStartupRuns);
+        }
+
+        delete[] blob.data;
+    }
+
+    // Tear down V8.
+    V8::Dispose();
+    V8::ShutdownPlatform();
+    delete platform;
+    return status;
+}